@@ -6,6 +6,7 @@
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <condition_variable>
 #include <ctime>
 #include <iomanip>
@@ -14,8 +15,20 @@
 #include <functional>
 #include <cctype>
 #include <map>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <memory>
 #include <locale>
 #include <cstring>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <string_view>
+#include <optional>
+#include <charconv>
+#include <limits>
 
 // 平台相关头文件和定义
 #if defined(_WIN32)
@@ -24,6 +37,8 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #pragma comment(lib, "ws2_32.lib")
 #define SOCKET_HANDLE SOCKET
 #define CLOSE_SOCKET closesocket
@@ -34,11 +49,16 @@ using ssize_t = long long;
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #define SOCKET_HANDLE int
 #define CLOSE_SOCKET close
 #define INVALID_SOCKET_VALUE (-1)
@@ -46,11 +66,72 @@ using ssize_t = long long;
 #define GET_SOCKET_ERRNO errno
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// 内核头文件足够新（有多次触发的recv，Linux 6.0+）时才编译io_uring引擎
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+#define LAN_HTTP_IO_URING
+#endif
+
+// 定义LAN_HTTP_USE_ZLIB并链接-lz后，可在后台为文本文件生成.gz缓存
+#if defined(LAN_HTTP_USE_ZLIB)
+#include <zlib.h>
+#endif
+
+// x86上按16/32字节块扫描URL（编译时开了AVX2就用256位），其他平台走标量路径
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LAN_HTTP_URL_SIMD 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LAN_HTTP_URL_SIMD 16
+#endif
+
 // 全局配置变量
 int PORT = 80;
 std::string ROOT_DIR = "HTTP";  // 默认网站根目录
 const int BUFFER_SIZE = 4096;
-const int THREAD_POOL_SIZE = 4;
+const size_t FILE_CHUNK_SIZE = 256 * 1024;  // 无法使用sendfile时读文件的缓冲大小
+const size_t MAX_SEND_IOVECS = 16;          // 一次sendmsg最多合并的数据段数
+int THREAD_POOL_SIZE = 0;          // 工作线程数，0表示按CPU核心数
+int LISTENER_COUNT = 1;             // SO_REUSEPORT监听socket（事件循环）的数量，0表示每个CPU核心一个（仅Linux）
+std::string IO_ENGINE = "epoll";    // Linux上的I/O引擎：epoll、uring或blocking（阻塞accept + 线程池）
+size_t MAX_REQUEST_HEADER_SIZE = 64 * 1024;  // 请求行加请求头的总大小上限，超出返回431
+size_t MAX_REQUEST_LINE_SIZE = 8 * 1024;     // 请求行上限，超出返回414
+size_t MAX_HEADER_COUNT = 100;               // 请求头个数上限，超出返回431
+int MAX_QUEUE_DEPTH = 4096;   // 线程池中排队的请求数上限，超出时直接返回503，0表示不限制
+int MAX_QUEUE_WAIT_MS = 2000; // 请求在线程池中排队超过这个时间就不再处理、返回503，0表示不限制
+int BULK_THREADS = 0;         // 大文件传输通道的工作线程数，0表示与普通通道相同
+int BULK_MAX_QUEUE = 4096;    // 大文件传输通道排队的任务数上限，0表示不限制
+int BULK_MIN_KB = 1024;       // 响应体不小于该大小（KB）的请求交给大文件传输通道
+const int RETRY_AFTER_SECONDS = 1;
+const size_t MAX_BYTE_RANGES = 32;  // 一个Range请求最多的区间数，超过则返回完整文件
+int KEEP_ALIVE_TIMEOUT = 5;         // 长连接空闲超时（秒），0表示不保持连接
+int HEADER_TIMEOUT = 10;            // 收完请求头的期限（秒），从连接建立或收到请求的第一个字节起算，0表示不限制
+int SEND_TIMEOUT = 30;              // 发送响应时两次写出进展之间的最长间隔（秒），0表示不限制
+int MAX_KEEP_ALIVE_REQUESTS = 100;  // 每个长连接最多处理的请求数
+int HOT_CACHE_MB = 64;              // 热点小文件缓存大小（MB），0表示关闭
+const size_t HOT_CACHE_MAX_FILE = 256 * 1024;  // 超过该大小的文件不进缓存
+int LISTING_CACHE_MB = 32;          // 目录列表页面缓存大小（MB），0表示关闭
+int FD_CACHE_ENTRIES = 1024;        // 文件描述符和元数据缓存的条目数，0表示关闭
+std::string GZIP_CACHE_DIR;         // 后台生成的.gz文件存放目录，为空表示不生成
+const long long GZIP_MIN_SIZE = 256;  // 小于该大小的文件不值得压缩
+const long long GZIP_MAX_SIZE = 256LL * 1024 * 1024;  // 大于该大小的文件不在后台生成.gz
+const long long COMPRESS_MIN_SIZE = 1024;  // 小于该大小的响应不做即时压缩
 
 // 初始化网络库（仅Windows需要）
 void init_networking() {
@@ -69,56 +150,608 @@ void cleanup_networking() {
 #endif
 }
 
-// 线程池类
-class ThreadPool {
+// 只由一个线程写入的计数：写入方直接读出再写回，不需要原子的读-改-写，其他线程随时可以读取
+template<class T>
+class LocalCounter {
 public:
-    ThreadPool(size_t threads) : stop(false) {
-        for (size_t i = 0; i < threads; ++i) {
-            workers.emplace_back([this] {
-                while (true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock, [this] {
-                            return this->stop || !this->tasks.empty();
-                            });
-                        if (this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-                    task();
+    void add(T n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    T load() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<T> value{ 0 };
+};
+
+// HDR风格的延迟直方图（纳秒）：每个2的幂区间再均分成8个子桶，相对误差不超过12.5%。
+// 覆盖到2^40纳秒（约18分钟），更大的值记在最后一个桶。同样只由一个线程写入
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int MAX_EXPONENT = 40;
+    static constexpr int BUCKET_COUNT = (MAX_EXPONENT - SUB_BITS + 1) * SUB_COUNT;
+
+    static int bucket_of(uint64_t ns) {
+        if (ns < SUB_COUNT) return static_cast<int>(ns);
+        int exponent = 0;  // 最高位的位置
+        for (int shift = 32; shift > 0; shift >>= 1) {
+            if (ns >> (exponent + shift)) exponent += shift;
+        }
+        if (exponent >= MAX_EXPONENT) return BUCKET_COUNT - 1;
+        int sub = static_cast<int>(ns >> (exponent - SUB_BITS)) & (SUB_COUNT - 1);
+        return (exponent - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    // 桶内的最大值，估算分位数时取这个值（偏保守）
+    static uint64_t bucket_upper(int bucket) {
+        if (bucket < SUB_COUNT) return static_cast<uint64_t>(bucket);
+        int exponent = bucket / SUB_COUNT + SUB_BITS - 1;
+        uint64_t sub = static_cast<uint64_t>(bucket % SUB_COUNT);
+        return ((SUB_COUNT + sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t ns) {
+        counts[bucket_of(ns)].add(1);
+        sum_ns.add(ns);
+    }
+
+    LocalCounter<uint64_t> counts[BUCKET_COUNT];
+    LocalCounter<uint64_t> sum_ns;
+};
+
+// 多个线程的直方图合并后的结果
+struct HistogramSnapshot {
+    uint64_t counts[LatencyHistogram::BUCKET_COUNT] = {};
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+
+    void merge(const LatencyHistogram& histogram) {
+        for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+            uint64_t n = histogram.counts[i].load();
+            counts[i] += n;
+            count += n;
+        }
+        sum_ns += histogram.sum_ns.load();
+    }
+
+    // 第q分位（0~1）所在桶的上界
+    uint64_t quantile(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LatencyHistogram::BUCKET_COUNT; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return LatencyHistogram::bucket_upper(i);
+        }
+        return LatencyHistogram::bucket_upper(LatencyHistogram::BUCKET_COUNT - 1);
+    }
+
+    // 小于2^exponent纳秒的记录数（2的幂正好是桶的边界）
+    uint64_t count_below_power(int exponent) const {
+        int end = std::min((exponent - LatencyHistogram::SUB_BITS + 1) * LatencyHistogram::SUB_COUNT,
+            LatencyHistogram::BUCKET_COUNT);
+        uint64_t total = 0;
+        for (int i = 0; i < end; ++i) total += counts[i];
+        return total;
+    }
+};
+
+// 请求按路由分类统计
+enum class RouteKind { Static, Download, Listing, NotFound, Other };
+const int ROUTE_KIND_COUNT = 5;
+const char* const ROUTE_KIND_NAMES[ROUTE_KIND_COUNT] = { "static", "download", "listing", "not_found", "other" };
+
+// 过载时拒绝请求的原因
+enum class RejectReason { QueueFull, QueueTimeout };
+const int REJECT_REASON_COUNT = 2;
+const char* const REJECT_REASON_NAMES[REJECT_REASON_COUNT] = { "queue_full", "queue_timeout" };
+
+// 执行通道：小文件和缓存命中的响应走低延迟通道，大文件下载走大文件传输通道，
+// 两者各有自己的线程池，大下载占满线程时小请求不用排在后面
+enum class Lane { Latency, Bulk };
+const int LANE_COUNT = 2;
+const char* const LANE_NAMES[LANE_COUNT] = { "latency", "bulk" };
+
+// 连接的超时期限：收请求头、发送响应、长连接空闲
+enum class TimeoutKind { Header, Send, Idle };
+const int TIMEOUT_KIND_COUNT = 3;
+const char* const TIMEOUT_KIND_NAMES[TIMEOUT_KIND_COUNT] = { "header", "send", "idle" };
+
+// 一个线程的全部统计，只由该线程写入
+struct ThreadMetrics {
+    LocalCounter<uint64_t> requests[ROUTE_KIND_COUNT];
+    LocalCounter<uint64_t> bytes[ROUTE_KIND_COUNT];
+    LatencyHistogram latency[ROUTE_KIND_COUNT];  // 解析完请求到响应发送完毕
+    LocalCounter<uint64_t> status_classes[5];    // 1xx~5xx
+    LocalCounter<uint64_t> aborted;              // 发送中途连接断开的响应
+    LocalCounter<uint64_t> rejected[REJECT_REASON_COUNT];  // 过载时直接回复503的请求
+    LocalCounter<uint64_t> timeouts[TIMEOUT_KIND_COUNT];   // 超时被关闭的连接
+    LocalCounter<int64_t> connections;           // 本线程接受的连接数减去关闭的连接数，各线程相加为当前连接数
+    LatencyHistogram queue_wait[LANE_COUNT];     // 任务在各通道线程池中排队的时间
+    LatencyHistogram handler_time;               // 工作线程生成响应（stat、open、目录遍历等）的时间
+};
+
+// 统计注册表：每个线程第一次记录时注册自己的统计块，之后的写入不加锁、不与其他线程共享缓存行。
+// /__stats读取时把所有线程的统计块相加
+class MetricsRegistry {
+public:
+    ThreadMetrics& local() {
+        thread_local ThreadMetrics* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocks.emplace_back(new ThreadMetrics());
+            mine = blocks.back().get();
+        }
+        return *mine;
+    }
+
+    // 遍历所有线程的统计块；线程退出后统计块仍然保留，计数不会丢失
+    template<class F>
+    void for_each(F&& f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& block : blocks) f(*block);
+    }
+
+    std::function<size_t(Lane)> queue_depth;  // 由run_server设置为各通道线程池的排队长度
+    std::function<uint64_t(Lane)> node_fallbacks;  // 各通道节点池耗尽后堆分配的任务节点数
+    size_t lane_workers[LANE_COUNT] = {};     // 各通道的工作线程数
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadMetrics>> blocks;
+};
+
+MetricsRegistry metrics;
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - since).count());
+}
+
+// 线程池任务：可调用对象直接构造在节点内部的固定缓冲中，不像std::function那样单独分配内存。
+// 节点来自预先分配的节点池，用完后归还
+// 放得下事件循环提交的请求任务（this、连接指针和一个HttpRequest），节点正好占4个缓存行
+const size_t TASK_INLINE_SIZE = 224;
+
+struct TaskNode {
+    alignas(std::max_align_t) unsigned char storage[TASK_INLINE_SIZE];
+    void (*run_and_destroy)(void*) = nullptr;
+    void (*destroy)(void*) = nullptr;      // 提交失败时只析构、不执行
+    std::atomic<uint32_t> next_free{ 0 };  // 空闲链表中下一个节点的编号+1，0表示没有
+    bool pooled = false;                   // 节点池耗尽时临时new出的节点为false
+    std::chrono::steady_clock::time_point enqueued;  // 提交时间，统计排队等待
+
+    template<class F>
+    void set(F&& f) {
+        using Fn = typename std::decay<F>::type;
+        static_assert(sizeof(Fn) <= TASK_INLINE_SIZE, "task capture too large for TaskNode");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "task capture over-aligned");
+        new (storage) Fn(std::forward<F>(f));
+        run_and_destroy = [](void* p) {
+            Fn* fn = static_cast<Fn*>(p);
+            (*fn)();
+            fn->~Fn();
+        };
+        destroy = [](void* p) { static_cast<Fn*>(p)->~Fn(); };
+    }
+
+    void run() { run_and_destroy(storage); }
+    void discard() { destroy(storage); }
+};
+
+// 固定数量的任务节点，空闲链表为无锁栈；栈顶带版本号，避免ABA问题
+class TaskNodePool {
+public:
+    explicit TaskNodePool(uint32_t capacity) : nodes(new TaskNode[capacity]) {
+        for (uint32_t i = 0; i < capacity; ++i) {
+            nodes[i].pooled = true;
+            nodes[i].next_free.store(i + 1 < capacity ? i + 2 : 0, std::memory_order_relaxed);
+        }
+        head.store(capacity > 0 ? 1 : 0, std::memory_order_relaxed);
+    }
+
+    TaskNode* acquire() {
+        uint64_t old_head = head.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t index = static_cast<uint32_t>(old_head);
+            if (index == 0) {
+                // 节点池耗尽（排队任务过多）时退回堆分配，计数在/__stats中可见
+                fallbacks.fetch_add(1, std::memory_order_relaxed);
+                return new TaskNode();
+            }
+            uint32_t next = nodes[index - 1].next_free.load(std::memory_order_relaxed);
+            uint64_t new_head = ((old_head >> 32) + 1) << 32 | next;
+            if (head.compare_exchange_weak(old_head, new_head, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return &nodes[index - 1];
+            }
+        }
+    }
+
+    void release(TaskNode* node) {
+        if (!node->pooled) {
+            delete node;
+            return;
+        }
+        uint32_t index = static_cast<uint32_t>(node - nodes.get()) + 1;
+        uint64_t old_head = head.load(std::memory_order_relaxed);
+        while (true) {
+            node->next_free.store(static_cast<uint32_t>(old_head), std::memory_order_relaxed);
+            uint64_t new_head = ((old_head >> 32) + 1) << 32 | index;
+            if (head.compare_exchange_weak(old_head, new_head, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+    // 节点池耗尽后堆分配的节点数
+    uint64_t fallback_count() const { return fallbacks.load(std::memory_order_relaxed); }
+
+private:
+    std::unique_ptr<TaskNode[]> nodes;
+    std::atomic<uint64_t> head{ 0 };  // 高32位为版本号，低32位为节点编号+1
+    std::atomic<uint64_t> fallbacks{ 0 };
+};
+
+// 有界多生产者多消费者无锁队列（Vyukov），用作线程池的注入队列和访问日志的环形缓冲
+template<class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity_pow2) : mask(capacity_pow2 - 1), cells(new Cell[capacity_pow2]) {
+        for (size_t i = 0; i < capacity_pow2; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // 队列已满时返回false
+    bool push(const T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
                 }
-                });
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // 队列为空时返回false
+    bool pop(T& value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value{};
+    };
+
+    size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    alignas(64) std::atomic<size_t> head{ 0 };
+};
+
+// Chase-Lev工作窃取双端队列（固定容量，创建线程池时确定）：所属线程在底部push/take，其他线程从顶部steal
+class WorkStealingDeque {
+public:
+    // 容量必须是2的幂，在使用前调用一次
+    void init(int64_t capacity_pow2) {
+        capacity = capacity_pow2;
+        buffer.reset(new std::atomic<TaskNode*>[static_cast<size_t>(capacity_pow2)]);
+    }
+
+    bool push(TaskNode* node) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= capacity) return false;
+        buffer[b & (capacity - 1)].store(node, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    TaskNode* take() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        TaskNode* node = buffer[b & (capacity - 1)].load(std::memory_order_relaxed);
+        if (t == b) {
+            // 只剩最后一个，与窃取者竞争
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                node = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    TaskNode* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        TaskNode* node = buffer[t & (capacity - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;  // 被其他线程抢先
+        }
+        return node;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+    // 只由所属线程调用：top只会增大，这里看到未满时接下来的push一定成功
+    bool full() const {
+        return bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_acquire) >= capacity;
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> top{ 0 };
+    alignas(64) std::atomic<int64_t> bottom{ 0 };
+    int64_t capacity = 0;
+    std::unique_ptr<std::atomic<TaskNode*>[]> buffer;
+};
+
+// 工作窃取线程池：外部线程（事件循环）提交的任务进入无锁注入队列，工作线程从中取任务时
+// 顺带搬一小批到自己的双端队列；工作线程内部提交的任务直接进自己的队列。
+// 自己的队列空了就从注入队列取，再空就随机从其他线程的队列窃取。只有全部空闲时才用锁休眠。
+// 节点池、注入队列和每个双端队列都按排队上限max_queued确定大小：排队的任务不超过上限时，
+// 提交不会退回堆分配，也不会因队列满而失败。max_queued为0（不限制）时用默认大小
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads, Lane pool_lane = Lane::Latency, size_t max_queued = 0)
+        : node_pool(node_capacity(threads, max_queued)),
+          injection(injection_capacity(threads, max_queued)),
+          deques(new WorkStealingDeque[std::max<size_t>(threads, 1)]),
+          worker_count(std::max<size_t>(threads, 1)), lane(pool_lane) {
+        int64_t deque_capacity = static_cast<int64_t>(std::max<size_t>(injection_capacity(threads, max_queued), 1024));
+        for (size_t i = 0; i < worker_count; ++i) deques[i].init(deque_capacity);
+        for (size_t i = 0; i < worker_count; ++i) {
+            workers.emplace_back([this, i] { worker_loop(i); });
         }
     }
 
+    // 排队的任务数已达max_queued（0表示不限制）或注入队列已满时不提交，返回false，
+    // 由调用方决定怎么办（回复503等），提交方从不等待。多个线程同时提交时可能略微超出上限
     template<class F>
-    void enqueue(F&& f) {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace(std::forward<F>(f));
+    bool try_enqueue(F&& f, size_t max_queued) {
+        if (max_queued > 0 && queued.load(std::memory_order_relaxed) >= max_queued) return false;
+        TaskNode* node = node_pool.acquire();
+        node->set(std::forward<F>(f));
+        node->enqueued = std::chrono::steady_clock::now();
+        queued.fetch_add(1, std::memory_order_seq_cst);
+
+        // 工作线程提交的任务放进自己的队列，放不下或外部线程提交的进注入队列
+        bool local = current_pool == this && deques[current_worker].push(node);
+        if (!local && !injection.push(node)) {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            node->discard();
+            node_pool.release(node);
+            return false;
         }
-        condition.notify_one();
+        wake_one();
+        return true;
     }
 
+    // 当前执行的任务是什么时候提交的（只在线程池的任务中有意义）
+    static std::chrono::steady_clock::time_point current_task_enqueued() {
+        return current_enqueued;
+    }
+
+    // 排队等待执行的任务数
+    size_t queue_depth() const {
+        return queued.load(std::memory_order_relaxed);
+    }
+
+    size_t size() const { return worker_count; }
+
+    // 节点池耗尽后堆分配的任务节点数，排队上限内应当一直是0
+    uint64_t node_fallbacks() const { return node_pool.fallback_count(); }
+
     ~ThreadPool() {
         {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            stop = true;
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stop.store(true);
         }
-        condition.notify_all();
+        sleep_condition.notify_all();
         for (std::thread& worker : workers) {
             if (worker.joinable()) worker.join();
         }
     }
 
 private:
+    static const int INJECTION_BATCH = 8;  // 从注入队列取任务时额外搬到本地队列的数量
+
+    // 排队上限加上正在执行的任务，再留出多个线程同时通过上限检查时的余量
+    static uint32_t node_capacity(size_t threads, size_t max_queued) {
+        if (max_queued == 0) return 4096;
+        return static_cast<uint32_t>(std::min<size_t>(max_queued + std::max<size_t>(threads, 1) + 256, 1u << 18));
+    }
+
+    // 注入队列（以及双端队列）的容量：不小于节点数的2的幂，节点用完之前队列不会满
+    static size_t injection_capacity(size_t threads, size_t max_queued) {
+        if (max_queued == 0) return 1 << 16;
+        size_t pow2 = 1;
+        while (pow2 < node_capacity(threads, max_queued)) pow2 <<= 1;
+        return pow2;
+    }
+
+    TaskNode* find_task(size_t self, uint32_t& rng) {
+        TaskNode* node = deques[self].take();
+        if (node) return node;
+
+        if (injection.pop(node)) {
+            // 本地队列有空位时才取，取出的一定放得下，不用再放回注入队列
+            for (int i = 0; i < INJECTION_BATCH && !deques[self].full(); ++i) {
+                TaskNode* extra;
+                if (!injection.pop(extra)) break;
+                deques[self].push(extra);
+            }
+            // 本地队列有了任务，叫醒一个线程来窃取
+            if (!deques[self].empty()) wake_one();
+            return node;
+        }
+
+        // 从随机位置开始依次尝试窃取
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        size_t start = rng % worker_count;
+        for (size_t i = 0; i < worker_count; ++i) {
+            size_t victim = (start + i) % worker_count;
+            if (victim == self) continue;
+            node = deques[victim].steal();
+            if (node) return node;
+        }
+        return nullptr;
+    }
+
+    // queued在任务放进队列之前就已加一，这里看到0说明确实没有待执行的任务
+    bool has_work() const {
+        return queued.load(std::memory_order_seq_cst) > 0;
+    }
+
+    void worker_loop(size_t self) {
+        current_pool = this;
+        current_worker = self;
+        uint32_t rng = static_cast<uint32_t>(self) * 2654435761u + 1;
+        int idle_spins = 0;
+        ThreadMetrics& stats = metrics.local();
+
+        while (true) {
+            TaskNode* node = find_task(self, rng);
+            if (node) {
+                idle_spins = 0;
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                stats.queue_wait[static_cast<int>(lane)].record(elapsed_ns(node->enqueued));
+                current_enqueued = node->enqueued;
+                node->run();
+                node_pool.release(node);
+                continue;
+            }
+
+            // 短暂自旋后再休眠，减少频繁唤醒的开销
+            if (++idle_spins < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+            idle_spins = 0;
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeping.fetch_add(1, std::memory_order_seq_cst);
+            // 计数加一之后再检查一次，和wake_one配合保证不会漏掉刚提交的任务
+            if (!has_work()) {
+                if (stop.load()) {
+                    sleeping.fetch_sub(1, std::memory_order_seq_cst);
+                    return;
+                }
+                sleep_condition.wait(lock);
+            }
+            sleeping.fetch_sub(1, std::memory_order_seq_cst);
+        }
+    }
+
+    void wake_one() {
+        if (sleeping.load(std::memory_order_seq_cst) == 0) return;
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        sleep_condition.notify_one();
+    }
+
+    TaskNodePool node_pool;
+    BoundedQueue<TaskNode*> injection;
+    std::unique_ptr<WorkStealingDeque[]> deques;
+    size_t worker_count;
+    Lane lane;
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
+    std::atomic<size_t> queued{ 0 };
+    std::atomic<int> sleeping{ 0 };
+    std::atomic<bool> stop{ false };
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_condition;
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local size_t current_worker;
+    static thread_local std::chrono::steady_clock::time_point current_enqueued;
+};
+
+thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local size_t ThreadPool::current_worker = 0;
+thread_local std::chrono::steady_clock::time_point ThreadPool::current_enqueued = std::chrono::steady_clock::time_point::max();
+
+// 当前任务在线程池中排队是否已超过MAX_QUEUE_WAIT_MS：这时客户端多半已经超时，不必再处理
+bool queue_wait_expired() {
+    if (MAX_QUEUE_WAIT_MS <= 0) return false;
+    auto now = std::chrono::steady_clock::now();
+    auto enqueued = ThreadPool::current_task_enqueued();
+    return now > enqueued && now - enqueued > std::chrono::milliseconds(MAX_QUEUE_WAIT_MS);
+}
+
+// 工作线程数：未指定时按CPU核心数，至少2个（工作线程会阻塞在文件操作上）
+size_t worker_thread_count() {
+    if (THREAD_POOL_SIZE > 0) return static_cast<size_t>(THREAD_POOL_SIZE);
+    return std::max<size_t>(2, std::thread::hardware_concurrency());
+}
+
+size_t bulk_thread_count() {
+    if (BULK_THREADS > 0) return static_cast<size_t>(BULK_THREADS);
+    return worker_thread_count();
+}
+
+long long bulk_min_size() {
+    return static_cast<long long>(BULK_MIN_KB) * 1024;
+}
+
+// 两个执行通道的线程池，按通道取对应的线程池和排队上限
+struct WorkerLanes {
+    WorkerLanes(size_t latency_threads, size_t bulk_threads)
+        : latency(latency_threads, Lane::Latency, max_queued(Lane::Latency)),
+          bulk(bulk_threads, Lane::Bulk, max_queued(Lane::Bulk)) {}
+
+    ThreadPool& operator[](Lane lane) { return lane == Lane::Bulk ? bulk : latency; }
+
+    static size_t max_queued(Lane lane) {
+        int limit = lane == Lane::Bulk ? BULK_MAX_QUEUE : MAX_QUEUE_DEPTH;
+        return static_cast<size_t>(std::max(limit, 0));
+    }
+
+    size_t queue_depth() const { return latency.queue_depth() + bulk.queue_depth(); }
+
+    ThreadPool latency;
+    ThreadPool bulk;
 };
 
 // 安全的gmtime实现（解决C4996警告）
@@ -134,45 +767,281 @@ std::tm safe_gmtime(const time_t* time) {
 #endif
 }
 
-// 获取当前时间的GMT字符串
-std::string get_gmt_time() {
+const size_t HTTP_DATE_LENGTH = 29;  // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+// 格式化为HTTP日期（RFC 7231 IMF-fixdate），写入HTTP_DATE_LENGTH个字符和结尾的\0。
+// 不用strftime：星期和月份名与locale无关
+void write_http_date(std::time_t time, char* out) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    std::tm gmt_tm = safe_gmtime(&time);
+    auto two_digits = [](char* dest, int value) {
+        dest[0] = static_cast<char>('0' + value / 10);
+        dest[1] = static_cast<char>('0' + value % 10);
+    };
+    std::memcpy(out, days + gmt_tm.tm_wday * 3, 3);
+    std::memcpy(out + 3, ", ", 2);
+    two_digits(out + 5, gmt_tm.tm_mday);
+    out[7] = ' ';
+    std::memcpy(out + 8, months + gmt_tm.tm_mon * 3, 3);
+    out[11] = ' ';
+    int year = gmt_tm.tm_year + 1900;
+    two_digits(out + 12, year / 100 % 100);
+    two_digits(out + 14, year % 100);
+    out[16] = ' ';
+    two_digits(out + 17, gmt_tm.tm_hour);
+    out[19] = ':';
+    two_digits(out + 20, gmt_tm.tm_min);
+    out[22] = ':';
+    two_digits(out + 23, gmt_tm.tm_sec);
+    std::memcpy(out + 25, " GMT", 5);
+}
+
+std::string format_http_date(std::time_t time) {
+    char buffer[HTTP_DATE_LENGTH + 1];
+    write_http_date(time, buffer);
+    return std::string(buffer, HTTP_DATE_LENGTH);
+}
+
+// 当前时间的HTTP日期，每个线程每秒只格式化一次，不需要加锁
+const char* current_http_date() {
+    thread_local std::time_t cached_second = -1;
+    thread_local char cached[HTTP_DATE_LENGTH + 1];
     std::time_t now = std::time(nullptr);
-    std::tm gmt_tm = safe_gmtime(&now);
-    char buffer[80];
-    std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &gmt_tm);
-    return std::string(buffer);
-}
-
-// URL解码函数 - 支持UTF-8
-std::string url_decode(const std::string& str) {
-    std::string bytes;
-    bytes.reserve(str.size());
-
-    for (size_t i = 0; i < str.size(); ++i) {
-        if (str[i] == '%') {
-            if (i + 2 < str.size()) {
-                int value = 0;
-                std::istringstream is(str.substr(i + 1, 2));
-                if (is >> std::hex >> value) {
-                    bytes += static_cast<char>(value);
-                    i += 2;
+    if (now != cached_second) {
+        write_http_date(now, cached);
+        cached_second = now;
+    }
+    return cached;
+}
+
+// URL解码结果：格式错误回400，危险路径回403
+enum class UrlStatus { Ok, BadRequest, Forbidden };
+
+struct HexTable {
+    uint8_t values[256] = {};
+};
+
+// 十六进制字符到数值，非法字符为0xFF
+constexpr HexTable build_hex_table() {
+    HexTable table{};
+    for (int c = 0; c < 256; ++c) {
+        if (c >= '0' && c <= '9') table.values[c] = static_cast<uint8_t>(c - '0');
+        else if (c >= 'a' && c <= 'f') table.values[c] = static_cast<uint8_t>(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') table.values[c] = static_cast<uint8_t>(c - 'A' + 10);
+        else table.values[c] = 0xFF;
+    }
+    return table;
+}
+
+constexpr HexTable HEX_TABLE = build_hex_table();
+
+// 逐字节检查解码后的路径：UTF-8必须合法（拒绝过长编码、代理区和超过U+10FFFF的码点），
+// 不允许控制字符、反斜杠、空段（//）以及"."和".."段
+struct PathValidator {
+    size_t seg_len = 0;     // 当前段的字节数
+    size_t seg_dots = 0;    // 当前段中'.'的个数，等于seg_len时整段都是点
+    int utf8_need = 0;      // 当前字符还缺几个后续字节
+    uint8_t utf8_lo = 0x80; // 下一个后续字节的取值范围
+    uint8_t utf8_hi = 0xBF;
+    bool leading = true;    // 还没有输出任何字节
+
+    bool dot_segment() const {
+        return seg_len > 0 && seg_len <= 2 && seg_dots == seg_len;
+    }
+
+    UrlStatus push(uint8_t c) {
+        bool first = leading;
+        leading = false;
+        if (utf8_need > 0) {
+            if (c < utf8_lo || c > utf8_hi) return UrlStatus::BadRequest;
+            utf8_lo = 0x80;
+            utf8_hi = 0xBF;
+            --utf8_need;
+            ++seg_len;
+            return UrlStatus::Ok;
+        }
+        if (c >= 0x80) {
+            if (c >= 0xC2 && c <= 0xDF) {
+                utf8_need = 1;
+            }
+            else if (c >= 0xE0 && c <= 0xEF) {
+                utf8_need = 2;
+                if (c == 0xE0) utf8_lo = 0xA0;       // 过长编码
+                else if (c == 0xED) utf8_hi = 0x9F;  // 代理区
+            }
+            else if (c >= 0xF0 && c <= 0xF4) {
+                utf8_need = 3;
+                if (c == 0xF0) utf8_lo = 0x90;       // 过长编码
+                else if (c == 0xF4) utf8_hi = 0x8F;  // 超过U+10FFFF
+            }
+            else {
+                return UrlStatus::BadRequest;
+            }
+            ++seg_len;
+            return UrlStatus::Ok;
+        }
+        if (c < 0x20 || c == 0x7F) return UrlStatus::BadRequest;
+        if (c == '\\') return UrlStatus::Forbidden;
+        if (c == '/') {
+            if (dot_segment() || (seg_len == 0 && !first)) return UrlStatus::Forbidden;
+            seg_len = 0;
+            seg_dots = 0;
+            return UrlStatus::Ok;
+        }
+        if (c == '.') ++seg_dots;
+        ++seg_len;
+        return UrlStatus::Ok;
+    }
+
+    UrlStatus finish() const {
+        if (utf8_need > 0) return UrlStatus::BadRequest;
+        if (dot_segment()) return UrlStatus::Forbidden;
+        return UrlStatus::Ok;
+    }
+};
+
+#if defined(LAN_HTTP_URL_SIMD)
+constexpr size_t URL_BLOCK = LAN_HTTP_URL_SIMD;
+
+// 一个块的位图：需要逐字节处理的字节（%、+、\、控制字符和非ASCII）、'/'和'.'
+struct UrlBlock {
+    uint32_t special;
+    uint32_t slash;
+    uint32_t dot;
+};
+
+inline UrlBlock classify_url_block(const char* p) {
+#if LAN_HTTP_URL_SIMD == 32
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    // 有符号比较，小于0x20的控制字符和0x80以上的字节一起命中
+    __m256i special = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v);
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')));
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+    return {
+        static_cast<uint32_t>(_mm256_movemask_epi8(special)),
+        static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')))),
+        static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))))
+    };
+#else
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i special = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+    return {
+        static_cast<uint32_t>(_mm_movemask_epi8(special)),
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')))),
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.'))))
+    };
+#endif
+}
+
+inline unsigned highest_bit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return 31u - static_cast<unsigned>(__builtin_clz(mask));
+#endif
+}
+#endif
+
+// URL解码并在同一遍里校验路径。按块找需要处理的字节，干净的块整块复制，
+// %XX查表解码。只处理路径部分，查询串先由target_path拆掉
+UrlStatus url_decode(std::string_view target, std::string& out) {
+    const char* src = target.data();
+    size_t n = target.size();
+    out.resize(n);  // 解码后不会变长
+    char* dst = &out[0];
+    size_t i = 0;
+    size_t len = 0;
+    PathValidator path;
+#if defined(LAN_HTTP_URL_SIMD)
+    size_t scalar_run = URL_BLOCK;  // 连续遇到要逐字节处理的块时加倍，%XX密集的中文路径少做无用的扫描
+#endif
+
+    while (i < n) {
+        size_t scalar_end = n;
+#if defined(LAN_HTTP_URL_SIMD)
+        if (n - i >= URL_BLOCK) {
+            UrlBlock block = classify_url_block(src + i);
+            // 段首（'/'之后，或当前段还是空的）出现'/'或'.'，
+            // 或者带进来的段全是点，都交给逐字节检查；路径开头的'/'除外
+            uint32_t seg_start = (block.slash << 1) | (path.seg_len == 0 ? 1u : 0u);
+            uint32_t seg_start_bad = seg_start & (block.slash | block.dot);
+            if (path.leading) seg_start_bad &= ~(block.slash & 1u);
+            if (block.special == 0 && path.utf8_need == 0 && seg_start_bad == 0 &&
+                !(path.seg_len > 0 && path.seg_dots == path.seg_len)) {
+                if (block.slash != 0) {
+                    path.seg_len = URL_BLOCK - 1 - highest_bit(block.slash);
+                    path.seg_dots = 0;
                 }
                 else {
-                    bytes += str[i];
+                    path.seg_len += URL_BLOCK;
                 }
+                path.leading = false;
+                std::memcpy(dst + len, src + i, URL_BLOCK);
+                len += URL_BLOCK;
+                i += URL_BLOCK;
+                scalar_run = URL_BLOCK;
+                continue;
+            }
+            scalar_end = std::min(n, i + scalar_run);
+            scalar_run = std::min(scalar_run * 2, URL_BLOCK * 8);
+        }
+#endif
+        while (i < scalar_end) {
+            uint8_t c = static_cast<uint8_t>(src[i]);
+            if (c == '%') {
+                if (n - i < 3) return UrlStatus::BadRequest;
+                uint8_t hi = HEX_TABLE.values[static_cast<uint8_t>(src[i + 1])];
+                uint8_t lo = HEX_TABLE.values[static_cast<uint8_t>(src[i + 2])];
+                if ((hi | lo) > 0x0F) return UrlStatus::BadRequest;
+                c = static_cast<uint8_t>((hi << 4) | lo);
+                i += 3;
             }
             else {
-                bytes += str[i];
+                ++i;
+                if (c == '+') c = ' ';
             }
+            UrlStatus status = path.push(c);
+            if (status != UrlStatus::Ok) return status;
+            dst[len++] = static_cast<char>(c);
         }
-        else if (str[i] == '+') {
-            bytes += ' ';
-        }
-        else {
-            bytes += str[i];
+    }
+    out.resize(len);
+    return path.finish();
+}
+
+// 请求目标中'?'之前的路径部分
+std::string_view target_path(std::string_view target) {
+    return target.substr(0, target.find('?'));
+}
+
+// 请求目标中'?'之后的查询串，没有时为空
+std::string_view target_query(std::string_view target) {
+    size_t question = target.find('?');
+    return question == std::string_view::npos ? std::string_view() : target.substr(question + 1);
+}
+
+// 查询串中参数的原始值（不解码），不存在时返回空
+std::optional<std::string_view> query_param(std::string_view query, std::string_view name) {
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view item = query.substr(0, amp);
+        size_t eq = item.find('=');
+        if (item.substr(0, eq) == name) {
+            return eq == std::string_view::npos ? std::string_view() : item.substr(eq + 1);
         }
+        if (amp == std::string_view::npos) break;
+        query.remove_prefix(amp + 1);
     }
-    return bytes;
+    return std::nullopt;
 }
 
 // 生成RFC 5987兼容的文件名
@@ -196,61 +1065,712 @@ std::string generate_content_disposition(const std::string& filename) {
     return oss.str();
 }
 
-// 发送HTTP响应
-void send_response(SOCKET_HANDLE client_socket, const std::string& status,
-    const std::string& content_type, const std::string& content,
-    const std::string& headers = "") {
-    std::ostringstream response;
-    response << "HTTP/1.1 " << status << "\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << content.length() << "\r\n";
-    response << "Connection: close\r\n";
-    response << "Date: " << get_gmt_time() << "\r\n";
-    if (!headers.empty()) {
-        response << headers;
+// 已打开的只读文件，最后一个引用释放时关闭
+struct FileHandle {
+    int fd;
+    explicit FileHandle(int file_fd) : fd(file_fd) {}
+    ~FileHandle() {
+#if defined(_WIN32)
+        _close(fd);
+#else
+        close(fd);
+#endif
     }
-    response << "\r\n";
-    response << content;
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+};
 
-    std::string response_str = response.str();
-    send(client_socket, response_str.c_str(), static_cast<int>(response_str.size()), 0);
+enum class StreamStatus { More, Done, Error };
+
+// 边生成边发送的响应体（如即时压缩），长度事先未知。
+// next可能读文件、压缩或遍历目录，只在工作线程中调用：事件循环把每一块的生成交给线程池
+class BodyStream {
+public:
+    virtual ~BodyStream() {}
+    // 把下一段已编码好的数据追加到out；最后一段返回Done，源数据出错返回Error
+    virtual StreamStatus next(std::string& out) = 0;
+    // 预计输出的字节数，未知时返回-1，用于选择执行通道
+    virtual long long expected_size() const { return -1; }
+};
+
+// 响应体分段：内存数据（自有或与缓存共享）、文件中的一段区间，或生成中的数据流
+struct BodySegment {
+    std::string data;
+    std::shared_ptr<const std::string> shared_data;
+    std::shared_ptr<FileHandle> file;
+    long long offset = 0;
+    long long length = 0;
+    std::shared_ptr<BodyStream> stream;
+
+    const std::string& bytes() const { return shared_data ? *shared_data : data; }
+    long long size() const { return file ? length : static_cast<long long>(bytes().size()); }
+};
+
+// 追加一个chunked编码的数据块：十六进制长度 CRLF 数据 CRLF。长度为0的块表示结束，由调用方单独写
+void append_chunk(std::string& out, std::string_view data) {
+    if (data.empty()) return;
+    char digits[16];
+    auto result = std::to_chars(digits, digits + sizeof(digits), data.size(), 16);
+    out.append(digits, static_cast<size_t>(result.ptr - digits));
+    out += "\r\n";
+    out.append(data);
+    out += "\r\n";
+}
+
+// 不区分大小写比较
+bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+            return false;
+    }
+    return true;
+}
+
+// 逗号分隔的列表头部（如Connection）中是否含有某个选项，不区分大小写
+bool header_has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        size_t start = item.find_first_not_of(" \t");
+        size_t end = item.find_last_not_of(" \t");
+        if (start != std::string_view::npos && equals_ignore_case(item.substr(start, end - start + 1), token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// HTTP请求（只保留处理需要的部分）。
+// 请求头原文只复制一次到header_block，各个头部只记录偏移，复制请求（交给线程池）时不会失效
+struct HttpRequest {
+    struct HeaderField {
+        uint32_t name_offset;
+        uint32_t name_length;
+        uint32_t value_offset;
+        uint32_t value_length;
+    };
+
+    std::string method;
+    std::string target;
+    std::string version;
+    std::string header_block;
+    std::vector<HeaderField> headers;
+    std::string path;                        // 解码后的路径（不含查询串），解析完成时只解码一次
+    UrlStatus path_status = UrlStatus::Ok;   // 解码结果，不是Ok时path无效
+
+    std::string_view header_name(const HeaderField& field) const {
+        return std::string_view(header_block).substr(field.name_offset, field.name_length);
+    }
+
+    std::string_view header_value(const HeaderField& field) const {
+        return std::string_view(header_block).substr(field.value_offset, field.value_length);
+    }
+
+    // 查找请求头，不存在时返回空
+    std::optional<std::string_view> find_header(std::string_view name) const {
+        for (const HeaderField& field : headers) {
+            if (equals_ignore_case(header_name(field), name)) return header_value(field);
+        }
+        return std::nullopt;
+    }
+
+    // HTTP/1.1默认保持连接，HTTP/1.0需要显式的keep-alive
+    bool wants_keep_alive() const {
+        auto connection = find_header("Connection");
+        if (version == "HTTP/1.1") {
+            return !connection || !header_has_token(*connection, "close");
+        }
+        return connection && header_has_token(*connection, "keep-alive");
+    }
+
+    // 带请求体的请求（GET一般没有）无法可靠地跳过请求体，处理完后直接断开
+    bool has_body() const {
+        auto length = find_header("Content-Length");
+        return find_header("Transfer-Encoding") || (length && *length != "0");
+    }
+};
+
+// HTTP响应，头部在发送前由build_response_head统一生成
+struct HttpResponse {
+    std::string status;
+    std::string content_type;
+    std::string headers;  // 额外头部，每行以\r\n结尾
+    std::vector<BodySegment> body;
+    bool head_only = false;  // HEAD请求：只发送响应头
+    bool chunked = false;    // 响应体长度未知，使用chunked编码
+    bool close_connection = false;  // 发送完后关闭连接（如过载时的503）
+
+    long long content_length() const {
+        long long total = 0;
+        for (const BodySegment& seg : body) total += seg.size();
+        return total;
+    }
+
+    // 按实际的响应体大小选择执行通道：长度未知的数据流按大响应处理
+    Lane lane(long long bulk_min) const {
+        if (head_only) return Lane::Latency;
+        long long total = 0;
+        for (const BodySegment& seg : body) {
+            long long size = seg.stream ? seg.stream->expected_size() : seg.size();
+            if (size < 0) return Lane::Bulk;
+            total += size;
+        }
+        return total >= bulk_min ? Lane::Bulk : Lane::Latency;
+    }
+};
+
+// 在栈上的定长缓冲中拼接响应头，超出时才转到堆上的字符串
+class HeadWriter {
+public:
+    explicit HeadWriter(std::string& target) : out(target) {}
+
+    template<size_t N>
+    void literal(const char (&text)[N]) {
+        append(text, N - 1);
+    }
+
+    void append(std::string_view text) {
+        append(text.data(), text.size());
+    }
+
+    void append(const char* data, size_t len) {
+        if (!spilled && length + len <= sizeof(buffer)) {
+            std::memcpy(buffer + length, data, len);
+            length += len;
+            return;
+        }
+        if (!spilled) {
+            out.assign(buffer, length);
+            spilled = true;
+        }
+        out.append(data, len);
+    }
+
+    void number(long long value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        append(digits, static_cast<size_t>(result.ptr - digits));
+    }
+
+    // 写入目标字符串（目标已有的容量会被复用）
+    void finish() {
+        if (!spilled) out.assign(buffer, length);
+    }
+
+private:
+    char buffer[1024];
+    size_t length = 0;
+    bool spilled = false;
+    std::string& out;
+};
+
+// 生成响应头写入out，remaining_requests>0时保持连接。
+// 固定的片段都是字面量，Date每秒格式化一次，数字用to_chars，拼接过程不分配内存
+void build_response_head(const HttpResponse& response, int remaining_requests, std::string& out) {
+    // Keep-Alive的timeout在启动后不再变化，只格式化一次
+    static const std::string keep_alive_prefix =
+        "Connection: keep-alive\r\nKeep-Alive: timeout=" + std::to_string(KEEP_ALIVE_TIMEOUT) + ", max=";
+
+    HeadWriter head(out);
+    head.literal("HTTP/1.1 ");
+    head.append(response.status);
+    head.literal("\r\n");
+    // 304没有响应体，不发送描述响应体的头部
+    if (response.status.compare(0, 3, "304") != 0) {
+        head.literal("Content-Type: ");
+        head.append(response.content_type);
+        if (response.chunked) {
+            head.literal("\r\nTransfer-Encoding: chunked\r\n");
+        }
+        else {
+            head.literal("\r\nContent-Length: ");
+            head.number(response.content_length());
+            head.literal("\r\n");
+        }
+    }
+    if (remaining_requests > 0) {
+        head.append(keep_alive_prefix);
+        head.number(remaining_requests);
+        head.literal("\r\n");
+    }
+    else {
+        head.literal("Connection: close\r\n");
+    }
+    head.literal("Date: ");
+    head.append(current_http_date(), HTTP_DATE_LENGTH);
+    head.literal("\r\n");
+    head.append(response.headers);
+    head.literal("\r\n");
+    head.finish();
 }
 
-// 发送文件内容（支持大文件）
-void send_file(SOCKET_HANDLE client_socket, const std::string& file_path, const std::string& content_type,
-    bool download = false) {
+// 构造内存响应
+HttpResponse make_response(const std::string& status, const std::string& content_type,
+    const std::string& content, const std::string& headers = "") {
+    HttpResponse response;
+    response.status = status;
+    response.content_type = content_type;
+    response.headers = headers;
+    if (!content.empty()) {
+        BodySegment seg;
+        seg.data = content;
+        response.body.push_back(std::move(seg));
+    }
+    return response;
+}
+
+// 过载时的503响应：不访问文件系统，响应体是共享的常量；发送完后关闭连接，让客户端按Retry-After稍后再试
+HttpResponse make_overload_response() {
+    static const auto body = std::make_shared<const std::string>("Service Unavailable");
+    static const std::string headers = "Retry-After: " + std::to_string(RETRY_AFTER_SECONDS) + "\r\n";
+    HttpResponse response;
+    response.status = "503 Service Unavailable";
+    response.content_type = "text/plain";
+    response.headers = headers;
+    response.close_connection = true;
+    BodySegment seg;
+    seg.shared_data = body;
+    response.body.push_back(std::move(seg));
+    return response;
+}
+
+// 记录一次过载拒绝并生成503
+HttpResponse reject_request(RejectReason reason) {
+    metrics.local().rejected[static_cast<int>(reason)].add(1);
+    return make_overload_response();
+}
+
+// 一条访问日志，定长、可直接复制，写入环形缓冲时不分配内存（过长的路径被截断）
+struct AccessLogRecord {
+    std::time_t time = 0;
+    int status = 0;
+    long long bytes = 0;       // 实际发出的字节数（含响应头）
+    long long latency_us = 0;  // 从解析完请求到响应发送完毕
+    char client_ip[48] = { 0 };
+    char method[12] = { 0 };
+    char target[256] = { 0 };
+    char version[12] = { 0 };
+};
+
+// 复制字符串到定长缓冲，必要时截断
+template<size_t N>
+void copy_truncated(char (&dest)[N], const std::string& src) {
+    size_t len = std::min(src.size(), N - 1);
+    std::memcpy(dest, src.data(), len);
+    dest[len] = '\0';
+}
+
+// 请求解析完成时生成日志记录，响应发送完后再补上状态、字节数和耗时
+AccessLogRecord make_access_record(const std::string& client_ip, const HttpRequest& request) {
+    AccessLogRecord record;
+    copy_truncated(record.client_ip, client_ip);
+    copy_truncated(record.method, request.method.empty() ? std::string("-") : request.method);
+    copy_truncated(record.target, request.target);
+    copy_truncated(record.version, request.version);
+    return record;
+}
+
+// 异步访问日志：请求线程把记录放进无锁环形缓冲（多生产者、单消费者），
+// 后台线程批量格式化后一次写出。缓冲满时丢弃记录而不阻塞请求处理
+class AccessLog {
+public:
+    AccessLog() : ring(RING_SIZE) {}
+
+    void start() {
+        std::lock_guard<std::mutex> lock(start_mutex);
+        if (thread.joinable()) return;
+        thread = std::thread([this] { run(); });
+        thread.detach();
+    }
+
+    void record(AccessLogRecord& entry, int status, long long bytes, std::chrono::steady_clock::time_point start) {
+        entry.time = std::time(nullptr);
+        entry.status = status;
+        entry.bytes = bytes;
+        entry.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        if (!ring.push(entry)) dropped_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    unsigned long long dropped() const {
+        return dropped_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const size_t RING_SIZE = 4096;
+    static const size_t BATCH_SIZE = 512;
+
+    void run() {
+        std::string batch;
+        AccessLogRecord entry;
+        std::time_t formatted_second = -1;
+        char time_text[40] = { 0 };
+        while (true) {
+            size_t count = 0;
+            while (count < BATCH_SIZE && ring.pop(entry)) {
+                // 同一秒内的时间只格式化一次
+                if (entry.time != formatted_second) {
+                    std::tm gmt_tm = safe_gmtime(&entry.time);
+                    std::strftime(time_text, sizeof(time_text), "%d/%b/%Y:%H:%M:%S +0000", &gmt_tm);
+                    formatted_second = entry.time;
+                }
+                char line[512];
+                int len = std::snprintf(line, sizeof(line), "%s [%s] \"%s %s %s\" %d %lld %.3fms\n",
+                    entry.client_ip, time_text, entry.method, entry.target, entry.version,
+                    entry.status, entry.bytes, entry.latency_us / 1000.0);
+                if (len > 0) batch.append(line, std::min<size_t>(static_cast<size_t>(len), sizeof(line) - 1));
+                count++;
+            }
+            if (count == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                continue;
+            }
+            std::fwrite(batch.data(), 1, batch.size(), stdout);
+            std::fflush(stdout);
+            batch.clear();
+        }
+    }
+
+    BoundedQueue<AccessLogRecord> ring;
+    std::atomic<unsigned long long> dropped_count{ 0 };
+    std::mutex start_mutex;
+    std::thread thread;
+};
+
+AccessLog access_log;
+
+// 按请求路径和状态码归类
+RouteKind classify_route(const AccessLogRecord& entry) {
+    if (entry.status == 404) return RouteKind::NotFound;
+    if (entry.status >= 400 || std::strncmp(entry.target, "/__stats", 8) == 0) return RouteKind::Other;
+    if (std::strncmp(entry.target, "/download/", 10) == 0) return RouteKind::Download;
+    // 根路径对应index.html；其他以/结尾的路径只可能是目录列表（目录不带/时是301）
+    const char* query = std::strchr(entry.target, '?');
+    size_t length = query ? static_cast<size_t>(query - entry.target) : std::strlen(entry.target);
+    if (length > 1 && entry.target[length - 1] == '/') return RouteKind::Listing;
+    if (entry.status >= 300 && entry.status != 304) return RouteKind::Other;
+    return RouteKind::Static;
+}
+
+// 响应发送完后（访问日志已填好状态和字节数）记入本线程的统计
+void record_request_metrics(const AccessLogRecord& entry, std::chrono::steady_clock::time_point start) {
+    ThreadMetrics& stats = metrics.local();
+    int route = static_cast<int>(classify_route(entry));
+    stats.requests[route].add(1);
+    stats.bytes[route].add(static_cast<uint64_t>(std::max(entry.bytes, 0LL)));
+    stats.latency[route].record(elapsed_ns(start));
+    if (entry.status >= 100 && entry.status < 600) stats.status_classes[entry.status / 100 - 1].add(1);
+}
+
+// 以只读方式打开文件，失败返回-1
+int open_file_readonly(const std::string& file_path) {
 #if defined(_WIN32)
     // 在Windows上使用宽字符路径支持Unicode
     std::wstring wide_path;
     int convert_size = MultiByteToWideChar(CP_UTF8, 0, file_path.c_str(), -1, nullptr, 0);
-    if (convert_size > 0) {
-        wide_path.resize(convert_size);
-        MultiByteToWideChar(CP_UTF8, 0, file_path.c_str(), -1, &wide_path[0], convert_size);
-        wide_path.pop_back(); // 移除多余的null终止符
+    if (convert_size <= 0) return -1;
+    wide_path.resize(convert_size);
+    MultiByteToWideChar(CP_UTF8, 0, file_path.c_str(), -1, &wide_path[0], convert_size);
+    wide_path.pop_back(); // 移除多余的null终止符
+    return _wopen(wide_path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    return open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+// 从文件指定位置读取
+ssize_t read_file_at(const FileHandle& file, char* buffer, size_t len, long long offset) {
+#if defined(_WIN32)
+    if (_lseeki64(file.fd, offset, SEEK_SET) < 0) return -1;
+    return _read(file.fd, buffer, static_cast<unsigned int>(len));
+#else
+    return pread(file.fd, buffer, len, static_cast<off_t>(offset));
+#endif
+}
+
+// 文件元数据
+struct FileInfo {
+    bool is_dir = false;
+    long long size = 0;
+    std::time_t mtime = 0;
+    long long mtime_nsec = 0;
+    unsigned long long inode = 0;  // Windows上为0
+};
+
+#if defined(_WIN32)
+typedef struct _stat64 native_stat;
+#else
+typedef struct stat native_stat;
+#endif
+
+void fill_file_info(const native_stat& st, FileInfo& info) {
+#if defined(_WIN32)
+    info.is_dir = (st.st_mode & _S_IFDIR) != 0;
+    info.inode = 0;
+    info.mtime_nsec = 0;
+#else
+    info.is_dir = S_ISDIR(st.st_mode);
+    info.inode = static_cast<unsigned long long>(st.st_ino);
+#if defined(__linux__)
+    info.mtime_nsec = st.st_mtim.tv_nsec;
+#else
+    info.mtime_nsec = 0;
+#endif
+#endif
+    info.size = static_cast<long long>(st.st_size);
+    info.mtime = static_cast<std::time_t>(st.st_mtime);
+}
+
+// 按路径获取文件信息，不存在时返回false
+bool stat_path(const std::string& path, FileInfo& info) {
+    native_stat st;
+#if defined(_WIN32)
+    int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+    if (wlen <= 0) return false;
+    std::wstring wpath(wlen, 0);
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
+    if (_wstat64(wpath.c_str(), &st) != 0) return false;
+#else
+    if (stat(path.c_str(), &st) != 0) return false;
+#endif
+    fill_file_info(st, info);
+    return true;
+}
+
+// 获取已打开文件的信息
+bool stat_fd(int fd, FileInfo& info) {
+    native_stat st;
+#if defined(_WIN32)
+    if (_fstat64(fd, &st) != 0) return false;
+#else
+    if (fstat(fd, &st) != 0) return false;
+#endif
+    fill_file_info(st, info);
+    return true;
+}
+
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+// 只取需要的字段（类型、大小、修改时间、inode）
+bool statx_fd(int fd, FileInfo& info) {
+    struct statx st;
+    if (statx(fd, "", AT_EMPTY_PATH | AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &st) != 0) {
+        return stat_fd(fd, info);
     }
-    std::ifstream file(wide_path, std::ios::binary | std::ios::ate);
+    info.is_dir = S_ISDIR(st.stx_mode);
+    info.size = static_cast<long long>(st.stx_size);
+    info.mtime = static_cast<std::time_t>(st.stx_mtime.tv_sec);
+    info.mtime_nsec = st.stx_mtime.tv_nsec;
+    info.inode = static_cast<unsigned long long>(st.stx_ino);
+    return true;
+}
 #else
-    std::ifstream file(file_path, std::ios::binary | std::ios::ate);
+bool statx_fd(int fd, FileInfo& info) {
+    return stat_fd(fd, info);
+}
 #endif
 
-    if (!file) {
-        // 添加错误日志以便调试
-        std::cerr << "File not found or cannot open: " << file_path << std::endl;
-        send_response(client_socket, "404 Not Found", "text/plain", "File Not Found");
-        return;
+// 由inode、大小和修改时间生成强ETag；
+// 即时压缩的内容随压缩级别变化，不是逐字节相同的，只能用弱ETag。
+// 各字段都是十六进制（负数按补码），数字用to_chars，只分配结果字符串一次
+std::string make_etag(const FileInfo& info, bool gzip_on_the_fly = false) {
+    std::string etag;
+    etag.reserve(80);
+    auto hex = [&etag](unsigned long long value) {
+        char digits[16];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value, 16);
+        etag.append(digits, static_cast<size_t>(result.ptr - digits));
+    };
+    etag += gzip_on_the_fly ? "W/\"" : "\"";
+    hex(info.inode);
+    etag += '-';
+    hex(static_cast<unsigned long long>(info.size));
+    etag += '-';
+    hex(static_cast<unsigned long long>(static_cast<long long>(info.mtime)));
+    etag += '.';
+    hex(static_cast<unsigned long long>(info.mtime_nsec));
+    etag += gzip_on_the_fly ? "-gzip\"" : "\"";
+    return etag;
+}
+
+// 校验相关的响应头：ETag、Last-Modified、Cache-Control
+std::string make_validator_headers(const FileInfo& info, std::string_view cache_control,
+    bool gzip_on_the_fly = false) {
+    std::string headers = "ETag: " + make_etag(info, gzip_on_the_fly) + "\r\nLast-Modified: " +
+        format_http_date(info.mtime) + "\r\nCache-Control: ";
+    headers.append(cache_control);
+    headers += "\r\n";
+    return headers;
+}
+
+// 解析HTTP日期（只支持RFC 7231推荐的IMF-fixdate格式，如Sun, 06 Nov 1994 08:49:37 GMT）。
+// 格式定长，直接按位置取各字段，不复制请求头
+bool parse_http_date(std::string_view text, std::time_t& result) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (text.size() != 29 || text.substr(3, 2) != ", " || text[7] != ' ' || text[11] != ' ' || text[16] != ' ' ||
+        text[19] != ':' || text[22] != ':' || text.substr(25) != " GMT") {
+        return false;
+    }
+    auto field = [&](size_t pos, size_t len, int& value) {
+        auto parsed = std::from_chars(text.data() + pos, text.data() + pos + len, value);
+        return parsed.ec == std::errc() && parsed.ptr == text.data() + pos + len;
+    };
+    int day, year, hour, minute, second;
+    if (!field(5, 2, day) || !field(12, 4, year) || !field(17, 2, hour) || !field(20, 2, minute) ||
+        !field(23, 2, second)) {
+        return false;
+    }
+    size_t month_pos = std::string_view(months, 36).find(text.substr(8, 3));
+    if (month_pos == std::string_view::npos || month_pos % 3 != 0) return false;
+    int month = static_cast<int>(month_pos / 3) + 1;
+
+    // 公历日期转为1970-01-01起的天数（不依赖timegm，Windows也可用）
+    int y = year - (month <= 2 ? 1 : 0);
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long yoe = y - era * 400;
+    long long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long long days = era * 146097 + doe - 719468;
+    result = static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+    return true;
+}
+
+// 判断条件请求是否命中（RFC 7232）：If-None-Match优先，其次If-Modified-Since
+bool is_not_modified(const HttpRequest& request, const std::string& etag, std::time_t mtime) {
+    auto if_none_match = request.find_header("If-None-Match");
+    if (if_none_match) {
+        // 弱比较：两边都忽略W/前缀。按逗号切分请求头原文，不复制
+        std::string_view opaque_tag(etag);
+        if (opaque_tag.compare(0, 2, "W/") == 0) opaque_tag.remove_prefix(2);
+        std::string_view tags = *if_none_match;
+        while (!tags.empty()) {
+            size_t comma = tags.find(',');
+            std::string_view tag = tags.substr(0, comma);
+            tags = comma == std::string_view::npos ? std::string_view() : tags.substr(comma + 1);
+            size_t start = tag.find_first_not_of(" \t");
+            if (start == std::string_view::npos) continue;
+            tag = tag.substr(start, tag.find_last_not_of(" \t") - start + 1);
+            if (tag == "*") return true;
+            if (tag.compare(0, 2, "W/") == 0) tag.remove_prefix(2);
+            if (tag == opaque_tag) return true;
+        }
+        return false;
+    }
+
+    auto if_modified_since = request.find_header("If-Modified-Since");
+    std::time_t since;
+    return if_modified_since && parse_http_date(*if_modified_since, since) && mtime <= since;
+}
+
+// 304响应只带校验相关的头部
+HttpResponse make_not_modified_response(const std::string& validator_headers) {
+    return make_response("304 Not Modified", "", "", validator_headers);
+}
+
+// 字节区间 [first, last]（闭区间）
+struct ByteRange {
+    long long first;
+    long long last;
+};
+
+enum class RangeResult { Ignore, Satisfiable, Unsatisfiable };
+
+// 解析非负整数，溢出或含非数字字符时返回false
+bool parse_byte_pos(std::string_view text, long long& value) {
+    if (text.empty() || text.size() > 18) return false;
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+// 去掉两端的空格和制表符
+std::string_view trim_blanks(std::string_view text) {
+    size_t start = text.find_first_not_of(" \t");
+    if (start == std::string_view::npos) return std::string_view();
+    return text.substr(start, text.find_last_not_of(" \t") - start + 1);
+}
+
+// 解析Range请求头（RFC 7233），语法错误时按没有Range处理。按逗号切分请求头原文，不复制
+RangeResult parse_range_header(std::string_view value, long long file_size, std::vector<ByteRange>& ranges) {
+    if (value.compare(0, 6, "bytes=") != 0) return RangeResult::Ignore;
+
+    std::string_view specs = value.substr(6);
+    bool any_spec = false;
+    while (!specs.empty()) {
+        size_t comma = specs.find(',');
+        std::string_view spec = trim_blanks(specs.substr(0, comma));
+        specs = comma == std::string_view::npos ? std::string_view() : specs.substr(comma + 1);
+        if (spec.empty()) continue;
+        any_spec = true;
+
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) return RangeResult::Ignore;
+        std::string_view first_text = trim_blanks(spec.substr(0, dash));
+        std::string_view last_text = trim_blanks(spec.substr(dash + 1));
+
+        ByteRange range{};
+        if (first_text.empty()) {
+            // 后缀区间：最后N个字节
+            long long suffix;
+            if (!parse_byte_pos(last_text, suffix)) return RangeResult::Ignore;
+            if (suffix == 0 || file_size == 0) continue;
+            range.first = std::max(0LL, file_size - suffix);
+            range.last = file_size - 1;
+        }
+        else {
+            if (!parse_byte_pos(first_text, range.first)) return RangeResult::Ignore;
+            if (last_text.empty()) {
+                range.last = file_size - 1;
+            }
+            else {
+                if (!parse_byte_pos(last_text, range.last) || range.last < range.first) return RangeResult::Ignore;
+                range.last = std::min(range.last, file_size - 1);
+            }
+            if (range.first >= file_size) continue;  // 不可满足的区间直接跳过
+        }
+        ranges.push_back(range);
+    }
+
+    if (!any_spec || ranges.size() > MAX_BYTE_RANGES) {
+        ranges.clear();
+        return RangeResult::Ignore;
     }
+    return ranges.empty() ? RangeResult::Unsatisfiable : RangeResult::Satisfiable;
+}
 
-    // 获取文件大小
-    std::streamsize file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
+// 生成multipart/byteranges的分隔符：LAN_HTTP_<时间>_<序号>，两个数字都是十六进制
+std::string make_multipart_boundary() {
+    static std::atomic<unsigned long long> counter(0);
+    char buffer[48] = "LAN_HTTP_";
+    char* const end = buffer + sizeof(buffer);
+    char* p = std::to_chars(buffer + 9, end, static_cast<unsigned long long>(std::time(nullptr)), 16).ptr;
+    *p++ = '_';
+    p = std::to_chars(p, end, counter.fetch_add(1), 16).ptr;
+    return std::string(buffer, static_cast<size_t>(p - buffer));
+}
+
+// 用已打开的文件构造响应（支持大文件和Range请求，文件内容在发送时才读取），info为该文件的元数据。
+// gzip_on_the_fly表示调用方随后会即时压缩响应体，校验头部使用压缩版本的弱ETag
+HttpResponse make_file_response(const HttpRequest& request, const std::string& file_path,
+    const std::shared_ptr<FileHandle>& file, const FileInfo& info,
+    std::string_view content_type, std::string_view cache_control, bool download = false,
+    const std::string& extra_headers = "", bool gzip_on_the_fly = false) {
+    long long file_size = info.size;
+    std::string etag = make_etag(info);
+    std::string last_modified = format_http_date(info.mtime);
 
-    // 构建响应头
-    std::ostringstream header;
-    header << "HTTP/1.1 200 OK\r\n";
-    header << "Content-Type: " << content_type << "\r\n";
-    header << "Content-Length: " << file_size << "\r\n";
-    header << "Connection: close\r\n";
-    header << "Date: " << get_gmt_time() << "\r\n";
+    HttpResponse response;
+    response.status = "200 OK";
+    response.content_type = content_type;
+    // 压缩后的长度未知，不对压缩结果提供Range
+    if (!gzip_on_the_fly) response.headers += "Accept-Ranges: bytes\r\n";
+    response.headers += make_validator_headers(info, cache_control, gzip_on_the_fly);
+    response.headers += extra_headers;
 
     // 如果是下载，添加Content-Disposition
     if (download) {
@@ -265,255 +1785,3698 @@ void send_file(SOCKET_HANDLE client_socket, const std::string& file_path, const
         }
 
         // 添加编码后的Content-Disposition
-        header << "Content-Disposition: " << generate_content_disposition(filename) << "\r\n";
+        response.headers += "Content-Disposition: " + generate_content_disposition(filename) + "\r\n";
     }
 
-    header << "\r\n";
-    std::string header_str = header.str();
-    send(client_socket, header_str.c_str(), static_cast<int>(header_str.size()), 0);
+    // 解析Range；If-Range与当前的ETag（强比较）或Last-Modified不一致时说明文件已变化，返回完整文件
+    std::vector<ByteRange> ranges;
+    RangeResult range_result = RangeResult::Ignore;
+    auto range_header = request.find_header("Range");
+    auto if_range = request.find_header("If-Range");
+    if (range_header && (!if_range || *if_range == etag || *if_range == last_modified)) {
+        range_result = parse_range_header(*range_header, file_size, ranges);
+    }
 
-    // 分块发送文件内容
-    char buffer[BUFFER_SIZE];
-    while (!file.eof()) {
-        file.read(buffer, sizeof(buffer));
-        ssize_t bytes_read = file.gcount();
-        if (bytes_read > 0) {
-            send(client_socket, buffer, static_cast<int>(bytes_read), 0);
+    if (range_result == RangeResult::Unsatisfiable) {
+        response.status = "416 Range Not Satisfiable";
+        response.content_type = "text/plain";
+        response.headers += "Content-Range: bytes */" + std::to_string(file_size) + "\r\n";
+        return response;
+    }
+
+    auto file_segment = [&file](long long offset, long long length) {
+        BodySegment seg;
+        seg.file = file;
+        seg.offset = offset;
+        seg.length = length;
+        return seg;
+    };
+
+    if (range_result == RangeResult::Ignore) {
+        if (file_size > 0) response.body.push_back(file_segment(0, file_size));
+        return response;
+    }
+
+    response.status = "206 Partial Content";
+    if (ranges.size() == 1) {
+        const ByteRange& range = ranges[0];
+        response.headers += "Content-Range: bytes " + std::to_string(range.first) + "-" +
+            std::to_string(range.last) + "/" + std::to_string(file_size) + "\r\n";
+        response.body.push_back(file_segment(range.first, range.last - range.first + 1));
+        return response;
+    }
+
+    // 多个区间：multipart/byteranges，每段的文件内容仍然走零拷贝发送
+    std::string boundary = make_multipart_boundary();
+    response.content_type = "multipart/byteranges; boundary=" + boundary;
+    for (const ByteRange& range : ranges) {
+        BodySegment part_head;
+        part_head.data = "\r\n--" + boundary + "\r\nContent-Type: " + std::string(content_type) +
+            "\r\nContent-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) +
+            "/" + std::to_string(file_size) + "\r\n\r\n";
+        response.body.push_back(std::move(part_head));
+        response.body.push_back(file_segment(range.first, range.last - range.first + 1));
+    }
+    BodySegment closing;
+    closing.data = "\r\n--" + boundary + "--\r\n";
+    response.body.push_back(std::move(closing));
+    return response;
+}
+
+// 按路径打开文件并构造响应
+HttpResponse make_file_response(const HttpRequest& request, const std::string& file_path,
+    std::string_view content_type, std::string_view cache_control, bool download = false,
+    const std::string& extra_headers = "", bool gzip_on_the_fly = false) {
+    int fd = open_file_readonly(file_path);
+    if (fd < 0) {
+        // 添加错误日志以便调试
+        std::cerr << "File not found or cannot open: " << file_path << std::endl;
+        return make_response("404 Not Found", "text/plain", "File Not Found");
+    }
+    auto file = std::make_shared<FileHandle>(fd);
+
+    // 获取文件大小和校验信息（以已打开的文件为准）
+    FileInfo info;
+    if (!stat_fd(fd, info) || info.is_dir) {
+        return make_response("404 Not Found", "text/plain", "File Not Found");
+    }
+    return make_file_response(request, file_path, file, info, content_type, cache_control, download,
+        extra_headers, gzip_on_the_fly);
+}
+
+// 获取文件扩展名（含点），没有扩展名时返回空；返回值指向file_path中的字符
+std::string_view get_extension(std::string_view file_path) {
+    // 从末尾向前只扫描一遍，先遇到路径分隔符说明最后一段没有扩展名
+    for (size_t i = file_path.size(); i > 0; --i) {
+        char c = file_path[i - 1];
+        if (c == '.') return file_path.substr(i - 1);
+        if (c == '/' || c == '\\') break;
+    }
+    return std::string_view();
+}
+
+// 按扩展名决定的缓存策略：页面和数据每次校验，静态资源允许浏览器缓存一段时间
+enum class CachePolicy : uint8_t { Revalidate, Hour, Day };
+constexpr std::string_view CACHE_POLICY_VALUES[] = { "no-cache", "public, max-age=3600", "public, max-age=86400" };
+
+struct MimeType {
+    std::string_view extension;  // 小写，不含点
+    std::string_view type;
+    CachePolicy cache;
+    bool compressible;           // 文本类的内容值得压缩
+};
+
+constexpr MimeType MIME_TYPES[] = {
+    // 页面和文本数据
+    { "html", "text/html", CachePolicy::Revalidate, true },
+    { "htm", "text/html", CachePolicy::Revalidate, true },
+    { "xhtml", "application/xhtml+xml", CachePolicy::Revalidate, true },
+    { "txt", "text/plain", CachePolicy::Revalidate, true },
+    { "text", "text/plain", CachePolicy::Revalidate, true },
+    { "log", "text/plain", CachePolicy::Revalidate, true },
+    { "md", "text/markdown", CachePolicy::Revalidate, true },
+    { "csv", "text/csv", CachePolicy::Revalidate, true },
+    { "tsv", "text/tab-separated-values", CachePolicy::Revalidate, true },
+    { "ics", "text/calendar", CachePolicy::Revalidate, true },
+    { "vtt", "text/vtt", CachePolicy::Revalidate, true },
+    { "srt", "application/x-subrip", CachePolicy::Revalidate, true },
+    { "json", "application/json", CachePolicy::Revalidate, true },
+    { "jsonld", "application/ld+json", CachePolicy::Revalidate, true },
+    { "geojson", "application/geo+json", CachePolicy::Revalidate, true },
+    { "webmanifest", "application/manifest+json", CachePolicy::Revalidate, true },
+    { "xml", "application/xml", CachePolicy::Revalidate, true },
+    { "rss", "application/rss+xml", CachePolicy::Revalidate, true },
+    { "atom", "application/atom+xml", CachePolicy::Revalidate, true },
+    { "yaml", "application/yaml", CachePolicy::Revalidate, true },
+    { "yml", "application/yaml", CachePolicy::Revalidate, true },
+    { "toml", "application/toml", CachePolicy::Revalidate, true },
+    // 样式和脚本
+    { "css", "text/css", CachePolicy::Hour, true },
+    { "js", "application/javascript", CachePolicy::Hour, true },
+    { "mjs", "application/javascript", CachePolicy::Hour, true },
+    { "map", "application/json", CachePolicy::Hour, true },
+    { "wasm", "application/wasm", CachePolicy::Hour, true },
+    // 图片
+    { "png", "image/png", CachePolicy::Day, false },
+    { "jpg", "image/jpeg", CachePolicy::Day, false },
+    { "jpeg", "image/jpeg", CachePolicy::Day, false },
+    { "jfif", "image/jpeg", CachePolicy::Day, false },
+    { "gif", "image/gif", CachePolicy::Day, false },
+    { "webp", "image/webp", CachePolicy::Day, false },
+    { "avif", "image/avif", CachePolicy::Day, false },
+    { "heic", "image/heic", CachePolicy::Day, false },
+    { "heif", "image/heif", CachePolicy::Day, false },
+    { "jxl", "image/jxl", CachePolicy::Day, false },
+    { "bmp", "image/bmp", CachePolicy::Day, true },
+    { "tif", "image/tiff", CachePolicy::Day, false },
+    { "tiff", "image/tiff", CachePolicy::Day, false },
+    { "ico", "image/x-icon", CachePolicy::Day, true },
+    { "cur", "image/x-icon", CachePolicy::Day, true },
+    { "svg", "image/svg+xml", CachePolicy::Day, true },
+    { "svgz", "image/svg+xml", CachePolicy::Day, false },
+    { "apng", "image/apng", CachePolicy::Day, false },
+    // 字体
+    { "woff", "font/woff", CachePolicy::Day, false },
+    { "woff2", "font/woff2", CachePolicy::Day, false },
+    { "ttf", "font/ttf", CachePolicy::Day, true },
+    { "otf", "font/otf", CachePolicy::Day, true },
+    { "eot", "application/vnd.ms-fontobject", CachePolicy::Day, true },
+    // 音视频
+    { "mp4", "video/mp4", CachePolicy::Day, false },
+    { "m4v", "video/mp4", CachePolicy::Day, false },
+    { "webm", "video/webm", CachePolicy::Day, false },
+    { "ogv", "video/ogg", CachePolicy::Day, false },
+    { "mov", "video/quicktime", CachePolicy::Day, false },
+    { "mkv", "video/x-matroska", CachePolicy::Day, false },
+    { "avi", "video/x-msvideo", CachePolicy::Day, false },
+    { "wmv", "video/x-ms-wmv", CachePolicy::Day, false },
+    { "flv", "video/x-flv", CachePolicy::Day, false },
+    { "mpeg", "video/mpeg", CachePolicy::Day, false },
+    { "mpg", "video/mpeg", CachePolicy::Day, false },
+    { "ts", "video/mp2t", CachePolicy::Day, false },
+    { "m3u8", "application/vnd.apple.mpegurl", CachePolicy::Revalidate, true },
+    { "mpd", "application/dash+xml", CachePolicy::Revalidate, true },
+    { "3gp", "video/3gpp", CachePolicy::Day, false },
+    { "mp3", "audio/mpeg", CachePolicy::Day, false },
+    { "m4a", "audio/mp4", CachePolicy::Day, false },
+    { "aac", "audio/aac", CachePolicy::Day, false },
+    { "oga", "audio/ogg", CachePolicy::Day, false },
+    { "ogg", "audio/ogg", CachePolicy::Day, false },
+    { "opus", "audio/opus", CachePolicy::Day, false },
+    { "wav", "audio/wav", CachePolicy::Day, false },
+    { "flac", "audio/flac", CachePolicy::Day, false },
+    { "weba", "audio/webm", CachePolicy::Day, false },
+    { "mid", "audio/midi", CachePolicy::Day, false },
+    { "midi", "audio/midi", CachePolicy::Day, false },
+    // 文档
+    { "pdf", "application/pdf", CachePolicy::Revalidate, false },
+    { "rtf", "application/rtf", CachePolicy::Revalidate, true },
+    { "doc", "application/msword", CachePolicy::Revalidate, false },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document", CachePolicy::Revalidate, false },
+    { "xls", "application/vnd.ms-excel", CachePolicy::Revalidate, false },
+    { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet", CachePolicy::Revalidate, false },
+    { "ppt", "application/vnd.ms-powerpoint", CachePolicy::Revalidate, false },
+    { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation", CachePolicy::Revalidate, false },
+    { "odt", "application/vnd.oasis.opendocument.text", CachePolicy::Revalidate, false },
+    { "ods", "application/vnd.oasis.opendocument.spreadsheet", CachePolicy::Revalidate, false },
+    { "odp", "application/vnd.oasis.opendocument.presentation", CachePolicy::Revalidate, false },
+    { "epub", "application/epub+zip", CachePolicy::Revalidate, false },
+    // 压缩包和二进制
+    { "zip", "application/zip", CachePolicy::Revalidate, false },
+    { "gz", "application/gzip", CachePolicy::Revalidate, false },
+    { "tgz", "application/gzip", CachePolicy::Revalidate, false },
+    { "bz2", "application/x-bzip2", CachePolicy::Revalidate, false },
+    { "xz", "application/x-xz", CachePolicy::Revalidate, false },
+    { "zst", "application/zstd", CachePolicy::Revalidate, false },
+    { "7z", "application/x-7z-compressed", CachePolicy::Revalidate, false },
+    { "rar", "application/vnd.rar", CachePolicy::Revalidate, false },
+    { "tar", "application/x-tar", CachePolicy::Revalidate, false },
+    { "iso", "application/x-iso9660-image", CachePolicy::Revalidate, false },
+    { "apk", "application/vnd.android.package-archive", CachePolicy::Revalidate, false },
+    { "exe", "application/vnd.microsoft.portable-executable", CachePolicy::Revalidate, false },
+    { "msi", "application/x-msi", CachePolicy::Revalidate, false },
+    { "deb", "application/vnd.debian.binary-package", CachePolicy::Revalidate, false },
+    { "rpm", "application/x-rpm", CachePolicy::Revalidate, false },
+    { "dmg", "application/x-apple-diskimage", CachePolicy::Revalidate, false },
+    { "jar", "application/java-archive", CachePolicy::Revalidate, false },
+};
+constexpr size_t MIME_TYPE_COUNT = sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]);
+
+constexpr size_t longest_mime_extension() {
+    size_t longest = 0;
+    for (const MimeType& mime : MIME_TYPES) longest = std::max(longest, mime.extension.size());
+    return longest;
+}
+constexpr size_t MIME_EXTENSION_MAX = longest_mime_extension();
+
+constexpr unsigned char ascii_lower(char c) {
+    unsigned char ch = static_cast<unsigned char>(c);
+    return ch >= 'A' && ch <= 'Z' ? static_cast<unsigned char>(ch + ('a' - 'A')) : ch;
+}
+
+// 扩展名按小写计算的FNV-1a哈希，seed用于寻找无冲突的完美哈希
+constexpr uint32_t mime_hash(std::string_view extension, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : extension) hash = (hash ^ ascii_lower(c)) * 16777619u;
+    return hash ^ (hash >> 15);
+}
+
+// 编译期生成的完美哈希：逐个尝试seed，直到表中所有扩展名落在不同的槽里。
+// 槽数取表长的10倍左右，几十到几百次尝试就能找到
+constexpr size_t MIME_HASH_SLOTS = 1024;
+constexpr uint8_t MIME_SLOT_EMPTY = 0xFF;
+static_assert(MIME_TYPE_COUNT < MIME_SLOT_EMPTY, "MIME table too large for 8-bit slots");
+
+struct MimeHashTable {
+    uint32_t seed = 0;  // 0表示没有找到（表中有重复的扩展名）
+    uint8_t slots[MIME_HASH_SLOTS] = {};
+};
+
+constexpr MimeHashTable build_mime_hash() {
+    MimeHashTable table{};
+    for (uint8_t& slot : table.slots) slot = MIME_SLOT_EMPTY;
+    size_t placed[MIME_TYPE_COUNT] = {};
+    for (uint32_t seed = 1; seed < 100000; ++seed) {
+        size_t count = 0;
+        while (count < MIME_TYPE_COUNT) {
+            size_t slot = mime_hash(MIME_TYPES[count].extension, seed) & (MIME_HASH_SLOTS - 1);
+            if (table.slots[slot] != MIME_SLOT_EMPTY) break;
+            table.slots[slot] = static_cast<uint8_t>(count);
+            placed[count++] = slot;
+        }
+        if (count == MIME_TYPE_COUNT) {
+            table.seed = seed;
+            return table;
         }
+        // 有冲突：只清掉这次放进去的槽，不必每次清空整张表
+        for (size_t i = 0; i < count; ++i) table.slots[placed[i]] = MIME_SLOT_EMPTY;
+    }
+    return table;
+}
+
+constexpr MimeHashTable MIME_HASH = build_mime_hash();
+static_assert(MIME_HASH.seed != 0, "no perfect hash found, check MIME_TYPES for duplicate extensions");
+
+// 按扩展名（可带点，不区分大小写）查表，不分配内存；未知扩展名返回nullptr
+const MimeType* find_mime_type(std::string_view extension) {
+    if (!extension.empty() && extension[0] == '.') extension.remove_prefix(1);
+    if (extension.empty() || extension.size() > MIME_EXTENSION_MAX) return nullptr;
+    uint8_t index = MIME_HASH.slots[mime_hash(extension, MIME_HASH.seed) & (MIME_HASH_SLOTS - 1)];
+    if (index == MIME_SLOT_EMPTY) return nullptr;
+    // 哈希只能排除，命中的槽还要核对扩展名（表中的扩展名已是小写）
+    std::string_view candidate = MIME_TYPES[index].extension;
+    if (candidate.size() != extension.size()) return nullptr;
+    for (size_t i = 0; i < extension.size(); ++i) {
+        if (ascii_lower(extension[i]) != static_cast<unsigned char>(candidate[i])) return nullptr;
     }
+    return &MIME_TYPES[index];
 }
 
 // MIME类型映射
-std::string get_content_type(const std::string& extension) {
-    static const std::map<std::string, std::string> mime_types = {
-        {".html", "text/html"},
-        {".htm", "text/html"},
-        {".css", "text/css"},
-        {".js", "application/javascript"},
-        {".png", "image/png"},
-        {".jpg", "image/jpeg"},
-        {".jpeg", "image/jpeg"},
-        {".gif", "image/gif"},
-        {".pdf", "application/pdf"},
-        {".zip", "application/zip"},
-        {".txt", "text/plain"},
-        {".json", "application/json"},
-        {".xml", "application/xml"},
-        {".ico", "image/x-icon"}
-    };
+std::string_view get_content_type(std::string_view extension) {
+    const MimeType* mime = find_mime_type(extension);
+    return mime ? mime->type : std::string_view("application/octet-stream");
+}
+
+// 按扩展名决定缓存策略，未知类型每次校验
+std::string_view get_cache_control(std::string_view extension) {
+    const MimeType* mime = find_mime_type(extension);
+    return CACHE_POLICY_VALUES[static_cast<int>(mime ? mime->cache : CachePolicy::Revalidate)];
+}
 
-    std::string ext = extension;
-    std::transform(ext.begin(), ext.end(), ext.begin(),
-        [](unsigned char c) { return std::tolower(c); });
+// 文本类型值得压缩
+bool is_compressible(std::string_view extension) {
+    const MimeType* mime = find_mime_type(extension);
+    return mime && mime->compressible;
+}
 
-    auto it = mime_types.find(ext);
-    if (it != mime_types.end()) {
-        return it->second;
+// 编码后面的参数（分号分隔）中q值是否为0。qvalue最多三位小数，为0只有0、0.、0.0、0.00、0.000几种写法
+bool is_zero_qvalue(std::string_view params) {
+    while (!params.empty()) {
+        size_t semicolon = params.find(';');
+        std::string_view param = trim_blanks(params.substr(0, semicolon));
+        params = semicolon == std::string_view::npos ? std::string_view() : params.substr(semicolon + 1);
+        if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=') continue;
+        std::string_view value = param.substr(2);
+        return value == "0" || (value.size() <= 5 && value.compare(0, 2, "0.") == 0 &&
+            value.find_first_not_of('0', 2) == std::string_view::npos);
     }
+    return false;
+}
 
-    return "application/octet-stream";
+// 客户端是否接受gzip编码（q=0表示明确拒绝）
+bool accepts_gzip(const HttpRequest& request) {
+    auto accept_encoding = request.find_header("Accept-Encoding");
+    if (!accept_encoding) return false;
+
+    // 按逗号和分号切分请求头原文，不复制
+    bool wildcard = false;
+    std::string_view codings = *accept_encoding;
+    while (!codings.empty()) {
+        size_t comma = codings.find(',');
+        std::string_view coding = codings.substr(0, comma);
+        codings = comma == std::string_view::npos ? std::string_view() : codings.substr(comma + 1);
+        size_t semicolon = coding.find(';');
+        std::string_view name = trim_blanks(coding.substr(0, semicolon));
+        bool rejected = semicolon != std::string_view::npos && is_zero_qvalue(coding.substr(semicolon + 1));
+        if (equals_ignore_case(name, "gzip") || equals_ignore_case(name, "x-gzip")) return !rejected;
+        if (name == "*") wildcard = !rejected;
+    }
+    return wildcard;
 }
 
-// 检查是否为目录
-bool is_directory(const std::string& path) {
+// 进程累计的CPU时间（用户态+内核态，秒）
+double process_cpu_seconds() {
 #if defined(_WIN32)
-    int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
-    if (wlen <= 0) return false;
-    std::wstring wpath(wlen, 0);
-    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
-    DWORD attrs = GetFileAttributesW(wpath.c_str());
-    return (attrs != INVALID_FILE_ATTRIBUTES) && (attrs & FILE_ATTRIBUTE_DIRECTORY);
+    FILETIME creation, exit_time, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit_time, &kernel, &user)) return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return static_cast<double>(k.QuadPart + u.QuadPart) / 1e7;  // 单位为100ns
 #else
-    struct stat info;
-    if (stat(path.c_str(), &info)) return false;
-    return S_ISDIR(info.st_mode);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
 #endif
 }
 
-// 检查文件是否存在
-bool file_exists(const std::string& path) {
+// 当前线程累计的CPU时间（纳秒），用于统计压缩的开销
+unsigned long long thread_cpu_ns() {
 #if defined(_WIN32)
-    int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
-    if (wlen <= 0) return false;
-    std::wstring wpath(wlen, 0);
-    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
-    DWORD attrs = GetFileAttributesW(wpath.c_str());
-    return (attrs != INVALID_FILE_ATTRIBUTES);
+    FILETIME creation, exit_time, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit_time, &kernel, &user)) return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) * 100;
 #else
-    struct stat info;
-    return stat(path.c_str(), &info) == 0;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + static_cast<unsigned long long>(ts.tv_nsec);
 #endif
 }
 
-// 处理HTTP请求
-void handle_request(SOCKET_HANDLE client_socket) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+// 即时压缩的统计，由/__stats输出
+struct CompressionStats {
+    std::atomic<unsigned long long> responses{ 0 };  // 压缩完成的响应数
+    std::atomic<unsigned long long> bytes_in{ 0 };   // 压缩前的字节数
+    std::atomic<unsigned long long> bytes_out{ 0 };  // 压缩后的字节数
+    std::atomic<unsigned long long> cpu_ns{ 0 };     // 压缩耗费的CPU时间
+};
+
+CompressionStats compression_stats;
+
+// 根据进程CPU占用和线程池排队长度选择压缩级别：空闲时压得更小，繁忙时只做最快的压缩。
+// 每250ms最多采样一次
+class CompressionGovernor {
+public:
+    std::function<size_t()> queue_depth;  // 由run_server设置为线程池的排队长度
+
+    int level() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (sampled_cpu < 0 || now - sampled_at >= std::chrono::milliseconds(250)) sample(now);
+        return current_level;
+    }
+
+    int last_level() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current_level;
+    }
+
+private:
+    void sample(std::chrono::steady_clock::time_point now) {
+        double cpu = process_cpu_seconds();
+        double wall = std::chrono::duration<double>(now - sampled_at).count();
+        // 占用率按全部CPU核心折算，第一次采样时没有参照，按空闲处理
+        double load = 0;
+        if (sampled_cpu >= 0 && wall > 0) {
+            unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+            load = (cpu - sampled_cpu) / (wall * cores);
+        }
+        sampled_cpu = cpu;
+        sampled_at = now;
+
+        size_t depth = queue_depth ? queue_depth() : 0;
+        if (load < 0.5 && depth == 0) current_level = 6;
+        else if (load < 0.8 && depth < 16) current_level = 3;
+        else current_level = 1;
+    }
+
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point sampled_at;
+    double sampled_cpu = -1;
+    int current_level = 6;
+};
+
+CompressionGovernor compression_governor;
+
+#if defined(LAN_HTTP_USE_ZLIB)
+// 即时gzip压缩的响应体：每次压缩一块源数据（内存或文件区间），输出为chunked编码的数据块
+class GzipStream : public BodyStream {
+public:
+    GzipStream(BodySegment&& source_segment, int level) : source(std::move(source_segment)) {
+        // windowBits 15+16：输出gzip格式
+        initialized = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+
+    ~GzipStream() override {
+        if (initialized) deflateEnd(&stream);
+    }
+
+    // 压缩前的大小：压缩的耗时与输入成正比
+    long long expected_size() const override { return source.size(); }
+
+    StreamStatus next(std::string& out) override {
+        if (!initialized) return StreamStatus::Error;
+        unsigned long long cpu_start = thread_cpu_ns();
+
+        long long take = std::min<long long>(INPUT_CHUNK, source.size() - consumed);
+        const char* input;
+        if (source.file) {
+            input_buffer.resize(static_cast<size_t>(take));
+            long long got = 0;
+            while (got < take) {
+                ssize_t n = read_file_at(*source.file, &input_buffer[static_cast<size_t>(got)],
+                    static_cast<size_t>(take - got), source.offset + consumed + got);
+                if (n <= 0) return StreamStatus::Error;  // 文件被截断
+                got += n;
+            }
+            input = input_buffer.data();
+        }
+        else {
+            input = source.bytes().data() + consumed;
+        }
+        consumed += take;
+        bool last = consumed >= source.size();
+
+        compressed.clear();
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+        stream.avail_in = static_cast<uInt>(take);
+        int rc;
+        do {
+            char buffer[16 * 1024];
+            stream.next_out = reinterpret_cast<Bytef*>(buffer);
+            stream.avail_out = sizeof(buffer);
+            rc = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+            if (rc == Z_STREAM_ERROR) return StreamStatus::Error;
+            compressed.append(buffer, sizeof(buffer) - stream.avail_out);
+        } while (stream.avail_out == 0 || (last && rc != Z_STREAM_END));
+
+        // 最后以长度为0的块结束
+        append_chunk(out, compressed);
+        if (last) out += "0\r\n\r\n";
+
+        compression_stats.bytes_in.fetch_add(static_cast<unsigned long long>(take), std::memory_order_relaxed);
+        compression_stats.bytes_out.fetch_add(compressed.size(), std::memory_order_relaxed);
+        compression_stats.cpu_ns.fetch_add(thread_cpu_ns() - cpu_start, std::memory_order_relaxed);
+        if (!last) return StreamStatus::More;
+        compression_stats.responses.fetch_add(1, std::memory_order_relaxed);
+        return StreamStatus::Done;
+    }
+
+private:
+    static constexpr long long INPUT_CHUNK = 64 * 1024;  // 每次压缩的源数据量
+
+    BodySegment source;
+    long long consumed = 0;
+    z_stream stream{};
+    bool initialized = false;
+    std::string input_buffer;
+    std::string compressed;
+};
+#endif
+
+// 是否即时压缩：需要zlib，客户端接受gzip且支持chunked（HTTP/1.1），不是Range请求，且大小不低于阈值
+bool should_compress(const HttpRequest& request, long long size) {
+#if defined(LAN_HTTP_USE_ZLIB)
+    return size >= COMPRESS_MIN_SIZE && request.version == "HTTP/1.1" &&
+        !request.find_header("Range") && accepts_gzip(request);
+#else
+    (void)request;
+    (void)size;
+    return false;
+#endif
+}
+
+// 把只有一个分段的响应体换成即时gzip压缩的数据流，压缩在发送时逐块进行
+void compress_response(HttpResponse& response) {
+#if defined(LAN_HTTP_USE_ZLIB)
+    if (response.body.size() != 1) return;
+    BodySegment seg;
+    seg.stream = std::make_shared<GzipStream>(std::move(response.body[0]), compression_governor.level());
+    response.body[0] = std::move(seg);
+    response.chunked = true;
+    response.headers += "Content-Encoding: gzip\r\n";
+#else
+    (void)response;
+#endif
+}
+
+// 所有线程统计相加后的结果
+struct MetricsSnapshot {
+    uint64_t requests[ROUTE_KIND_COUNT] = {};
+    uint64_t bytes[ROUTE_KIND_COUNT] = {};
+    HistogramSnapshot latency[ROUTE_KIND_COUNT];
+    uint64_t status_classes[5] = {};
+    uint64_t aborted = 0;
+    uint64_t rejected[REJECT_REASON_COUNT] = {};
+    uint64_t timeouts[TIMEOUT_KIND_COUNT] = {};
+    int64_t connections = 0;
+    HistogramSnapshot queue_wait[LANE_COUNT];
+    HistogramSnapshot handler_time;
+};
+
+std::unique_ptr<MetricsSnapshot> collect_metrics() {
+    auto snapshot = std::make_unique<MetricsSnapshot>();
+    metrics.for_each([&snapshot](const ThreadMetrics& stats) {
+        for (int i = 0; i < ROUTE_KIND_COUNT; ++i) {
+            snapshot->requests[i] += stats.requests[i].load();
+            snapshot->bytes[i] += stats.bytes[i].load();
+            snapshot->latency[i].merge(stats.latency[i]);
+        }
+        for (int i = 0; i < 5; ++i) snapshot->status_classes[i] += stats.status_classes[i].load();
+        snapshot->aborted += stats.aborted.load();
+        for (int i = 0; i < REJECT_REASON_COUNT; ++i) snapshot->rejected[i] += stats.rejected[i].load();
+        for (int i = 0; i < TIMEOUT_KIND_COUNT; ++i) snapshot->timeouts[i] += stats.timeouts[i].load();
+        snapshot->connections += stats.connections.load();
+        for (int i = 0; i < LANE_COUNT; ++i) snapshot->queue_wait[i].merge(stats.queue_wait[i]);
+        snapshot->handler_time.merge(stats.handler_time);
+    });
+    return snapshot;
+}
+
+// Prometheus直方图：桶边界取2的幂纳秒（正好是HDR桶的边界），从约1微秒到约69秒
+void write_prometheus_histogram(std::ostringstream& oss, const char* name, const std::string& labels,
+    const HistogramSnapshot& histogram) {
+    std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    for (int exponent = 10; exponent <= 36; ++exponent) {
+        oss << name << "_bucket" << prefix << "le=\"" << static_cast<double>(1ULL << exponent) / 1e9 << "\"} "
+            << histogram.count_below_power(exponent) << "\n";
+    }
+    oss << name << "_bucket" << prefix << "le=\"+Inf\"} " << histogram.count << "\n"
+        << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << histogram.sum_ns / 1e9 << "\n"
+        << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << histogram.count << "\n";
+}
+
+// JSON中的延迟摘要（微秒）
+void write_json_latency(std::ostringstream& oss, const HistogramSnapshot& histogram) {
+    oss << "{\"count\":" << histogram.count
+        << ",\"mean\":" << (histogram.count ? histogram.sum_ns / 1e3 / static_cast<double>(histogram.count) : 0.0)
+        << ",\"p50\":" << histogram.quantile(0.5) / 1e3
+        << ",\"p90\":" << histogram.quantile(0.9) / 1e3
+        << ",\"p99\":" << histogram.quantile(0.99) / 1e3
+        << ",\"p999\":" << histogram.quantile(0.999) / 1e3
+        << ",\"max\":" << histogram.quantile(1.0) / 1e3 << "}";
+}
+
+// 服务器统计信息：默认Prometheus文本格式，/__stats?format=json输出JSON
+HttpResponse make_stats_response(bool json) {
+    std::unique_ptr<MetricsSnapshot> snapshot = collect_metrics();
+    size_t queue_depth[LANE_COUNT] = {};
+    uint64_t node_fallbacks[LANE_COUNT] = {};
+    if (metrics.queue_depth) {
+        for (int i = 0; i < LANE_COUNT; ++i) {
+            queue_depth[i] = metrics.queue_depth(static_cast<Lane>(i));
+            node_fallbacks[i] = metrics.node_fallbacks(static_cast<Lane>(i));
+        }
+    }
+    unsigned long long bytes_in = compression_stats.bytes_in.load();
+    unsigned long long bytes_out = compression_stats.bytes_out.load();
+    unsigned long long bytes_saved = bytes_in > bytes_out ? bytes_in - bytes_out : 0;
+    std::ostringstream oss;
+    oss.precision(9);
+
+    if (json) {
+        oss << "{\"routes\":{";
+        for (int i = 0; i < ROUTE_KIND_COUNT; ++i) {
+            oss << (i ? "," : "") << "\"" << ROUTE_KIND_NAMES[i] << "\":{\"requests\":" << snapshot->requests[i]
+                << ",\"bytes\":" << snapshot->bytes[i] << ",\"latency_us\":";
+            write_json_latency(oss, snapshot->latency[i]);
+            oss << "}";
+        }
+        oss << "},\"responses\":{";
+        for (int i = 0; i < 5; ++i) oss << (i ? "," : "") << "\"" << i + 1 << "xx\":" << snapshot->status_classes[i];
+        oss << "},\"aborted\":" << snapshot->aborted << ",\"rejected\":{";
+        for (int i = 0; i < REJECT_REASON_COUNT; ++i) {
+            oss << (i ? "," : "") << "\"" << REJECT_REASON_NAMES[i] << "\":" << snapshot->rejected[i];
+        }
+        oss << "},\"timeouts\":{";
+        for (int i = 0; i < TIMEOUT_KIND_COUNT; ++i) {
+            oss << (i ? "," : "") << "\"" << TIMEOUT_KIND_NAMES[i] << "\":" << snapshot->timeouts[i];
+        }
+        oss << "},\"connections\":" << snapshot->connections << ",\"pool\":{\"lanes\":{";
+        for (int i = 0; i < LANE_COUNT; ++i) {
+            oss << (i ? "," : "") << "\"" << LANE_NAMES[i] << "\":{\"workers\":" << metrics.lane_workers[i]
+                << ",\"queue_depth\":" << queue_depth[i] << ",\"node_fallbacks\":" << node_fallbacks[i]
+                << ",\"queue_wait_us\":";
+            write_json_latency(oss, snapshot->queue_wait[i]);
+            oss << "}";
+        }
+        oss << "},\"handler_us\":";
+        write_json_latency(oss, snapshot->handler_time);
+        oss << "},\"compression\":{\"responses\":" << compression_stats.responses.load()
+            << ",\"bytes_in\":" << bytes_in << ",\"bytes_out\":" << bytes_out << ",\"bytes_saved\":" << bytes_saved
+            << ",\"cpu_seconds\":" << compression_stats.cpu_ns.load() / 1e9
+            << ",\"level\":" << compression_governor.last_level() << "}"
+            << ",\"access_log_dropped\":" << access_log.dropped() << "}\n";
+        return make_response("200 OK", "application/json", oss.str(), "Cache-Control: no-store\r\n");
+    }
+
+    oss << "# TYPE lan_http_requests_total counter\n";
+    for (int i = 0; i < ROUTE_KIND_COUNT; ++i) {
+        oss << "lan_http_requests_total{route=\"" << ROUTE_KIND_NAMES[i] << "\"} " << snapshot->requests[i] << "\n";
+    }
+    oss << "# TYPE lan_http_response_bytes_total counter\n";
+    for (int i = 0; i < ROUTE_KIND_COUNT; ++i) {
+        oss << "lan_http_response_bytes_total{route=\"" << ROUTE_KIND_NAMES[i] << "\"} " << snapshot->bytes[i] << "\n";
+    }
+    oss << "# TYPE lan_http_request_duration_seconds histogram\n";
+    for (int i = 0; i < ROUTE_KIND_COUNT; ++i) {
+        write_prometheus_histogram(oss, "lan_http_request_duration_seconds",
+            std::string("route=\"") + ROUTE_KIND_NAMES[i] + "\"", snapshot->latency[i]);
+    }
+    oss << "# TYPE lan_http_responses_total counter\n";
+    for (int i = 0; i < 5; ++i) {
+        oss << "lan_http_responses_total{code=\"" << i + 1 << "xx\"} " << snapshot->status_classes[i] << "\n";
+    }
+    oss << "# TYPE lan_http_responses_aborted_total counter\n"
+        << "lan_http_responses_aborted_total " << snapshot->aborted << "\n"
+        << "# TYPE lan_http_rejected_total counter\n";
+    for (int i = 0; i < REJECT_REASON_COUNT; ++i) {
+        oss << "lan_http_rejected_total{reason=\"" << REJECT_REASON_NAMES[i] << "\"} " << snapshot->rejected[i] << "\n";
+    }
+    oss << "# TYPE lan_http_timeouts_total counter\n";
+    for (int i = 0; i < TIMEOUT_KIND_COUNT; ++i) {
+        oss << "lan_http_timeouts_total{kind=\"" << TIMEOUT_KIND_NAMES[i] << "\"} " << snapshot->timeouts[i] << "\n";
+    }
+    oss << "# TYPE lan_http_connections gauge\n"
+        << "lan_http_connections " << snapshot->connections << "\n"
+        << "# TYPE lan_http_pool_workers gauge\n";
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        oss << "lan_http_pool_workers{lane=\"" << LANE_NAMES[i] << "\"} " << metrics.lane_workers[i] << "\n";
+    }
+    oss << "# TYPE lan_http_pool_queue_depth gauge\n";
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        oss << "lan_http_pool_queue_depth{lane=\"" << LANE_NAMES[i] << "\"} " << queue_depth[i] << "\n";
+    }
+    oss << "# TYPE lan_http_pool_node_fallbacks_total counter\n";
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        oss << "lan_http_pool_node_fallbacks_total{lane=\"" << LANE_NAMES[i] << "\"} " << node_fallbacks[i] << "\n";
+    }
+    oss << "# TYPE lan_http_pool_queue_wait_seconds histogram\n";
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        write_prometheus_histogram(oss, "lan_http_pool_queue_wait_seconds",
+            std::string("lane=\"") + LANE_NAMES[i] + "\"", snapshot->queue_wait[i]);
+    }
+    oss << "# TYPE lan_http_handler_duration_seconds histogram\n";
+    write_prometheus_histogram(oss, "lan_http_handler_duration_seconds", "", snapshot->handler_time);
+    oss << "# TYPE lan_http_compression_responses_total counter\n"
+        << "lan_http_compression_responses_total " << compression_stats.responses.load() << "\n"
+        << "# TYPE lan_http_compression_bytes_in_total counter\n"
+        << "lan_http_compression_bytes_in_total " << bytes_in << "\n"
+        << "# TYPE lan_http_compression_bytes_out_total counter\n"
+        << "lan_http_compression_bytes_out_total " << bytes_out << "\n"
+        << "# TYPE lan_http_compression_bytes_saved_total counter\n"
+        << "lan_http_compression_bytes_saved_total " << bytes_saved << "\n"
+        << "# TYPE lan_http_compression_cpu_seconds_total counter\n"
+        << "lan_http_compression_cpu_seconds_total " << compression_stats.cpu_ns.load() / 1e9 << "\n"
+        << "# TYPE lan_http_compression_level gauge\n"
+        << "lan_http_compression_level " << compression_governor.last_level() << "\n"
+        << "# TYPE lan_http_access_log_dropped_total counter\n"
+        << "lan_http_access_log_dropped_total " << access_log.dropped() << "\n";
+    return make_response("200 OK", "text/plain; version=0.0.4", oss.str(), "Cache-Control: no-store\r\n");
+}
+
+// 检查是否为目录
+bool is_directory(const std::string& path) {
+#if defined(_WIN32)
+    int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+    if (wlen <= 0) return false;
+    std::wstring wpath(wlen, 0);
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
+    DWORD attrs = GetFileAttributesW(wpath.c_str());
+    return (attrs != INVALID_FILE_ATTRIBUTES) && (attrs & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info)) return false;
+    return S_ISDIR(info.st_mode);
+#endif
+}
+
+enum class ParseResult { Incomplete, Complete, BadRequest, UriTooLong, HeadersTooLarge };
+
+// 增量解析请求行和请求头的状态机。每次在连接的输入缓冲上继续上次的位置向后扫描，
+// 请求头被拆成多次recv到达时不会重新扫描；各部分只记录在缓冲中的偏移，解析完成后才复制到HttpRequest
+class RequestParser {
+public:
+    // buffer为连接的输入缓冲（开头是当前请求），返回Complete时填好request，consumed()为请求头的总长度
+    ParseResult parse(std::string_view buffer, HttpRequest& request) {
+        while (true) {
+            const char* newline = static_cast<const char*>(
+                std::memchr(buffer.data() + scan_pos, '\n', buffer.size() - scan_pos));
+            if (!newline) {
+                // 没有完整的行，检查未完成的部分是否已超限
+                scan_pos = buffer.size();
+                if (state == State::RequestLine && buffer.size() - line_start > MAX_REQUEST_LINE_SIZE) {
+                    return ParseResult::UriTooLong;
+                }
+                if (buffer.size() > MAX_REQUEST_HEADER_SIZE) return ParseResult::HeadersTooLarge;
+                return ParseResult::Incomplete;
+            }
+
+            size_t line_end = static_cast<size_t>(newline - buffer.data());
+            scan_pos = line_end + 1;
+            if (scan_pos > MAX_REQUEST_HEADER_SIZE) return ParseResult::HeadersTooLarge;
+            // 行尾的\r可以省略
+            size_t content_end = (line_end > line_start && buffer[line_end - 1] == '\r') ? line_end - 1 : line_end;
+            std::string_view line = buffer.substr(line_start, content_end - line_start);
+            size_t offset = line_start;
+            line_start = scan_pos;
+
+            if (state == State::RequestLine) {
+                if (line.empty()) {
+                    // 请求行之前的空行忽略（RFC 7230 3.5）
+                    header_start = line_start;
+                    continue;
+                }
+                if (line.size() > MAX_REQUEST_LINE_SIZE) return ParseResult::UriTooLong;
+                if (!parse_request_line(line, offset)) return ParseResult::BadRequest;
+                header_start = line_start;
+                state = State::Headers;
+                continue;
+            }
+
+            if (line.empty()) {
+                finish(buffer, request, offset);
+                return ParseResult::Complete;
+            }
+            if (fields.size() >= MAX_HEADER_COUNT) return ParseResult::HeadersTooLarge;
+            if (!parse_header_line(line, offset)) return ParseResult::BadRequest;
+        }
+    }
+
+    size_t consumed() const { return scan_pos; }
+
+    // 开始解析下一个请求（缓冲中已处理的部分由调用方删除）
+    void reset() {
+        state = State::RequestLine;
+        scan_pos = line_start = header_start = 0;
+        fields.clear();
+    }
+
+private:
+    enum class State { RequestLine, Headers };
+
+    struct Span {
+        size_t offset;
+        size_t length;
+    };
+
+    static bool is_token_char(unsigned char c) {
+        return std::isalnum(c) || std::strchr("!#$%&'*+-.^_`|~", c) != nullptr;
+    }
+
+    // 请求行：method SP request-target SP HTTP-version
+    bool parse_request_line(std::string_view line, size_t offset) {
+        size_t sp1 = line.find(' ');
+        if (sp1 == std::string_view::npos || sp1 == 0) return false;
+        size_t sp2 = line.find(' ', sp1 + 1);
+        if (sp2 == std::string_view::npos || sp2 == sp1 + 1) return false;
+        for (size_t i = 0; i < sp1; ++i) {
+            if (!is_token_char(static_cast<unsigned char>(line[i]))) return false;
+        }
+        for (size_t i = sp1 + 1; i < sp2; ++i) {
+            unsigned char c = static_cast<unsigned char>(line[i]);
+            if (c <= 0x20 || c == 0x7f) return false;
+        }
+        std::string_view version = line.substr(sp2 + 1);
+        if (version.size() != 8 || version.compare(0, 5, "HTTP/") != 0 || !std::isdigit(static_cast<unsigned char>(version[5])) ||
+            version[6] != '.' || !std::isdigit(static_cast<unsigned char>(version[7]))) {
+            return false;
+        }
+        method_span = Span{ offset, sp1 };
+        target_span = Span{ offset + sp1 + 1, sp2 - sp1 - 1 };
+        version_span = Span{ offset + sp2 + 1, version.size() };
+        return true;
+    }
+
+    // 请求头：field-name ":" OWS field-value OWS；不接受折行和名字后的空白（RFC 7230 3.2.4）
+    bool parse_header_line(std::string_view line, size_t offset) {
+        if (line[0] == ' ' || line[0] == '\t') return false;
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0) return false;
+        for (size_t i = 0; i < colon; ++i) {
+            if (!is_token_char(static_cast<unsigned char>(line[i]))) return false;
+        }
+        size_t value_start = colon + 1;
+        size_t value_end = line.size();
+        while (value_start < value_end && (line[value_start] == ' ' || line[value_start] == '\t')) value_start++;
+        while (value_end > value_start && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t')) value_end--;
+        fields.push_back(HttpRequest::HeaderField{
+            static_cast<uint32_t>(offset - header_start), static_cast<uint32_t>(colon),
+            static_cast<uint32_t>(offset + value_start - header_start), static_cast<uint32_t>(value_end - value_start) });
+        return true;
+    }
+
+    void finish(std::string_view buffer, HttpRequest& request, size_t header_end) {
+        request.method.assign(buffer.data() + method_span.offset, method_span.length);
+        request.target.assign(buffer.data() + target_span.offset, target_span.length);
+        request.version.assign(buffer.data() + version_span.offset, version_span.length);
+        request.header_block.assign(buffer.data() + header_start, header_end - header_start);
+        request.headers = fields;
+        // 缓存查找、选择通道和路由都用这一次的解码结果
+        request.path_status = url_decode(target_path(request.target), request.path);
+    }
+
+    State state = State::RequestLine;
+    size_t scan_pos = 0;      // 下次从这里开始找换行
+    size_t line_start = 0;    // 当前行的起点
+    size_t header_start = 0;  // 请求头部分的起点
+    Span method_span{ 0, 0 };
+    Span target_span{ 0, 0 };
+    Span version_span{ 0, 0 };
+    std::vector<HttpRequest::HeaderField> fields;  // 连接内复用，不为每个请求头单独分配
+};
+
+// 解析失败时的响应
+HttpResponse make_parse_error_response(ParseResult result) {
+    if (result == ParseResult::UriTooLong) {
+        return make_response("414 URI Too Long", "text/plain", "URI Too Long");
+    }
+    if (result == ParseResult::HeadersTooLarge) {
+        return make_response("431 Request Header Fields Too Large", "text/plain", "Request Header Fields Too Large");
+    }
+    return make_response("400 Bad Request", "text/plain", "Bad Request");
+}
+
+#if defined(__linux__)
+// 监视ROOT_DIR下的文件变化（inotify），通知各个缓存失效
+class FsWatcher {
+public:
+    // url_path为相对网站根目录的路径（如"/downloads/a.txt"），为空表示所有缓存都要失效
+    using Listener = std::function<void(const std::string& url_path, bool is_dir)>;
+
+    ~FsWatcher() {
+        if (inotify_fd >= 0) close(inotify_fd);
+        if (thread.joinable()) thread.detach();
+    }
+
+    // 在start之前注册
+    void add_listener(Listener listener) {
+        listeners.push_back(std::move(listener));
+    }
+
+    // 递归监视根目录，失败时返回false（调用方应关闭依赖它的缓存）
+    bool start(const std::string& root) {
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd < 0) return false;
+        root_dir = root;
+        if (!add_watch_recursive(root_dir, "")) {
+            close(inotify_fd);
+            inotify_fd = -1;
+            return false;
+        }
+        thread = std::thread([this] { run(); });
+        return true;
+    }
+
+    bool running() const { return inotify_fd >= 0; }
+
+private:
+    static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    bool add_watch_recursive(const std::string& dir_path, const std::string& url_path) {
+        int wd = inotify_add_watch(inotify_fd, dir_path.c_str(), WATCH_MASK | IN_ONLYDIR);
+        if (wd < 0) {
+            std::cerr << "inotify_add_watch failed for " << dir_path << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            watches[wd] = url_path;
+        }
+
+        DIR* dir = opendir(dir_path.c_str());
+        if (!dir) return true;
+        bool ok = true;
+        struct dirent* ent;
+        while (ok && (ent = readdir(dir)) != nullptr) {
+            std::string name = ent->d_name;
+            if (name == "." || name == "..") continue;
+            bool is_dir = ent->d_type == DT_DIR;
+            if (ent->d_type == DT_UNKNOWN) is_dir = is_directory(dir_path + "/" + name);
+            if (is_dir) ok = add_watch_recursive(dir_path + "/" + name, url_path + "/" + name);
+        }
+        closedir(dir);
+        return ok;
+    }
+
+    void notify(const std::string& url_path, bool is_dir) {
+        for (const Listener& listener : listeners) listener(url_path, is_dir);
+    }
+
+    void run() {
+        alignas(inotify_event) char buffer[64 * 1024];
+        while (true) {
+            ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+            if (len <= 0) {
+                if (len < 0 && errno == EINTR) continue;
+                // 无法继续监视时清空所有缓存，之后也不会再有新的失效通知
+                notify("", true);
+                return;
+            }
+            for (char* ptr = buffer; ptr < buffer + len;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(ptr);
+                ptr += sizeof(inotify_event) + event->len;
+                handle_event(*event);
+            }
+        }
+    }
+
+    void handle_event(const inotify_event& event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            notify("", true);
+            return;
+        }
+
+        std::string dir_url;
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            auto it = watches.find(event.wd);
+            if (it == watches.end()) return;
+            dir_url = it->second;
+            if (event.mask & IN_IGNORED) {
+                watches.erase(it);
+                return;
+            }
+        }
+
+        if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            notify(dir_url, true);
+            return;
+        }
+
+        bool is_dir = (event.mask & IN_ISDIR) != 0;
+        std::string url_path = dir_url + "/" + (event.len > 0 ? std::string(event.name) : std::string());
+        if (event.len == 0) url_path = dir_url;
+
+        // 新建或移入的目录也需要监视
+        if (is_dir && (event.mask & (IN_CREATE | IN_MOVED_TO))) {
+            add_watch_recursive(root_dir + url_path, url_path);
+        }
+        notify(url_path, is_dir);
+    }
+
+    int inotify_fd = -1;
+    std::string root_dir;
+    std::vector<Listener> listeners;
+    std::mutex watch_mutex;
+    std::unordered_map<int, std::string> watches;  // wd -> 目录的URL路径
+    std::thread thread;
+};
+
+FsWatcher fs_watcher;
+
+// 缓存的小文件：文件内容和预先生成的响应头
+struct CachedFile {
+    std::shared_ptr<const std::string> bytes;
+    std::string content_type;
+    std::string etag;
+    std::time_t mtime;
+    std::string validators;  // 304响应使用的头部
+    std::string headers;     // 200响应使用的头部
+    std::shared_ptr<const CachedFile> gzip;  // 预压缩版本（可能没有）
+    bool compressible = false;               // 没有预压缩版本时可以即时压缩
+    std::string stream_etag;                 // 即时压缩版本的弱ETag
+    std::string stream_headers;              // 即时压缩版本的校验头部
+};
+
+// 热点小文件缓存：按路径哈希分片，每个分片独立加锁，按大小和LRU淘汰，由inotify失效。
+// 命中时不需要任何文件系统调用。也用于缓存生成好的目录列表页面。
+class FileCache {
+public:
+    explicit FileCache(size_t shards_count = 16)
+        : shard_count(shards_count), shards(new Shard[shards_count]) {}
+
+    void configure(size_t capacity_bytes, size_t max_file) {
+        shard_capacity = capacity_bytes / shard_count;
+        max_file_size = std::min(max_file, shard_capacity);
+    }
+
+    bool enabled() const { return shard_capacity > 0; }
+
+    std::shared_ptr<const CachedFile> lookup(const std::string& key) {
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) return nullptr;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_pos);
+        return it->second.file;
+    }
+
+    // 读取文件并放入缓存；文件不是普通文件或太大时返回nullptr，太大时不做任何系统调用。
+    // file、gzip_file为调用方已打开的文件（info、gzip_info是它们的元数据），这时只需pread；为空时自己打开。
+    // gzip_path不为空时一并读入预压缩版本
+    std::shared_ptr<const CachedFile> load(const std::string& key, const std::string& file_path,
+        const std::shared_ptr<FileHandle>& file, const FileInfo& info,
+        std::string_view content_type, std::string_view cache_control, const std::string& vary_headers,
+        const std::string& gzip_path, const std::shared_ptr<FileHandle>& gzip_file, const FileInfo& gzip_info,
+        bool compressible) {
+        if (info.is_dir || info.size < 0 || static_cast<unsigned long long>(info.size) > max_file_size) return nullptr;
+        // 读取期间如有任何失效通知，结果可能已过期，不放入缓存
+        unsigned long long epoch_before = epoch.load(std::memory_order_acquire);
+
+        auto entry = read_file(file_path, file, info, content_type, cache_control, vary_headers, compressible);
+        if (!entry) return nullptr;
+        if (!gzip_path.empty()) {
+            entry->gzip = read_file(gzip_path, gzip_file, gzip_info, content_type, cache_control,
+                "Content-Encoding: gzip\r\n" + vary_headers, false);
+        }
+
+        if (epoch.load(std::memory_order_acquire) == epoch_before) {
+            insert(key, entry);
+        }
+        return entry;
+    }
+
+    // 生成内容前取得当前版本号，传给store
+    unsigned long long current_epoch() const {
+        return epoch.load(std::memory_order_acquire);
+    }
+
+    // 放入已生成的内容；生成期间有过失效通知时不放入
+    void store(const std::string& key, const std::shared_ptr<const CachedFile>& entry, unsigned long long epoch_before) {
+        if (entry->bytes->size() > max_file_size || epoch.load(std::memory_order_acquire) != epoch_before) return;
+        insert(key, entry);
+    }
+
+    // 路径变化时调用；is_dir为true时同时清掉目录下的所有条目，路径为空时清空缓存
+    void invalidate(const std::string& url_path, bool is_dir) {
+        epoch.fetch_add(1, std::memory_order_acq_rel);
+        if (url_path.empty()) {
+            for (size_t i = 0; i < shard_count; ++i) {
+                Shard& shard = shards[i];
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.entries.clear();
+                shard.lru.clear();
+                shard.bytes = 0;
+            }
+            return;
+        }
+
+        if (!is_dir) {
+            Shard& shard = shard_for(url_path);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            erase(shard, url_path);
+            return;
+        }
+
+        std::string prefix = url_path + "/";
+        for (size_t i = 0; i < shard_count; ++i) {
+            Shard& shard = shards[i];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.lru.begin(); it != shard.lru.end();) {
+                const std::string& key = *it++;
+                if (key == url_path || key.compare(0, prefix.size(), prefix) == 0) erase(shard, key);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const CachedFile> file;
+        std::list<std::string>::iterator lru_pos;
+        size_t charge;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<std::string> lru;  // 头部为最近使用
+        std::unordered_map<std::string, Entry> entries;
+        size_t bytes = 0;
+    };
+
+    // opened为空时打开file_path并以fstat的结果代替known_info
+    std::shared_ptr<CachedFile> read_file(const std::string& file_path, std::shared_ptr<FileHandle> opened,
+        const FileInfo& known_info, std::string_view content_type, std::string_view cache_control,
+        const std::string& extra_headers, bool compressible) {
+        FileInfo info = known_info;
+        if (!opened) {
+            int fd = open_file_readonly(file_path);
+            if (fd < 0) return nullptr;
+            opened = std::make_shared<FileHandle>(fd);
+            if (!stat_fd(fd, info)) return nullptr;
+        }
+        if (info.is_dir || info.size < 0 || static_cast<unsigned long long>(info.size) > max_file_size) return nullptr;
+        const FileHandle& file = *opened;
+
+        auto bytes = std::make_shared<std::string>(static_cast<size_t>(info.size), '\0');
+        size_t total = 0;
+        while (total < bytes->size()) {
+            ssize_t n = read_file_at(file, &(*bytes)[total], bytes->size() - total, static_cast<long long>(total));
+            if (n <= 0) return nullptr;
+            total += static_cast<size_t>(n);
+        }
+
+        auto entry = std::make_shared<CachedFile>();
+        entry->bytes = bytes;
+        entry->content_type = content_type;
+        entry->etag = make_etag(info);
+        entry->mtime = info.mtime;
+        entry->validators = make_validator_headers(info, cache_control) + extra_headers;
+        entry->headers = "Accept-Ranges: bytes\r\n" + entry->validators;
+        entry->compressible = compressible;
+        if (compressible) {
+            entry->stream_etag = make_etag(info, true);
+            entry->stream_headers = make_validator_headers(info, cache_control, true) + extra_headers;
+        }
+        return entry;
+    }
+
+    Shard& shard_for(const std::string& key) {
+        return shards[std::hash<std::string>()(key) % shard_count];
+    }
+
+    void insert(const std::string& key, const std::shared_ptr<const CachedFile>& file) {
+        size_t charge = file->bytes->size() + file->headers.size() + file->stream_headers.size() + key.size() * 2 + 128;
+        if (file->gzip) charge += file->gzip->bytes->size() + file->gzip->headers.size();
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        erase(shard, key);
+        while (!shard.lru.empty() && shard.bytes + charge > shard_capacity) {
+            erase(shard, shard.lru.back());
+        }
+        if (charge > shard_capacity) return;
+        shard.lru.push_front(key);
+        shard.entries[key] = Entry{ file, shard.lru.begin(), charge };
+        shard.bytes += charge;
+    }
+
+    void erase(Shard& shard, const std::string& key) {
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) return;
+        shard.bytes -= it->second.charge;
+        shard.lru.erase(it->second.lru_pos);
+        shard.entries.erase(it);
+    }
+
+    size_t shard_count;
+    std::unique_ptr<Shard[]> shards;
+    size_t shard_capacity = 0;
+    size_t max_file_size = 0;
+    std::atomic<unsigned long long> epoch{ 0 };
+};
+
+FileCache file_cache;
+// 目录列表页面缓存，键为以/结尾的目录URL；页面可能很大，分片少一些，单个页面的上限更高
+FileCache listing_cache(4);
+
+// 路径查找的结果：exists为false表示路径不存在（负缓存）；目录和打不开的文件只有元数据，file为空
+struct OpenedPath {
+    bool exists = false;
+    FileInfo info;
+    std::shared_ptr<FileHandle> file;
+};
+
+// 文件描述符和元数据缓存：按URL路径缓存已打开的fd和statx结果，也缓存不存在的路径，由inotify失效。
+// 命中时不需要任何文件系统调用。fd由shared_ptr计数，条目被淘汰或失效后，正在发送的响应仍持有它，发完才关闭
+class OpenFileCache {
+public:
+    explicit OpenFileCache(size_t shards_count = 16)
+        : shard_count(shards_count), shards(new Shard[shards_count]) {}
+
+    void configure(size_t max_entries) {
+        shard_capacity = (max_entries + shard_count - 1) / shard_count;
+    }
+
+    bool enabled() const { return shard_capacity > 0; }
+
+    // url_path为解码后的请求路径，目录末尾的/可有可无；file_path为对应的本地路径
+    std::shared_ptr<const OpenedPath> lookup(const std::string& url_path, const std::string& file_path) {
+        if (!enabled()) return open_path(file_path);
+        std::string key = url_path;
+        if (!key.empty() && key.back() == '/') key.pop_back();
+        Shard& shard = shard_for(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_pos);
+                return it->second.opened;
+            }
+        }
+
+        // 打开期间如有任何失效通知，结果可能已过期，不放入缓存
+        unsigned long long epoch_before = epoch.load(std::memory_order_acquire);
+        auto opened = open_path(file_path);
+        if (epoch.load(std::memory_order_acquire) == epoch_before) insert(shard, key, opened);
+        return opened;
+    }
+
+    // 只查缓存，不打开文件、不调整LRU顺序；未命中返回空
+    std::shared_ptr<const OpenedPath> peek(std::string key) {
+        if (!enabled()) return nullptr;
+        if (!key.empty() && key.back() == '/') key.pop_back();
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        return it != shard.entries.end() ? it->second.opened : nullptr;
+    }
+
+    // 路径变化时调用：清掉它和所在目录的条目（目录的修改时间随条目增删而变），
+    // is_dir为true时同时清掉目录下的所有条目，路径为空时清空缓存
+    void invalidate(const std::string& url_path, bool is_dir) {
+        epoch.fetch_add(1, std::memory_order_acq_rel);
+        if (url_path.empty()) {
+            for (size_t i = 0; i < shard_count; ++i) {
+                Shard& shard = shards[i];
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.entries.clear();
+                shard.lru.clear();
+            }
+            return;
+        }
+
+        for (const std::string& key : { url_path, url_path.substr(0, url_path.rfind('/')) }) {
+            Shard& shard = shard_for(key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            erase(shard, key);
+        }
+        if (!is_dir) return;
+
+        std::string prefix = url_path + "/";
+        for (size_t i = 0; i < shard_count; ++i) {
+            Shard& shard = shards[i];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.lru.begin(); it != shard.lru.end();) {
+                const std::string& key = *it++;
+                if (key.compare(0, prefix.size(), prefix) == 0) erase(shard, key);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const OpenedPath> opened;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<std::string> lru;  // 头部为最近使用
+        std::unordered_map<std::string, Entry> entries;
+    };
+
+    // 一次open加一次statx；不存在的路径只有一次失败的open
+    static std::shared_ptr<const OpenedPath> open_path(const std::string& file_path) {
+        auto opened = std::make_shared<OpenedPath>();
+        // O_NONBLOCK：打开FIFO不会阻塞，对普通文件的读和sendfile没有影响
+        int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0) {
+            // 没有读权限等情况：路径存在，但不缓存fd
+            if (errno != ENOENT && errno != ENOTDIR) opened->exists = stat_path(file_path, opened->info);
+            return opened;
+        }
+        auto file = std::make_shared<FileHandle>(fd);
+        if (!statx_fd(fd, opened->info)) return opened;
+        opened->exists = true;
+        // 目录只需要元数据，不占用fd
+        if (!opened->info.is_dir) opened->file = std::move(file);
+        return opened;
+    }
+
+    Shard& shard_for(const std::string& key) {
+        return shards[std::hash<std::string>()(key) % shard_count];
+    }
+
+    void insert(Shard& shard, const std::string& key, const std::shared_ptr<const OpenedPath>& opened) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        erase(shard, key);
+        while (!shard.lru.empty() && shard.entries.size() >= shard_capacity) {
+            erase(shard, shard.lru.back());
+        }
+        shard.lru.push_front(key);
+        shard.entries[key] = Entry{ opened, shard.lru.begin() };
+    }
+
+    void erase(Shard& shard, const std::string& key) {
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) return;
+        shard.lru.erase(it->second.lru_pos);
+        shard.entries.erase(it);
+    }
+
+    size_t shard_count;
+    std::unique_ptr<Shard[]> shards;
+    size_t shard_capacity = 0;
+    std::atomic<unsigned long long> epoch{ 0 };
+};
+
+OpenFileCache open_file_cache;
+
+// 用缓存的文件构造响应，内容与缓存共享，不复制；条件请求命中时返回304
+HttpResponse make_cached_response(const HttpRequest& request, const CachedFile& entry) {
+    // 没有预压缩版本的文本文件即时压缩
+    if (!entry.gzip && entry.compressible && should_compress(request, static_cast<long long>(entry.bytes->size()))) {
+        if (is_not_modified(request, entry.stream_etag, entry.mtime)) {
+            HttpResponse response = make_not_modified_response(entry.stream_headers);
+            response.head_only = request.method == "HEAD";
+            return response;
+        }
+        HttpResponse response;
+        response.status = "200 OK";
+        response.content_type = entry.content_type;
+        response.headers = entry.stream_headers;
+        BodySegment seg;
+        seg.shared_data = entry.bytes;
+        response.body.push_back(std::move(seg));
+        compress_response(response);
+        response.head_only = request.method == "HEAD";
+        return response;
+    }
+
+    // 客户端接受gzip时使用预压缩版本
+    const CachedFile& cached = (entry.gzip && accepts_gzip(request)) ? *entry.gzip : entry;
+    if (is_not_modified(request, cached.etag, cached.mtime)) {
+        HttpResponse response = make_not_modified_response(cached.validators);
+        response.head_only = request.method == "HEAD";
+        return response;
+    }
+
+    HttpResponse response;
+    response.status = "200 OK";
+    response.content_type = cached.content_type;
+    response.headers = cached.headers;
+    if (!cached.bytes->empty()) {
+        BodySegment seg;
+        seg.shared_data = cached.bytes;
+        response.body.push_back(std::move(seg));
+    }
+    response.head_only = request.method == "HEAD";
+    return response;
+}
+
+// 可以走缓存的静态文件或目录列表请求返回true，key为补全index.html后的解码路径（与route_request一致），
+// 目录列表的key以/结尾
+bool static_cache_key(const HttpRequest& request, std::string& key) {
+    if ((request.method != "GET" && request.method != "HEAD") || request.find_header("Range")) return false;
+    if (request.path_status != UrlStatus::Ok || request.path.compare(0, 10, "/download/") == 0) return false;
+    key = request.path.empty() || request.path == "/" ? std::string("/index.html") : request.path;
+    // 带查询参数的目录请求（如format=json）不是缓存的页面
+    return key.back() != '/' || target_query(request.target).empty();
+}
+
+// 事件循环把请求交给线程池之前按预计的响应大小选择通道，只查文件描述符缓存、不做系统调用：
+// 缓存中已知的大文件走大文件传输通道，/download/下大小未知的文件也按大文件处理，其他未知的走低延迟通道
+Lane predict_lane(const HttpRequest& request) {
+    if (request.method == "HEAD" || request.path_status != UrlStatus::Ok) return Lane::Latency;
+    const std::string& path = request.path;
+    bool download = path.compare(0, 10, "/download/") == 0;
+    auto opened = open_file_cache.peek(download ? path.substr(9) : path);
+    if (!opened || !opened->exists) return download ? Lane::Bulk : Lane::Latency;
+    return !opened->info.is_dir && opened->info.size >= bulk_min_size() ? Lane::Bulk : Lane::Latency;
+}
+#endif
+
+// 查找路径的元数据，能打开时一并返回已打开的文件。Linux上经过文件描述符缓存，其他平台只stat、不打开
+bool lookup_file(const std::string& url_path, const std::string& file_path, FileInfo& info,
+    std::shared_ptr<FileHandle>& file) {
+#if defined(__linux__)
+    auto opened = open_file_cache.lookup(url_path, file_path);
+    info = opened->info;
+    file = opened->file;
+    return opened->exists;
+#else
+    (void)url_path;
+    file.reset();
+    return stat_path(file_path, info);
+#endif
+}
+
+#if defined(__linux__) && defined(LAN_HTTP_USE_ZLIB)
+// 后台压缩线程：在GZIP_CACHE_DIR中生成与网站目录结构相同的.gz文件，
+// 生成的文件修改时间与原文件一致，原文件变化后自然失效并重新生成
+class GzipBuilder {
+public:
+    // 压缩完成后回调（用于让热点缓存重新加载）
+    std::function<void(const std::string& url_path)> on_built;
+
+    void request(const std::string& url_path, const std::string& source_path, const FileInfo& info) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string job_key = url_path + "@" + std::to_string(static_cast<long long>(info.mtime)) +
+            "." + std::to_string(info.mtime_nsec);
+        if (pending.count(job_key) || skipped.count(job_key)) return;
+        if (!thread.joinable()) {
+            thread = std::thread([this] { run(); });
+            thread.detach();
+        }
+        pending[job_key] = true;
+        jobs.push(Job{ url_path, source_path, info.mtime, info.mtime_nsec, job_key });
+        condition.notify_one();
+    }
+
+private:
+    struct Job {
+        std::string url_path;
+        std::string source_path;
+        std::time_t mtime;
+        long long mtime_nsec;
+        std::string key;
+    };
+
+    void run() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return !jobs.empty(); });
+                job = jobs.front();
+                jobs.pop();
+            }
+            bool built = build(job);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.erase(job.key);
+                // 压缩后没有变小的文件不再尝试
+                if (!built) skipped[job.key] = true;
+            }
+            if (built && on_built) on_built(job.url_path);
+        }
+    }
+
+    // 逐级创建目录
+    static void make_parent_dirs(const std::string& file_path) {
+        for (size_t pos = file_path.find('/', 1); pos != std::string::npos; pos = file_path.find('/', pos + 1)) {
+            mkdir(file_path.substr(0, pos).c_str(), 0755);
+        }
+    }
+
+    // 从文件描述符逐块读入、逐块压缩并写出，内存占用与文件大小无关
+    bool build(const Job& job) {
+        int fd = open_file_readonly(job.source_path);
+        if (fd < 0) return false;
+        FileHandle source(fd);
+        // 排队期间文件变了就不生成，新版本由之后的请求重新安排
+        FileInfo info;
+        if (!stat_fd(fd, info) || info.is_dir || info.size > GZIP_MAX_SIZE ||
+            info.mtime != job.mtime || info.mtime_nsec != job.mtime_nsec) {
+            return false;
+        }
+
+        z_stream stream{};
+        // windowBits 15+16：输出gzip格式
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+
+        // 先写临时文件再改名，避免请求读到写了一半的文件
+        std::string target = GZIP_CACHE_DIR + job.url_path + ".gz";
+        std::string temp = target + ".tmp";
+        make_parent_dirs(target);
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        bool ok = static_cast<bool>(out);
+        std::string input(INPUT_CHUNK, '\0');
+        std::string output(OUTPUT_CHUNK, '\0');
+        long long offset = 0;
+        int rc = Z_OK;
+        while (ok) {
+            size_t take = static_cast<size_t>(std::min<long long>(INPUT_CHUNK, info.size - offset));
+            ssize_t n = take > 0 ? read_file_at(source, &input[0], take, offset) : 0;
+            if (n < 0 || (n == 0 && take > 0)) {
+                ok = false;  // 读取出错或文件被截断
+                break;
+            }
+            offset += n;
+            bool last = offset >= info.size;
+            stream.next_in = reinterpret_cast<Bytef*>(&input[0]);
+            stream.avail_in = static_cast<uInt>(n);
+            do {
+                stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                stream.avail_out = static_cast<uInt>(output.size());
+                rc = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+                if (rc == Z_STREAM_ERROR) {
+                    ok = false;
+                    break;
+                }
+                ok = static_cast<bool>(out.write(output.data(),
+                    static_cast<std::streamsize>(output.size() - stream.avail_out)));
+            } while (ok && (stream.avail_out == 0 || (last && rc != Z_STREAM_END)));
+            if (last) break;
+        }
+        // 压缩后没有变小的文件不保留
+        ok = ok && rc == Z_STREAM_END && static_cast<long long>(stream.total_out) < info.size;
+        deflateEnd(&stream);
+        out.close();
+        if (!ok || out.fail()) {
+            unlink(temp.c_str());
+            return false;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = job.mtime;
+        times[0].tv_nsec = times[1].tv_nsec = job.mtime_nsec;
+        utimensat(AT_FDCWD, temp.c_str(), times, 0);
+        return rename(temp.c_str(), target.c_str()) == 0;
+    }
+
+    static constexpr long long INPUT_CHUNK = 256 * 1024;  // 每次读入压缩的源数据量
+    static constexpr size_t OUTPUT_CHUNK = 64 * 1024;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::queue<Job> jobs;
+    std::map<std::string, bool> pending;
+    std::map<std::string, bool> skipped;
+    std::thread thread;
+};
+
+GzipBuilder gzip_builder;
+#endif
+
+// 查找文件的gzip预压缩版本：先找同目录下的file.gz（不能比原文件旧），
+// 再找后台缓存目录中生成的版本；都没有时安排后台生成。同目录下的版本已打开时由gzip_file返回
+bool find_gzip_variant(const std::string& url_path, const std::string& file_path, const FileInfo& info,
+    std::string& gzip_path, FileInfo& gzip_info, std::shared_ptr<FileHandle>& gzip_file) {
+    gzip_path = file_path + ".gz";
+    if (lookup_file(url_path + ".gz", gzip_path, gzip_info, gzip_file) && !gzip_info.is_dir &&
+        gzip_info.mtime >= info.mtime) {
+        return true;
+    }
+    gzip_file.reset();
+
+#if defined(__linux__) && defined(LAN_HTTP_USE_ZLIB)
+    if (!GZIP_CACHE_DIR.empty() && info.size >= GZIP_MIN_SIZE && info.size <= GZIP_MAX_SIZE) {
+        gzip_path = GZIP_CACHE_DIR + url_path + ".gz";
+        if (stat_path(gzip_path, gzip_info) && !gzip_info.is_dir &&
+            gzip_info.mtime == info.mtime && gzip_info.mtime_nsec == info.mtime_nsec) {
+            return true;
+        }
+        gzip_builder.request(url_path, file_path, info);
+    }
+#else
+    (void)url_path;
+#endif
+    gzip_path.clear();
+    return false;
+}
+
+constexpr size_t LISTING_STREAM_THRESHOLD = 256 * 1024;  // 页面超过这个大小时改为边读目录边发送，也不进缓存
+constexpr size_t LISTING_CHUNK_SIZE = 32 * 1024;         // 流式发送时每个chunk的页面大小
+constexpr long long LISTING_PAGE_DEFAULT = 1000;         // JSON接口默认每页条目数
+constexpr long long LISTING_PAGE_MAX = 10000;
+
+// 按浏览器的方式对路径做百分号编码，保留'/'和不需要编码的字符
+void append_url_encoded(std::string& out, std::string_view path) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (unsigned char c : path) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '/' || c == '.' || c == '-' || c == '_' || c == '~') {
+            out += static_cast<char>(c);
+        }
+        else {
+            out += '%';
+            out += digits[c >> 4];
+            out += digits[c & 0x0F];
+        }
+    }
+}
+
+// 转义HTML文本和属性值中的特殊字符
+void append_html_escaped(std::string& out, std::string_view text) {
+    for (char c : text) {
+        switch (c) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        case '\'': out += "&#39;"; break;
+        default: out += c;
+        }
+    }
+}
+
+// 转义JSON字符串中的引号、反斜杠和控制字符
+void append_json_escaped(std::string& out, std::string_view text) {
+    static const char digits[] = "0123456789abcdef";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20) {
+            out += "\\u00";
+            out += digits[c >> 4];
+            out += digits[c & 0x0F];
+        }
+        else {
+            out += static_cast<char>(c);
+        }
+    }
+}
+
+// 目录条目；只知道类型时stated为false，info中的大小和修改时间无效
+struct DirEntry {
+    std::string name;
+    FileInfo info;
+    bool stated = false;
+};
+
+// 逐个读取目录条目（跳过.和..）。POSIX上类型取自d_type，只有类型未知或是符号链接时才fstatat；
+// Windows的FindNextFileW本身就带有大小和修改时间
+class DirectoryReader {
+public:
+    explicit DirectoryReader(const std::string& dir_path) {
+#if defined(_WIN32)
+        int wlen = MultiByteToWideChar(CP_UTF8, 0, dir_path.c_str(), -1, nullptr, 0);
+        if (wlen > 0) {
+            std::wstring pattern(wlen, 0);
+            MultiByteToWideChar(CP_UTF8, 0, dir_path.c_str(), -1, &pattern[0], wlen);
+            pattern.pop_back();  // 移除null终止符
+            pattern += L"\\*";
+            handle = FindFirstFileW(pattern.c_str(), &find_data);
+        }
+        has_pending = handle != INVALID_HANDLE_VALUE;
+#else
+        dir = opendir(dir_path.c_str());
+#endif
+    }
+
+    ~DirectoryReader() {
+#if defined(_WIN32)
+        if (handle != INVALID_HANDLE_VALUE) FindClose(handle);
+#else
+        if (dir) closedir(dir);
+#endif
+    }
+
+    DirectoryReader(const DirectoryReader&) = delete;
+    DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+    // 读下一个条目，读完（或出错）返回false
+    bool next(DirEntry& entry) {
+#if defined(_WIN32)
+        while (has_pending) {
+            WIN32_FIND_DATAW data = find_data;
+            has_pending = FindNextFileW(handle, &find_data) != 0;
+            if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) continue;
+
+            // 将宽字符文件名转换为UTF-8
+            int size_needed = WideCharToMultiByte(CP_UTF8, 0, data.cFileName, -1, nullptr, 0, nullptr, nullptr);
+            entry.name.assign(size_needed, 0);
+            WideCharToMultiByte(CP_UTF8, 0, data.cFileName, -1, &entry.name[0], size_needed, nullptr, nullptr);
+            entry.name.pop_back();
+            entry.info = FileInfo();
+            entry.info.is_dir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            entry.info.size = entry.info.is_dir ? 0 :
+                static_cast<long long>((static_cast<unsigned long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow);
+            // FILETIME是1601年起的100纳秒数
+            ULARGE_INTEGER write_time;
+            write_time.LowPart = data.ftLastWriteTime.dwLowDateTime;
+            write_time.HighPart = data.ftLastWriteTime.dwHighDateTime;
+            entry.info.mtime = static_cast<std::time_t>((write_time.QuadPart - 116444736000000000ULL) / 10000000ULL);
+            entry.stated = true;
+            return true;
+        }
+        return false;
+#else
+        if (!dir) return false;
+        while (struct dirent* ent = readdir(dir)) {
+            const char* name = ent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            entry.name = name;
+            entry.info = FileInfo();
+            entry.stated = false;
+#if defined(DT_UNKNOWN)
+            if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+                entry.info.is_dir = ent->d_type == DT_DIR;
+                return true;
+            }
+#endif
+            // 类型未知或是符号链接：跟随链接取类型，断开的链接跳过
+            if (stat_entry(entry)) return true;
+        }
+        return false;
+#endif
+    }
+
+    // 取条目的大小和修改时间：相对目录的文件描述符fstatat，不必拼接完整路径
+    bool stat_entry(DirEntry& entry) {
+        if (entry.stated) return true;
+#if defined(_WIN32)
+        return false;
+#else
+        native_stat st;
+        if (!dir || fstatat(dirfd(dir), entry.name.c_str(), &st, 0) != 0) return false;
+        fill_file_info(st, entry.info);
+        if (entry.info.is_dir) entry.info.size = 0;
+        entry.stated = true;
+        return true;
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAW find_data;
+    bool has_pending = false;
+#else
+    DIR* dir = nullptr;
+#endif
+};
+
+// 目录列表页面（会阻塞在readdir上，不再逐个stat）。render一次生成到limit字节为止，
+// 目录太大时剩下的部分作为数据流由next继续读，每次输出一个chunk。
+// render和next都只在工作线程中运行：事件循环只发送已生成的chunk，从不读目录
+class ListingStream : public BodyStream {
+public:
+    ListingStream(const std::string& url_path, const std::string& dir_path) : path(url_path), reader(dir_path) {}
+
+    // 继续生成页面追加到html，读完目录返回true，页面达到limit字节时返回false
+    bool render(std::string& html, size_t limit) {
+        if (!started) {
+            started = true;
+            html += "<html><head><title>Directory Listing</title>"
+                "<meta charset=\"UTF-8\">"  // 添加UTF-8字符集声明
+                "<style>"
+                "body { font-family: Arial, sans-serif; margin: 20px; }"
+                "h1 { color: #333; }"
+                "ul { list-style-type: none; padding: 0; }"
+                "li { margin: 5px 0; }"
+                "a { text-decoration: none; color: #0066cc; }"
+                "a:hover { text-decoration: underline; }"
+                "</style></head>"
+                "<body><h1>Directory Listing: ";
+            append_html_escaped(html, path);
+            html += "</h1><ul>";
+        }
+        while (html.size() < limit) {
+            if (!reader.next(entry)) {
+                html += "</ul></body></html>";
+                finished = true;
+                return true;
+            }
+            // 链接按百分号编码，文件名中的?、#等不会被当成查询串或片段
+            item_path.assign(path);
+            item_path += entry.name;
+            html += "<li><a href=\"";
+            if (entry.info.is_dir) {
+                append_url_encoded(html, item_path);
+                html += "/\">";
+                append_html_escaped(html, entry.name);
+                html += "/</a></li>";
+            }
+            else {
+                // 确保下载路径以/download/开头，后面是完整的文件路径
+                append_url_encoded(html, item_path);
+                html += "\">";
+                append_html_escaped(html, entry.name);
+                html += "</a> (<a href=\"/download";
+                append_url_encoded(html, item_path);
+                html += "\">Download</a>)</li>";
+            }
+        }
+        return false;
+    }
+
+    // 已经生成、还没发出的页面开头，作为第一个chunk
+    void set_prefix(std::string&& html) {
+        chunk = std::move(html);
+    }
+
+    StreamStatus next(std::string& out) override {
+        if (chunk.empty() && !finished) render(chunk, LISTING_CHUNK_SIZE);
+        append_chunk(out, chunk);
+        chunk.clear();
+        if (!finished) return StreamStatus::More;
+        out += "0\r\n\r\n";
+        return StreamStatus::Done;
+    }
+
+private:
+    std::string path;  // 以/结尾的URL路径（已解码）
+    DirectoryReader reader;
+    DirEntry entry;
+    std::string item_path;
+    std::string chunk;
+    bool started = false;
+    bool finished = false;
+};
+
+// 解析非负整数查询参数，没有该参数时用默认值，超出[0, max]或不是数字时返回false
+bool parse_query_number(std::string_view query, std::string_view name, long long fallback, long long max,
+    long long& value) {
+    auto text = query_param(query, name);
+    if (!text) {
+        value = fallback;
+        return true;
+    }
+    auto result = std::from_chars(text->data(), text->data() + text->size(), value);
+    return result.ec == std::errc() && result.ptr == text->data() + text->size() && value >= 0 && value <= max;
+}
+
+// 目录列表的JSON接口，供页面分页：?format=json&offset=&limit=&sort=。
+// sort为name（默认）、size或mtime，前面加-表示降序；目录总排在文件前面。
+// 按名字排序时只靠d_type，只有当前页的条目才fstatat取大小和修改时间
+HttpResponse make_listing_json(const HttpRequest& request, const std::string& path, const std::string& file_path,
+    std::string_view query) {
+    long long offset = 0;
+    long long limit = 0;
+    std::string_view sort = query_param(query, "sort").value_or("name");
+    bool descending = !sort.empty() && sort[0] == '-';
+    if (descending) sort.remove_prefix(1);
+    if (!parse_query_number(query, "offset", 0, std::numeric_limits<long long>::max(), offset) ||
+        !parse_query_number(query, "limit", LISTING_PAGE_DEFAULT, LISTING_PAGE_MAX, limit) ||
+        (sort != "name" && sort != "size" && sort != "mtime")) {
+        return make_response("400 Bad Request", "text/plain", "Bad Request");
+    }
+
+    DirectoryReader reader(file_path);
+    std::vector<DirEntry> entries;
+    DirEntry entry;
+    bool by_name = sort == "name";
+    bool by_size = sort == "size";
+    // fstatat失败（比如条目刚被删除）时仍保留该条目，用d_type得到的类型、大小和时间记为0，total与条目数一致
+    while (reader.next(entry)) {
+        if (!by_name) reader.stat_entry(entry);
+        entries.push_back(std::move(entry));
+    }
+    std::sort(entries.begin(), entries.end(), [&](const DirEntry& a, const DirEntry& b) {
+        if (a.info.is_dir != b.info.is_dir) return a.info.is_dir;
+        if (!by_name) {
+            long long ka = by_size ? a.info.size : static_cast<long long>(a.info.mtime);
+            long long kb = by_size ? b.info.size : static_cast<long long>(b.info.mtime);
+            if (ka != kb) return descending ? ka > kb : ka < kb;
+        }
+        return descending && by_name ? a.name > b.name : a.name < b.name;
+        });
+
+    size_t total = entries.size();
+    size_t begin = static_cast<size_t>(std::min<long long>(offset, static_cast<long long>(total)));
+    size_t end = begin + static_cast<size_t>(std::min<long long>(limit, static_cast<long long>(total - begin)));
+    std::string json = "{\"path\":\"";
+    append_json_escaped(json, path);
+    json += "\",\"total\":" + std::to_string(total) + ",\"offset\":" + std::to_string(begin) +
+        ",\"limit\":" + std::to_string(limit) + ",\"sort\":\"" + (descending ? "-" : "") + std::string(sort) +
+        "\",\"entries\":[";
+    for (size_t i = begin; i < end; ++i) {
+        DirEntry& item = entries[i];
+        reader.stat_entry(item);
+        json += i == begin ? "{\"name\":\"" : ",{\"name\":\"";
+        append_json_escaped(json, item.name);
+        json += item.info.is_dir ? "\",\"type\":\"dir\"" : "\",\"type\":\"file\"";
+        json += ",\"size\":" + std::to_string(item.info.size) +
+            ",\"mtime\":" + std::to_string(static_cast<long long>(item.info.mtime)) + "}";
+    }
+    json += "]}\n";
+
+    std::string headers = "Cache-Control: no-cache\r\n";
+#if defined(LAN_HTTP_USE_ZLIB)
+    headers += "Vary: Accept-Encoding\r\n";
+#endif
+    HttpResponse response = make_response("200 OK", "application/json", json, headers);
+    if (should_compress(request, static_cast<long long>(json.size()))) compress_response(response);
+    return response;
+}
+
+// 按请求路径路由（会阻塞在stat、open、readdir等文件操作上）
+HttpResponse route_request(const HttpRequest& request) {
+    // 检查是否为GET/HEAD请求
+    if (request.method != "GET" && request.method != "HEAD") {
+        return make_response("405 Method Not Allowed", "text/plain", "Method Not Allowed");
+    }
+
+    // 路径在解析时已解码，同时检查了编码和路径遍历攻击；查询串不解码，参数由query_param取出
+    std::string path = request.path;
+    std::string_view query = target_query(request.target);
+    if (request.path_status == UrlStatus::BadRequest) {
+        return make_response("400 Bad Request", "text/plain", "Bad Request");
+    }
+    if (request.path_status == UrlStatus::Forbidden) {
+        return make_response("403 Forbidden", "text/plain", "Forbidden");
+    }
+
+    // 保留路径：统计信息
+    if (path == "/__stats") return make_stats_response(query_param(query, "format") == std::string_view("json"));
+
+    // 处理下载请求 - 修复路径处理
+    if (path.find("/download/") == 0) {
+        // 正确提取文件路径
+        std::string file_path = ROOT_DIR + path.substr(9);
+        FileInfo info;
+        std::shared_ptr<FileHandle> file;
+        if (!lookup_file(path.substr(9), file_path, info, file) || info.is_dir) {
+            std::cerr << "File does not exist: " << file_path << std::endl;
+            return make_response("404 Not Found", "text/plain", "File Not Found");
+        }
+
+        std::string_view cache_control = get_cache_control(get_extension(file_path));
+        // 条件请求命中时不打开文件
+        if (is_not_modified(request, make_etag(info), info.mtime)) {
+            return make_not_modified_response(make_validator_headers(info, cache_control));
+        }
+        if (file) return make_file_response(request, file_path, file, info, "application/octet-stream", cache_control, true);
+        return make_file_response(request, file_path, "application/octet-stream", cache_control, true);
+    }
+
+    // 默认文件为index.html
+    if (path == "/" || path.empty()) path = "/index.html";
+
+    // 构造文件路径
+    std::string file_path = ROOT_DIR + path;
+
+    #if defined(_WIN32)
+        // 将所有'/'替换为'\\'，保证Windows路径兼容
+        std::replace(file_path.begin(), file_path.end(), '/', '\\');
+    #endif
+
+    // 只查找一次：目录、不存在、条件请求都由这一次的结果判断，文件描述符缓存命中时不需要系统调用
+    FileInfo info;
+    std::shared_ptr<FileHandle> file;
+    bool exists = lookup_file(path, file_path, info, file);
+
+    // 检查是否为目录
+    if (exists && info.is_dir) {
+        // 确保路径以斜杠结尾（沿用请求中原样的编码和查询串）
+        if (path.back() != '/') {
+            std::string location(target_path(request.target));
+            location += '/';
+            if (!query.empty()) location.append("?").append(query);
+            return make_response("301 Moved Permanently", "text/plain", "", "Location: " + location + "\r\n");
+        }
+
+        if (query_param(query, "format") == std::string_view("json")) {
+            return make_listing_json(request, path, file_path, query);
+        }
+
+#if defined(__linux__)
+        // 目录未变化（inotify没有通知失效，且ETag与缓存一致）时直接使用缓存的页面
+        std::string etag = make_etag(info);
+        if (listing_cache.enabled()) {
+            auto cached = listing_cache.lookup(path);
+            if (cached && cached->etag == etag) return make_cached_response(request, *cached);
+        }
+        unsigned long long epoch_before = listing_cache.current_epoch();
+#endif
+
+        // 先生成到LISTING_STREAM_THRESHOLD为止。读完了就是普通的页面（可缓存、可压缩）；
+        // 没读完说明目录很大，已生成的部分作为第一个chunk，剩下的边读目录边发送。HTTP/1.0不支持chunked，只能整页生成
+        auto listing = std::make_shared<ListingStream>(path, file_path);
+        std::string html;
+        size_t limit = request.version == "HTTP/1.1" ? LISTING_STREAM_THRESHOLD : std::numeric_limits<size_t>::max();
+        if (!listing->render(html, limit)) {
+            listing->set_prefix(std::move(html));
+            HttpResponse response;
+            response.status = "200 OK";
+            response.content_type = "text/html";
+            response.headers = "Cache-Control: no-cache\r\n";
+            response.chunked = true;
+            BodySegment seg;
+            seg.stream = std::move(listing);
+            response.body.push_back(std::move(seg));
+            return response;
+        }
+        listing.reset();  // 已读完，关闭目录
+
+#if defined(__linux__)
+        if (listing_cache.enabled()) {
+            auto entry = std::make_shared<CachedFile>();
+            entry->bytes = std::make_shared<const std::string>(std::move(html));
+            entry->content_type = "text/html";
+            entry->etag = etag;
+            entry->mtime = info.mtime;
+            std::string vary_headers;
+#if defined(LAN_HTTP_USE_ZLIB)
+            vary_headers = "Vary: Accept-Encoding\r\n";
+#endif
+            entry->validators = make_validator_headers(info, "no-cache") + vary_headers;
+            entry->headers = entry->validators;
+            entry->compressible = true;
+            entry->stream_etag = make_etag(info, true);
+            entry->stream_headers = make_validator_headers(info, "no-cache", true) + vary_headers;
+            listing_cache.store(path, entry, epoch_before);
+            return make_cached_response(request, *entry);
+        }
+#endif
+
+        HttpResponse response = make_response("200 OK", "text/html", html);
+#if defined(LAN_HTTP_USE_ZLIB)
+        response.headers += "Vary: Accept-Encoding\r\n";
+#endif
+        if (should_compress(request, static_cast<long long>(html.size()))) compress_response(response);
+        return response;
+    }
+
+    // 检查文件是否存在
+    if (!exists) {
+        std::cerr << "File does not exist: " << file_path << std::endl;
+        return make_response("404 Not Found", "text/plain", "File Not Found");
+    }
+
+    // 获取文件扩展名
+    std::string_view ext = get_extension(file_path);
+
+    // 获取Content-Type和缓存策略
+    std::string_view content_type = get_content_type(ext);
+    std::string_view cache_control = get_cache_control(ext);
+
+    // 文本文件：客户端接受gzip且有预压缩版本时，直接发送.gz文件（Range请求仍按原文件处理）
+    bool compressible = is_compressible(ext);
+    std::string gzip_path;
+    FileInfo gzip_info;
+    std::shared_ptr<FileHandle> gzip_file;
+    bool has_gzip = compressible && find_gzip_variant(path, file_path, info, gzip_path, gzip_info, gzip_file);
+    bool use_gzip = has_gzip && accepts_gzip(request) && !request.find_header("Range");
+    // 没有预压缩版本时即时压缩
+    bool gzip_on_the_fly = compressible && !has_gzip && should_compress(request, info.size);
+    std::string vary_headers = compressible ? "Vary: Accept-Encoding\r\n" : "";
+    const FileInfo& selected = use_gzip ? gzip_info : info;
+    std::string encoding_headers = (use_gzip ? "Content-Encoding: gzip\r\n" : "") + vary_headers;
+
+    // 条件请求命中时不打开文件
+    if (is_not_modified(request, make_etag(selected, gzip_on_the_fly), selected.mtime)) {
+        return make_not_modified_response(make_validator_headers(selected, cache_control, gzip_on_the_fly) +
+            encoding_headers);
+    }
+
+#if defined(__linux__)
+    // 小文件读入热点缓存，后续请求在事件循环中直接命中
+    if (file_cache.enabled() && !request.find_header("Range")) {
+        auto cached = file_cache.load(path, file_path, file, info, content_type, cache_control, vary_headers,
+            has_gzip ? gzip_path : "", gzip_file, gzip_info, compressible);
+        if (cached) return make_cached_response(request, *cached);
+    }
+#endif
+
+    // 发送文件 - 统一使用make_file_response函数，已打开的文件直接使用（多个响应共享同一个fd，都按偏移读写）
+    const std::shared_ptr<FileHandle>& selected_file = use_gzip ? gzip_file : file;
+    HttpResponse response = selected_file ?
+        make_file_response(request, file_path, selected_file, selected, content_type, cache_control, false,
+            encoding_headers, gzip_on_the_fly) :
+        make_file_response(request, use_gzip ? gzip_path : file_path, content_type,
+            cache_control, false, encoding_headers, gzip_on_the_fly);
+    if (gzip_on_the_fly && response.status == "200 OK") compress_response(response);
+    return response;
+}
+
+// 生成请求对应的响应
+HttpResponse build_response(const HttpRequest& request) {
+    auto start = std::chrono::steady_clock::now();
+    HttpResponse response = route_request(request);
+    // HEAD的Content-Length仍是完整响应体的长度，只是不发送响应体
+    response.head_only = request.method == "HEAD";
+    metrics.local().handler_time.record(elapsed_ns(start));
+    return response;
+}
+
+// 阻塞发送全部数据
+bool send_all(SOCKET_HANDLE client_socket, const char* data, size_t len, long long& total_sent) {
+    while (len > 0) {
+        int chunk = static_cast<int>(std::min<size_t>(len, 1 << 30));
+#if defined(_WIN32)
+        int sent = send(client_socket, data, chunk, 0);
+#else
+        ssize_t sent = send(client_socket, data, chunk, MSG_NOSIGNAL);
+#endif
+        if (sent <= 0) return false;
+        total_sent += sent;
+        data += sent;
+        len -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+#if !defined(_WIN32)
+// 阻塞发送一组数据段（sendmsg可能只发出一部分）
+bool send_all_vectored(SOCKET_HANDLE client_socket, iovec* iov, size_t count, int flags, long long& total_sent) {
+    while (count > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(client_socket, &msg, flags | MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        total_sent += sent;
+        size_t rest = static_cast<size_t>(sent);
+        while (count > 0 && rest >= iov->iov_len) {
+            rest -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + rest;
+            iov->iov_len -= rest;
+        }
+    }
+    return true;
+}
+#endif
+
+// 阻塞发送整个响应（Windows等没有事件循环的平台使用），返回实际发出的字节数
+long long send_response(SOCKET_HANDLE client_socket, const HttpResponse& response) {
+    long long total = 0;
+    std::string head;
+    build_response_head(response, 0, head);
+    size_t first = 0;  // 已经和响应头一起发出的响应体分段数
+#if defined(_WIN32)
+    if (!send_all(client_socket, head.data(), head.size(), total) || response.head_only) return total;
+#else
+    // 响应头和紧跟的内存分段用一次sendmsg发出，不拼接复制，也不会单独发一个只有响应头的小包
+    iovec iov[MAX_SEND_IOVECS];
+    size_t count = 0;
+    iov[count++] = { head.data(), head.size() };
+    while (!response.head_only && first < response.body.size() && count < MAX_SEND_IOVECS &&
+        !response.body[first].file && !response.body[first].stream) {
+        const std::string& data = response.body[first++].bytes();
+        iov[count++] = { const_cast<char*>(data.data()), data.size() };
+    }
+    int flags = 0;
+#if defined(MSG_MORE)
+    // 后面是文件时先压住这部分数据，让文件开头接在同一个报文段里
+    if (!response.head_only && first < response.body.size() && response.body[first].file &&
+        response.body[first].length > 0) flags = MSG_MORE;
+#endif
+    if (!send_all_vectored(client_socket, iov, count, flags, total) || response.head_only) return total;
+#endif
+
+    std::vector<char> buffer;
+    for (size_t i = first; i < response.body.size(); ++i) {
+        const BodySegment& seg = response.body[i];
+        if (seg.stream) {
+            StreamStatus status;
+            do {
+                std::string out;
+                status = seg.stream->next(out);
+                if (status == StreamStatus::Error || !send_all(client_socket, out.data(), out.size(), total)) return total;
+            } while (status == StreamStatus::More);
+            continue;
+        }
+        if (!seg.file) {
+            if (!send_all(client_socket, seg.bytes().data(), seg.bytes().size(), total)) return total;
+            continue;
+        }
+        long long sent = 0;
+#if defined(__linux__)
+        // 零拷贝：文件内容由内核直接写入socket。
+        // sendfile不受SO_SNDTIMEO限制，发送期间socket改为非阻塞，缓冲区满时用poll最多等SEND_TIMEOUT秒
+        int socket_flags = fcntl(client_socket, F_GETFL, 0);
+        fcntl(client_socket, F_SETFL, socket_flags | O_NONBLOCK);
+        while (sent < seg.length) {
+            off_t offset = static_cast<off_t>(seg.offset + sent);
+            ssize_t n = sendfile(client_socket, seg.file->fd, &offset, static_cast<size_t>(seg.length - sent));
+            if (n > 0) {
+                sent += n;
+                total += n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                pollfd writable{ client_socket, POLLOUT, 0 };
+                if (poll(&writable, 1, SEND_TIMEOUT > 0 ? SEND_TIMEOUT * 1000 : -1) > 0) continue;
+                if (SEND_TIMEOUT > 0) metrics.local().timeouts[static_cast<int>(TimeoutKind::Send)].add(1);
+                return total;
+            }
+            break;
+        }
+        fcntl(client_socket, F_SETFL, socket_flags);
+        if (sent > 0 && sent < seg.length) return total;
+#endif
+        // 不支持sendfile时，大块读取后发送
+        if (buffer.empty()) buffer.resize(FILE_CHUNK_SIZE);
+        while (sent < seg.length) {
+            size_t want = static_cast<size_t>(std::min<long long>(buffer.size(), seg.length - sent));
+            ssize_t bytes_read = read_file_at(*seg.file, buffer.data(), want, seg.offset + sent);
+            if (bytes_read <= 0) return total;
+            if (!send_all(client_socket, buffer.data(), static_cast<size_t>(bytes_read), total)) return total;
+            sent += bytes_read;
+        }
+    }
+    return total;
+}
+
+// 设置阻塞socket单次收发的超时（毫秒），0表示不限制
+void set_socket_timeout(SOCKET_HANDLE client_socket, int option, long long ms) {
+#if defined(_WIN32)
+    DWORD value = static_cast<DWORD>(ms);
+    setsockopt(client_socket, SOL_SOCKET, option, reinterpret_cast<const char*>(&value), sizeof(value));
+#else
+    timeval value{};
+    value.tv_sec = static_cast<time_t>(ms / 1000);
+    value.tv_usec = static_cast<suseconds_t>(ms % 1000 * 1000);
+    setsockopt(client_socket, SOL_SOCKET, option, &value, sizeof(value));
+#endif
+}
+
+// 线程池排队已满时由accept线程直接回复503并关闭（阻塞模型）。
+// 不等待请求到达，只读掉已经到达的部分，减少关闭时内核发RST冲掉503的可能。
+// 503只做一次非阻塞发送（新连接的发送缓冲是空的，通常一次发完），发不出去就放弃，慢速客户端卡不住accept线程
+void reject_connection(SOCKET_HANDLE client_socket, const std::string& client_ip) {
+    auto start = std::chrono::steady_clock::now();
+    char buffer[BUFFER_SIZE];
+    HttpResponse response = reject_request(RejectReason::QueueFull);
+    std::string out;
+    build_response_head(response, 0, out);
+    for (const BodySegment& seg : response.body) out += seg.bytes();
+#if defined(_WIN32)
+    u_long nonblocking = 1;
+    ioctlsocket(client_socket, FIONBIO, &nonblocking);
+    while (recv(client_socket, buffer, sizeof(buffer), 0) > 0) {}
+    int sent = send(client_socket, out.data(), static_cast<int>(out.size()), 0);
+#else
+    while (recv(client_socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+    ssize_t sent = send(client_socket, out.data(), out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+#endif
+    AccessLogRecord record = make_access_record(client_ip, HttpRequest());
+    CLOSE_SOCKET(client_socket);
+    metrics.local().connections.add(-1);
+    access_log.record(record, 503, sent > 0 ? static_cast<long long>(sent) : 0, start);
+    record_request_metrics(record, start);
+}
+
+// 发送响应、关闭连接并记录日志和统计
+void finish_request(SOCKET_HANDLE client_socket, const HttpResponse& response, AccessLogRecord& record,
+    std::chrono::steady_clock::time_point start) {
+    // 每次写操作（包括sendfile）超过SEND_TIMEOUT秒没有进展就放弃
+    if (SEND_TIMEOUT > 0) set_socket_timeout(client_socket, SO_SNDTIMEO, SEND_TIMEOUT * 1000LL);
+    long long bytes = send_response(client_socket, response);
+    CLOSE_SOCKET(client_socket);
+    metrics.local().connections.add(-1);
+    access_log.record(record, std::atoi(response.status.c_str()), bytes, start);
+    record_request_metrics(record, start);
+}
+
+// 交给大文件传输通道发送的响应；任务内联空间放不下，放在堆上
+struct PendingSend {
+    SOCKET_HANDLE client_socket;
+    HttpResponse response;
+    AccessLogRecord record;
+    std::chrono::steady_clock::time_point start;
+};
+
+// 处理HTTP请求（阻塞模式，一个连接一个请求；空闲的长连接会占住工作线程，所以这里不保持连接）。
+// 在低延迟通道读请求、生成响应，响应体较大时把发送交给大文件传输通道，慢速下载不会占住处理小请求的线程
+void handle_request(SOCKET_HANDLE client_socket, const std::string& client_ip, WorkerLanes& lanes) {
+    // 排队太久的连接仍然读完请求（直接关闭会让内核发RST，冲掉503），但不再处理
+    bool expired = queue_wait_expired();
+    char buffer[BUFFER_SIZE];
+    std::string raw;
+    RequestParser parser;
+    HttpRequest request;
+    ParseResult result = ParseResult::Incomplete;
+    auto header_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(HEADER_TIMEOUT);
+
+    // 读取直到请求头结束，每次只解析新到的数据。
+    // 每次recv前把剩余时间设为接收超时，不发请求或一点点发的客户端最多占住工作线程HEADER_TIMEOUT秒
+    while (result == ParseResult::Incomplete) {
+        if (HEADER_TIMEOUT > 0) {
+            // 向上取整，接收超时时一定已经过了期限
+            auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+                header_deadline - std::chrono::steady_clock::now()).count();
+            set_socket_timeout(client_socket, SO_RCVTIMEO, std::max<long long>((remaining + 999) / 1000, 1));
+        }
+        ssize_t bytes_read = recv(client_socket, buffer, sizeof(buffer), 0);
+        if (bytes_read <= 0) {
+            if (HEADER_TIMEOUT > 0 && std::chrono::steady_clock::now() >= header_deadline) {
+                metrics.local().timeouts[static_cast<int>(TimeoutKind::Header)].add(1);
+            }
+            CLOSE_SOCKET(client_socket);
+            metrics.local().connections.add(-1);
+            return;
+        }
+        raw.append(buffer, static_cast<size_t>(bytes_read));
+        result = parser.parse(raw, request);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    AccessLogRecord record = make_access_record(client_ip, request);
+    HttpResponse response = result != ParseResult::Complete ? make_parse_error_response(result) :
+        expired ? reject_request(RejectReason::QueueTimeout) : build_response(request);
+
+    // 大文件传输通道排队已满时回复503。响应已经生成，排队多久都照常发送
+    if (response.lane(bulk_min_size()) == Lane::Bulk) {
+        std::unique_ptr<PendingSend> pending(new PendingSend{ client_socket, std::move(response), record, start });
+        PendingSend* task = pending.get();
+        bool queued = lanes.bulk.try_enqueue([task] {
+            std::unique_ptr<PendingSend> owned(task);
+            finish_request(owned->client_socket, owned->response, owned->record, owned->start);
+            }, WorkerLanes::max_queued(Lane::Bulk));
+        if (queued) {
+            pending.release();
+            return;
+        }
+        response = reject_request(RejectReason::QueueFull);
+    }
+    finish_request(client_socket, response, record, start);
+}
+
+#if defined(__linux__)
+// 事件循环自己把每个响应合并成尽量少的写操作，关掉Nagle算法，避免流水线中后一个响应等待前一个的ACK
+void set_no_delay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+const int TIMER_TICK_MS = 250;  // 时间轮一格的长度，也是事件循环检查超时的间隔
+
+// 嵌在连接里的定时器节点，挂在时间轮某个槽的双向循环链表上
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0;   // 到期的格数
+    void* owner = nullptr;
+
+    bool armed() const { return next != nullptr; }
+};
+
+// 分层时间轮：3层各64个槽，第0层一个槽一格，上层的槽在下层转完一圈时整槽降级、按剩余时间重新分配。
+// 设置和取消都是O(1)，每格只处理到期的那一个槽。超过约18小时（2^18格）的期限先放在最高层，到时再重新分配
+class TimerWheel {
+public:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 3;
+
+    explicit TimerWheel(uint64_t now_tick) : now(now_tick) {
+        for (auto& level : slots) {
+            for (TimerNode& head : level) head.prev = head.next = &head;
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    static uint64_t now_ms() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    static uint64_t current_tick() { return now_ms() / TIMER_TICK_MS; }
+
+    // 至少ms毫秒之后才到的第一格
+    static uint64_t tick_after(uint64_t ms) { return (now_ms() + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS; }
+
+    // 设置在第expires格到期，已设置的先取消；已经过去的期限在下一格到期
+    void arm(TimerNode* node, uint64_t expires) {
+        cancel(node);
+        node->expires = std::max(expires, now + 1);
+        place(node);
+    }
+
+    void cancel(TimerNode* node) {
+        if (!node->armed()) return;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    // 推进到第tick格，对到期的定时器调用on_expire（回调中可以设置或取消任意定时器）
+    template<class F>
+    void advance(uint64_t tick, F&& on_expire) {
+        while (now < tick) {
+            ++now;
+            for (int level = 1; level < LEVELS; ++level) {
+                if (now & ((1ULL << (SLOT_BITS * level)) - 1)) break;
+                cascade(slots[level][(now >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+            }
+
+            TimerNode due;
+            take(slots[0][now & (SLOTS - 1)], due);
+            while (due.next != &due) {
+                TimerNode* node = due.next;
+                cancel(node);
+                if (node->expires > now) place(node);
+                else on_expire(node);
+            }
+        }
+    }
+
+private:
+    void place(TimerNode* node) {
+        uint64_t delta = node->expires - now;
+        uint64_t expires = node->expires;
+        if (delta >= (1ULL << (SLOT_BITS * LEVELS))) expires = now + (1ULL << (SLOT_BITS * LEVELS)) - 1;
+        int level = 0;
+        while (level < LEVELS - 1 && expires - now >= (1ULL << (SLOT_BITS * (level + 1)))) ++level;
+        TimerNode& head = slots[level][(expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        node->prev = head.prev;
+        node->next = &head;
+        head.prev->next = node;
+        head.prev = node;
+    }
+
+    // 把一个槽的链表整个移到临时表头to下
+    static void take(TimerNode& head, TimerNode& to) {
+        if (head.next == &head) {
+            to.prev = to.next = &to;
+            return;
+        }
+        to.next = head.next;
+        to.prev = head.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        head.prev = head.next = &head;
+    }
+
+    void cascade(TimerNode& head) {
+        TimerNode moved;
+        take(head, moved);
+        while (moved.next != &moved) {
+            TimerNode* node = moved.next;
+            cancel(node);
+            place(node);
+        }
+    }
+
+    uint64_t now;
+    TimerNode slots[LEVELS][SLOTS];
+};
+
+// 单个客户端连接的状态，只在事件循环线程中访问
+struct Connection {
+    virtual ~Connection() {}
+
+    int fd = -1;
+    std::string client_ip;
+    std::string in;                 // 已读取但尚未处理的数据（可能包含流水线中的后续请求）
+    RequestParser parser;           // in开头的请求解析到哪里了
+    std::string out_head;           // 正在发送的响应头
+    HttpResponse out;               // 正在发送的响应
+    size_t out_head_sent = 0;
+    size_t out_seg = 0;             // 当前发送到第几个响应体分段
+    long long out_pos = 0;          // 分段内已发送的字节数
+    std::vector<char> chunk;        // 文件分段的读缓冲
+    char* chunk_buf = nullptr;      // 当前文件块所在的缓冲（chunk或io_uring的固定缓冲）
+    size_t chunk_pos = 0;
+    size_t chunk_len = 0;
+    std::string stream_buf;         // 数据流分段已生成、尚未发送的数据；生成下一块期间由工作线程写入
+    size_t stream_pos = 0;
+    bool stream_done = false;       // 数据流已生成完毕
+    bool stream_pending = false;    // 数据流的下一块正在线程池中生成
+    bool use_sendfile = true;       // sendfile失败（如文件系统不支持）后改用读缓冲
+    int requests_served = 0;
+    AccessLogRecord log_record;     // 当前请求的访问日志，响应发送完后写出
+    std::chrono::steady_clock::time_point request_start;
+    long long bytes_sent = 0;       // 当前响应已发出的字节数
+    bool keep_alive = false;        // 当前响应发送完后是否保持连接
+    bool busy = false;              // 请求正在线程池中处理
+    bool sending = false;           // 响应正在发送
+    bool processing = false;        // 正在process_input中，避免递归
+    bool read_closed = false;       // 对端已关闭写方向
+    bool dead = false;              // socket已关闭，等待线程池任务结束后释放
+    TimerNode timer;                // 当前的超时期限
+    TimeoutKind timeout_kind = TimeoutKind::Header;
+};
+
+// prepare_output的结果：可以发送、等待线程池生成数据流的下一块、数据流出错
+enum class OutputState { Ready, Pending, Error };
+
+// 事件循环的公共部分：请求分发、线程池结果回传、超时和连接的延迟释放。
+// epoll和io_uring两种引擎只在socket读写的方式上不同
+class ConnectionLoop {
+public:
+    ConnectionLoop(int listen_socket, WorkerLanes& worker_lanes)
+        : listen_fd(listen_socket), lanes(worker_lanes) {
+    }
+
+    virtual ~ConnectionLoop() {
+        if (wake_fd >= 0) close(wake_fd);
+    }
+
+    virtual void run() = 0;
+
+    // 工作线程处理完请求后调用，线程安全
+    void post_response(Connection* conn, HttpResponse&& response) {
+        {
+            std::lock_guard<std::mutex> lock(completion_mutex);
+            completions.emplace_back(conn, std::move(response));
+        }
+        wake();
+    }
+
+    // 工作线程生成完数据流的下一块（已写入conn->stream_buf）后调用，线程安全
+    void post_stream_chunk(Connection* conn, StreamStatus status) {
+        {
+            std::lock_guard<std::mutex> lock(completion_mutex);
+            stream_completions.emplace_back(conn, status);
+        }
+        wake();
+    }
+
+protected:
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // 缓冲中没有完整的请求时继续读取，返回是否读到了新数据
+    virtual bool read_more(Connection* conn) = 0;
+    virtual void start_response(Connection* conn, HttpResponse&& response) = 0;
+    // 数据流的下一块生成好了，继续发送
+    virtual void resume_output(Connection* conn) = 0;
+    virtual void close_connection(Connection* conn) = 0;
+    // 已关闭的连接不再被任何操作引用时放入closed，等本轮事件处理完后释放
+    virtual void reclaim(Connection* conn) = 0;
+
+    // 设置连接的超时期限：收请求头的期限从连接建立或请求的第一个字节算起，陆续到达的数据不延长期限；
+    // 发送期限在每次写出进展后重新计算；空闲期限从上一个响应发完算起。请求在线程池中处理时不计时
+    void set_deadline(Connection* conn, TimeoutKind kind) {
+        conn->timeout_kind = kind;
+        int seconds = kind == TimeoutKind::Header ? HEADER_TIMEOUT :
+            kind == TimeoutKind::Send ? SEND_TIMEOUT : std::max(KEEP_ALIVE_TIMEOUT, 1);
+        if (seconds <= 0) {
+            timers.cancel(&conn->timer);
+            return;
+        }
+        uint64_t expires = TimerWheel::tick_after(static_cast<uint64_t>(seconds) * 1000);
+        // 发送期间每次写出都会调用，期限没变时不必重新挂链
+        if (conn->timer.armed() && conn->timer.expires == expires) return;
+        conn->timer.owner = conn;
+        timers.arm(&conn->timer, expires);
+    }
+
+    // 空闲的长连接收到新请求的数据，开始计算收请求头的期限
+    void note_input(Connection* conn) {
+        if (conn->timeout_kind == TimeoutKind::Idle) set_deadline(conn, TimeoutKind::Header);
+    }
+
+    // 关闭超时的连接
+    void expire_timers() {
+        timers.advance(TimerWheel::current_tick(), [this](TimerNode* node) {
+            Connection* conn = static_cast<Connection*>(node->owner);
+            metrics.local().timeouts[static_cast<int>(conn->timeout_kind)].add(1);
+            close_connection(conn);
+            });
+    }
+
+    // 按顺序处理缓冲中的请求：缓存命中的直接在本线程响应，其余交给线程池。
+    // 流水线中的后续请求留在缓冲里，前一个响应发送完后再处理。
+    void process_input(Connection* conn) {
+        conn->processing = true;
+        while (!conn->dead && !conn->busy && !conn->sending) {
+            HttpRequest request;
+            ParseResult result = conn->parser.parse(conn->in, request);
+            if (result == ParseResult::Incomplete) {
+                if (conn->read_closed) {
+                    close_connection(conn);
+                    break;
+                }
+                // 之前可能因缓冲已满暂停了读取
+                if (!read_more(conn)) break;
+                continue;
+            }
+
+            conn->requests_served++;
+            conn->request_start = std::chrono::steady_clock::now();
+            conn->log_record = make_access_record(conn->client_ip, request);
+            if (result != ParseResult::Complete) {
+                // 请求无法解析时后面的数据也无法分界，回复错误后断开
+                conn->in.clear();
+                conn->parser.reset();
+                conn->keep_alive = false;
+                start_response(conn, make_parse_error_response(result));
+                continue;
+            }
+            conn->in.erase(0, conn->parser.consumed());
+            conn->parser.reset();
+            conn->keep_alive = KEEP_ALIVE_TIMEOUT > 0 && request.wants_keep_alive() && !request.has_body() &&
+                conn->requests_served < MAX_KEEP_ALIVE_REQUESTS;
+
+            // 目录列表只有在inotify保证及时失效时才能不经stat直接命中
+            std::string cache_key;
+            if (static_cache_key(request, cache_key)) {
+                bool listing = cache_key.back() == '/';
+                FileCache& cache = listing ? listing_cache : file_cache;
+                auto cached = cache.enabled() && (!listing || fs_watcher.running()) ? cache.lookup(cache_key) : nullptr;
+                if (cached) {
+                    start_response(conn, make_cached_response(request, *cached));
+                    continue;
+                }
+            }
+
+            // 线程池排队已满时在本线程直接回复503，不再排队
+            conn->busy = true;
+            timers.cancel(&conn->timer);
+            Lane lane = predict_lane(request);
+            bool queued = lanes[lane].try_enqueue([this, conn, request] {
+                post_response(conn, queue_wait_expired() ? reject_request(RejectReason::QueueTimeout) : build_response(request));
+                }, WorkerLanes::max_queued(lane));
+            if (!queued) {
+                conn->busy = false;
+                start_response(conn, reject_request(RejectReason::QueueFull));
+            }
+        }
+        conn->processing = false;
+    }
+
+    // 取出线程池处理完的响应开始发送，生成好的数据流块继续发送
+    void handle_completions() {
+        std::vector<std::pair<Connection*, HttpResponse>> ready;
+        std::vector<std::pair<Connection*, StreamStatus>> chunks;
+        {
+            std::lock_guard<std::mutex> lock(completion_mutex);
+            ready.swap(completions);
+            chunks.swap(stream_completions);
+        }
+        for (auto& item : ready) {
+            Connection* conn = item.first;
+            conn->busy = false;
+            if (conn->dead) {
+                reclaim(conn);
+                continue;
+            }
+            start_response(conn, std::move(item.second));
+        }
+        for (auto& item : chunks) {
+            Connection* conn = item.first;
+            conn->busy = false;
+            conn->stream_pending = false;
+            if (conn->dead) {
+                reclaim(conn);
+                continue;
+            }
+            // 已经发出的chunked数据无法再补救，只能断开
+            if (item.second == StreamStatus::Error) {
+                close_connection(conn);
+                continue;
+            }
+            conn->stream_done = item.second == StreamStatus::Done;
+            set_deadline(conn, TimeoutKind::Send);
+            resume_output(conn);
+        }
+    }
+
+    // 准备发送新的响应：生成响应头，清零发送进度
+    void begin_response(Connection* conn, HttpResponse&& response) {
+        conn->out = std::move(response);
+        if (conn->out.close_connection) conn->keep_alive = false;
+        build_response_head(conn->out,
+            conn->keep_alive ? MAX_KEEP_ALIVE_REQUESTS - conn->requests_served : 0, conn->out_head);
+        conn->out_head_sent = 0;
+        conn->bytes_sent = 0;
+        conn->out_seg = 0;
+        conn->out_pos = 0;
+        conn->chunk_pos = conn->chunk_len = 0;
+        conn->stream_buf.clear();
+        conn->stream_pos = 0;
+        conn->stream_done = false;
+        conn->sending = true;
+        set_deadline(conn, TimeoutKind::Send);
+    }
+
+    // 一个响应发送完毕：短连接直接关闭，长连接继续处理缓冲中剩余的请求
+    void finish_response(Connection* conn) {
+        log_response(conn);
+        conn->sending = false;
+        conn->out = HttpResponse();
+        conn->out_head.clear();
+        if (!conn->keep_alive) {
+            close_connection(conn);
+            return;
+        }
+        // 缓冲中已有下一个请求的数据时从现在开始计算收请求头的期限
+        set_deadline(conn, conn->in.empty() ? TimeoutKind::Idle : TimeoutKind::Header);
+        // 继续处理缓冲中的下一个请求；处理期间可能错过了可读通知，由process_input主动再读
+        if (!conn->processing) process_input(conn);
+    }
+
+    // 跳过已发完的分段；当前是数据流分段且已生成的数据发完时，把下一块交给线程池生成后返回Pending。
+    // 生成数据流要读文件、压缩或遍历目录，不能在事件循环线程里做，否则会卡住本循环的所有连接
+    OutputState prepare_output(Connection* conn) {
+        if (conn->stream_pending) return OutputState::Pending;
+        if (conn->out.head_only) conn->out_seg = conn->out.body.size();
+        while (conn->out_seg < conn->out.body.size()) {
+            const BodySegment& seg = conn->out.body[conn->out_seg];
+            if (!seg.stream) {
+                if (conn->out_pos < seg.size() || conn->chunk_pos < conn->chunk_len) return OutputState::Ready;
+                conn->out_seg++;
+                conn->out_pos = 0;
+                continue;
+            }
+            if (conn->stream_pos < conn->stream_buf.size()) return OutputState::Ready;
+            conn->stream_buf.clear();
+            conn->stream_pos = 0;
+            if (conn->stream_done) {
+                conn->stream_done = false;
+                conn->out_seg++;
+                continue;
+            }
+            return request_stream_chunk(conn, seg.stream) ? OutputState::Pending : OutputState::Error;
+        }
+        return OutputState::Ready;
+    }
+
+    // 在线程池中生成数据流的下一块。已经开始发送的响应不受排队上限限制；
+    // 注入队列满了提交失败时，已经发出的chunked数据无法补救，由调用方断开连接
+    bool request_stream_chunk(Connection* conn, std::shared_ptr<BodyStream> stream) {
+        Lane lane = conn->out.lane(bulk_min_size());
+        conn->stream_pending = true;
+        conn->busy = true;
+        // 生成期间不计发送期限，和请求在线程池中处理时一样
+        timers.cancel(&conn->timer);
+        bool queued = lanes[lane].try_enqueue([this, conn, stream] {
+            post_stream_chunk(conn, stream->next(conn->stream_buf));
+            }, 0);
+        if (!queued) {
+            conn->stream_pending = false;
+            conn->busy = false;
+        }
+        return queued;
+    }
+
+    // 从当前发送进度起收集可以一次发出的内存数据：未发完的响应头、内存分段、已生成的数据流和已读入的文件块。
+    // 遇到还没有数据的文件分段时停止，file_follows表示后面紧跟着文件内容
+    size_t gather_output(Connection* conn, iovec* iov, size_t max_iov, bool& file_follows) {
+        size_t count = 0;
+        file_follows = false;
+        if (conn->out_head_sent < conn->out_head.size()) {
+            iov[count++] = { conn->out_head.data() + conn->out_head_sent, conn->out_head.size() - conn->out_head_sent };
+        }
+        for (size_t i = conn->out_seg; i < conn->out.body.size() && count < max_iov; ++i) {
+            const BodySegment& seg = conn->out.body[i];
+            bool current = i == conn->out_seg;
+            if (seg.stream) {
+                // 后面的数据流轮到时才生成
+                if (current) iov[count++] = { &conn->stream_buf[conn->stream_pos], conn->stream_buf.size() - conn->stream_pos };
+                break;
+            }
+            if (seg.file) {
+                if (current && conn->chunk_pos < conn->chunk_len) {
+                    iov[count++] = { conn->chunk_buf + conn->chunk_pos, conn->chunk_len - conn->chunk_pos };
+                }
+                else {
+                    file_follows = current || seg.length > 0;
+                }
+                break;
+            }
+            const std::string& data = seg.bytes();
+            size_t pos = current ? static_cast<size_t>(conn->out_pos) : 0;
+            if (pos < data.size()) iov[count++] = { const_cast<char*>(data.data()) + pos, data.size() - pos };
+        }
+        return count;
+    }
+
+    // 按gather_output的顺序推进发送进度
+    void advance_output(Connection* conn, size_t sent) {
+        set_deadline(conn, TimeoutKind::Send);
+        conn->bytes_sent += static_cast<long long>(sent);
+        size_t head = std::min(sent, conn->out_head.size() - conn->out_head_sent);
+        conn->out_head_sent += head;
+        sent -= head;
+        while (sent > 0 && conn->out_seg < conn->out.body.size()) {
+            const BodySegment& seg = conn->out.body[conn->out_seg];
+            if (seg.stream) {
+                conn->stream_pos += sent;
+                return;
+            }
+            if (seg.file) {
+                conn->chunk_pos += sent;
+                conn->out_pos += static_cast<long long>(sent);
+                return;
+            }
+            size_t take = std::min(sent, seg.bytes().size() - static_cast<size_t>(conn->out_pos));
+            conn->out_pos += static_cast<long long>(take);
+            sent -= take;
+            if (conn->out_pos == seg.size()) {
+                conn->out_seg++;
+                conn->out_pos = 0;
+            }
+        }
+    }
+
+    // 写出当前响应的访问日志
+    void log_response(Connection* conn) {
+        access_log.record(conn->log_record, std::atoi(conn->out.status.c_str()), conn->bytes_sent, conn->request_start);
+        record_request_metrics(conn->log_record, conn->request_start);
+    }
+
+    // 本轮事件处理完后再释放已关闭的连接，避免同一批事件访问已释放的对象
+    void free_closed() {
+        for (Connection* conn : closed) delete conn;
+        closed.clear();
+    }
+
+    int listen_fd = -1;
+    int wake_fd = -1;
+    WorkerLanes& lanes;
+    std::mutex completion_mutex;
+    std::vector<std::pair<Connection*, HttpResponse>> completions;
+    std::vector<std::pair<Connection*, StreamStatus>> stream_completions;
+    std::vector<Connection*> closed;
+    TimerWheel timers{ TimerWheel::current_tick() };
+    size_t connection_count = 0;
+};
+
+// 基于epoll边缘触发的事件循环：
+// socket读写全部非阻塞，在本线程完成；stat、open、目录遍历等阻塞的文件操作交给线程池。
+class EventLoop : public ConnectionLoop {
+public:
+    EventLoop(int listen_socket, WorkerLanes& worker_lanes)
+        : ConnectionLoop(listen_socket, worker_lanes) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0) {
+            throw std::runtime_error("epoll/eventfd setup failed");
+        }
+
+        int flags = fcntl(listen_fd, F_GETFL, 0);
+        fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &listen_tag;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        ev.data.ptr = &wake_tag;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+
+    ~EventLoop() {
+        close(epoll_fd);
+        if (spare_fd >= 0) close(spare_fd);
+    }
+
+    void run() override {
+        std::vector<epoll_event> events(1024);
+        while (true) {
+            int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), TIMER_TICK_MS);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("epoll_wait failed");
+            }
+            for (int i = 0; i < n; ++i) {
+                void* tag = events[i].data.ptr;
+                if (tag == &listen_tag) {
+                    accept_connections();
+                }
+                else if (tag == &wake_tag) {
+                    drain_completions();
+                }
+                else {
+                    Connection* conn = static_cast<Connection*>(tag);
+                    if (conn->dead) continue;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        close_connection(conn);
+                        continue;
+                    }
+                    if (events[i].events & (EPOLLIN | EPOLLRDHUP)) on_readable(conn);
+                    if (!conn->dead && (events[i].events & EPOLLOUT)) on_writable(conn);
+                }
+            }
+
+            expire_timers();
+            free_closed();
+        }
+    }
+
+private:
+    void accept_connections() {
+        while (true) {
+            sockaddr_in client_address{};
+            socklen_t client_addr_len = sizeof(client_address);
+            int client_socket = accept4(listen_fd, reinterpret_cast<sockaddr*>(&client_address),
+                &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                    // 文件描述符耗尽：借用备用fd接受并立即关闭，避免边缘触发下监听socket饿死
+                    close(spare_fd);
+                    int dropped = accept(listen_fd, nullptr, nullptr);
+                    if (dropped >= 0) close(dropped);
+                    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    std::cerr << "Accept failed: too many open files\n";
+                    continue;
+                }
+                std::cerr << "Accept failed. Error: " << GET_SOCKET_ERRNO << "\n";
+                return;
+            }
+
+            Connection* conn = new Connection();
+            conn->fd = client_socket;
+            set_no_delay(client_socket);
+
+            // 获取客户端IP
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
+            conn->client_ip = client_ip;
+
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = conn;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) != 0) {
+                close(client_socket);
+                delete conn;
+                continue;
+            }
+            set_deadline(conn, TimeoutKind::Header);
+            ++connection_count;
+            metrics.local().connections.add(1);
+        }
+    }
+
+    void on_readable(Connection* conn) {
+        read_available(conn);
+        if (!conn->dead) process_input(conn);
+    }
+
+    bool read_more(Connection* conn) override {
+        return read_available(conn);
+    }
+
+    // 读到EAGAIN或缓冲上限为止，返回是否读到了新数据
+    bool read_available(Connection* conn) {
+        char buffer[BUFFER_SIZE];
+        bool got_data = false;
+        // 缓冲已满时暂停读取，处理掉已有的请求后process_input会继续读
+        while (!conn->read_closed && conn->in.size() <= MAX_REQUEST_HEADER_SIZE) {
+            ssize_t bytes_read = recv(conn->fd, buffer, sizeof(buffer), 0);
+            if (bytes_read > 0) {
+                conn->in.append(buffer, static_cast<size_t>(bytes_read));
+                if (!got_data) note_input(conn);
+                got_data = true;
+                continue;
+            }
+            if (bytes_read == 0) {
+                conn->read_closed = true;
+                break;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            close_connection(conn);
+            return false;
+        }
+        return got_data;
+    }
+
+    void drain_completions() {
+        uint64_t counter;
+        while (read(wake_fd, &counter, sizeof(counter)) > 0) {}
+        handle_completions();
+    }
+
+    void start_response(Connection* conn, HttpResponse&& response) override {
+        begin_response(conn, std::move(response));
+        on_writable(conn);
+    }
+
+    // 等待数据流期间错过的EPOLLOUT边沿不会再来，主动写一次
+    void resume_output(Connection* conn) override {
+        on_writable(conn);
+    }
+
+    // 尽可能多地写出响应，遇到EAGAIN等待下一次EPOLLOUT。
+    // 响应头和内存中的数据用一次sendmsg写出，后面是sendfile时加MSG_MORE，让响应头和文件开头在同一个报文段里
+    void on_writable(Connection* conn) {
+        if (!conn->sending) return;
+
+        while (true) {
+            OutputState state = prepare_output(conn);
+            if (state == OutputState::Pending) return;
+            if (state == OutputState::Error) {
+                close_connection(conn);
+                return;
+            }
+            const BodySegment* file_seg = nullptr;
+            if (conn->out_seg < conn->out.body.size() && conn->out.body[conn->out_seg].file) {
+                file_seg = &conn->out.body[conn->out_seg];
+            }
+
+            // 不能用sendfile时先把文件读入缓冲，和前面的响应头一起写出
+            if (file_seg && !conn->use_sendfile && conn->chunk_pos == conn->chunk_len) {
+                if (conn->chunk.empty()) conn->chunk.resize(FILE_CHUNK_SIZE);
+                size_t want = static_cast<size_t>(std::min<long long>(conn->chunk.size(), file_seg->length - conn->out_pos));
+                ssize_t bytes_read = read_file_at(*file_seg->file, conn->chunk.data(), want, file_seg->offset + conn->out_pos);
+                if (bytes_read <= 0) {
+                    close_connection(conn);
+                    return;
+                }
+                conn->chunk_buf = conn->chunk.data();
+                conn->chunk_pos = 0;
+                conn->chunk_len = static_cast<size_t>(bytes_read);
+            }
+
+            iovec iov[MAX_SEND_IOVECS];
+            bool file_follows = false;
+            size_t count = gather_output(conn, iov, MAX_SEND_IOVECS, file_follows);
+            if (count > 0) {
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+                ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (file_follows ? MSG_MORE : 0));
+                if (!check_sent(conn, sent)) return;
+                advance_output(conn, static_cast<size_t>(sent));
+                continue;
+            }
+            if (!file_seg) break;
+
+            // 文件分段：零拷贝sendfile，socket缓冲区满时返回EAGAIN
+            off_t offset = static_cast<off_t>(file_seg->offset + conn->out_pos);
+            ssize_t sent = sendfile(conn->fd, file_seg->file->fd, &offset, static_cast<size_t>(file_seg->length - conn->out_pos));
+            if (sent > 0) {
+                conn->out_pos += sent;
+                conn->bytes_sent += sent;
+                set_deadline(conn, TimeoutKind::Send);
+                continue;
+            }
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                // 文件系统不支持sendfile，改用读缓冲
+                conn->use_sendfile = false;
+                continue;
+            }
+            if (sent == 0) {
+                // 文件被截断，无法再发送声明的长度
+                close_connection(conn);
+                return;
+            }
+            check_sent(conn, sent);
+            return;
+        }
+
+        // 响应发送完毕
+        finish_response(conn);
+    }
+
+    // 检查send结果，返回false表示需要停止写出（缓冲区已满或连接已关闭）
+    bool check_sent(Connection* conn, ssize_t sent) {
+        if (sent >= 0) return true;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+        close_connection(conn);
+        return false;
+    }
+
+    void close_connection(Connection* conn) override {
+        if (conn->dead) return;
+        // 发送中途断开的响应也记录下来（字节数为实际发出的部分）
+        if (conn->sending) {
+            log_response(conn);
+            metrics.local().aborted.add(1);
+        }
+        metrics.local().connections.add(-1);
+        conn->dead = true;
+        close(conn->fd);
+        conn->out = HttpResponse();
+        timers.cancel(&conn->timer);
+        --connection_count;
+        reclaim(conn);
+    }
+
+    // 线程池任务仍持有该连接时，等任务完成后再释放
+    void reclaim(Connection* conn) override {
+        if (!conn->busy) closed.push_back(conn);
+    }
+
+    int epoll_fd = -1;
+    int spare_fd = -1;
+    char listen_tag = 0;
+    char wake_tag = 0;
+};
+
+#if defined(LAN_HTTP_IO_URING)
+// 一个完成事件（从完成队列中复制出来，处理时队列中的位置已可被内核重用）
+struct UringCompletion {
+    uint64_t user_data;
+    int res;
+    uint32_t flags;
+};
+
+// 直接通过系统调用使用的io_uring提交/完成队列，不依赖liburing。只由创建它的线程使用
+class IoUring {
+public:
+    IoUring() {}
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring) munmap(sq_ring, sq_ring_size);
+        if (fd >= 0) close(fd);
+    }
+
+    // 创建队列并映射到用户空间，失败返回false
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        // 只有本线程提交，完成事件推迟到io_uring_enter时统一处理，不打断正在运行的事件循环
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        params.cq_entries = entries * 4;
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0 && errno == EINVAL) {
+            // 旧内核不支持上面的部分选项
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        }
+        // 没有IORING_FEAT_NODROP时完成队列溢出会丢事件
+        if (fd < 0 || !(params.features & IORING_FEAT_NODROP)) return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        if (!sq_ring) return false;
+        cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        if (!cq_ring) return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+        if (!sqes) return false;
+
+        char* sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        // 提交项和提交队列位置一一对应，间接数组只需填一次
+        unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) sq_array[i] = i;
+        sqe_tail = *sq_tail;
+
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // 取一个清零的提交项，队列已满时先把已填好的提交给内核
+    // 取一个空的提交项由调用方填写。提交队列满时先提交一次；内核暂时不接收（EBUSY/EAGAIN）仍满时
+    // 放进积压队列，下次submit时按顺序移入提交队列，调用方不会因此失败，事件循环也不会退出
+    io_uring_sqe* get_sqe() {
+        if (backlog.empty() && sq_full()) submit(0);
+        // 已有积压时后面的操作也要排在后面，保持提交顺序（如取消必须在被取消的recv之后）
+        if (!backlog.empty() || sq_full()) {
+            backlog.emplace_back();
+            io_uring_sqe* sqe = &backlog.back();
+            std::memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+        io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe_tail++;
+        return sqe;
+    }
+
+    // 一次系统调用提交所有已填好的提交项，并等待至少wait_nr个完成事件。
+    // 还有积压的提交项时不等待，让事件循环先处理完成事件腾出空间，再回来提交
+    void submit(unsigned wait_nr) {
+        while (!backlog.empty() && !sq_full()) {
+            sqes[sqe_tail & sq_mask] = backlog.front();
+            backlog.pop_front();
+            sqe_tail++;
+        }
+        if (!backlog.empty()) wait_nr = 0;
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        long ret = syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS, nullptr, 0);
+        // EBUSY/EAGAIN：完成队列积压或内核暂时无法接收，先处理完成事件再提交
+        if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            throw std::runtime_error("io_uring_enter failed");
+        }
+    }
+
+    // 逐个取出完成事件交给handler，handler中可以继续提交新的操作
+    template<class Handler>
+    void reap(Handler&& handler) {
+        while (true) {
+            unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return;
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            UringCompletion completion{ cqe.user_data, cqe.res, cqe.flags };
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            handler(completion);
+        }
+    }
+
+    // 注册固定缓冲，之后的READ_FIXED不需要每次映射用户内存
+    bool register_buffers(const std::vector<iovec>& buffers) {
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+            buffers.data(), static_cast<unsigned>(buffers.size())) == 0;
+    }
+
+    // 注册提供缓冲环（Linux 5.19+），recv时由内核从环中挑选缓冲。
+    // 环按io_uring_buf数组访问：C++中io_uring_buf_ring::bufs的偏移和内核（C）不一致
+    bool register_buffer_ring(io_uring_buf* ring, unsigned entries, unsigned group) {
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = entries;
+        reg.bgid = static_cast<uint16_t>(group);
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+    }
+
+private:
+    bool sq_full() const {
+        return sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries;
+    }
+
+    void* map(size_t size, off_t offset) {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    int fd = -1;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sqe_tail = 0;  // 本地已填好的提交项末尾，submit时才发布给内核
+    std::deque<io_uring_sqe> backlog;  // 提交队列满时暂存的提交项（deque追加时已有元素的地址不变）
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+};
+
+const unsigned URING_ENTRIES = 1024;
+const unsigned RECV_BUFFER_COUNT = 1024;     // recv提供缓冲的数量（2的幂），每块BUFFER_SIZE字节
+const unsigned RECV_BUFFER_GROUP = 0;
+const unsigned FILE_BUFFER_COUNT = 64;       // 读文件的固定缓冲数量，每块FILE_BUFFER_SIZE字节
+const size_t FILE_BUFFER_SIZE = 64 * 1024;
+
+// io_uring引擎中的连接：socket上的操作都是异步的，所有操作完成前不能关闭fd和释放对象
+struct UringConnection : Connection {
+    int pending_ops = 0;            // 已提交、尚未完成的操作数（多次触发的recv只算一个）
+    bool recv_armed = false;        // 多次触发的recv还在进行
+    bool recv_cancelled = false;    // 已请求取消recv（缓冲中积压的数据太多）
+    int buffer_slot = -1;           // 占用的读文件固定缓冲编号，-1表示使用自己的chunk缓冲
+    iovec send_iov[MAX_SEND_IOVECS];    // 进行中的sendmsg的数据段，操作完成前保持有效
+    msghdr send_msg{};
+};
+
+// 内核是否支持io_uring引擎需要的功能：多次触发的recv需要Linux 6.0+，并能注册提供缓冲环
+bool io_uring_available() {
+    utsname name{};
+    int major = 0, minor = 0;
+    if (uname(&name) != 0 || std::sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) return false;
+
+    IoUring ring;
+    if (!ring.init(8)) return false;
+    size_t ring_bytes = 8 * sizeof(io_uring_buf);
+    void* buffers = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) return false;
+    bool ok = ring.register_buffer_ring(static_cast<io_uring_buf*>(buffers), 8, RECV_BUFFER_GROUP);
+    munmap(buffers, ring_bytes);
+    return ok;
+}
+
+// 基于io_uring的事件循环：accept、recv、send和文件读取都作为异步操作提交，
+// 每轮一次io_uring_enter批量提交并收取完成事件，不再逐个调用accept/recv/send。
+// 监听socket使用多次触发的accept；每个连接一个多次触发的recv，数据直接写入预先提供的缓冲环；
+// 文件内容用READ_FIXED读入预先注册的固定缓冲后发送（固定缓冲用完时读入连接自己的缓冲）。stat、open等仍在线程池中完成，和epoll引擎相同
+class UringLoop : public ConnectionLoop {
+public:
+    UringLoop(int listen_socket, WorkerLanes& worker_lanes)
+        : ConnectionLoop(listen_socket, worker_lanes) {
+        // 由io_uring读取，不能设为非阻塞（否则读操作会直接返回EAGAIN）
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            throw std::runtime_error("eventfd setup failed");
+        }
+        // accept由io_uring等待，监听socket保持阻塞模式
+        int flags = fcntl(listen_fd, F_GETFL, 0);
+        fcntl(listen_fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    ~UringLoop() {
+        if (recv_ring) munmap(recv_ring, RECV_BUFFER_COUNT * sizeof(io_uring_buf));
+    }
+
+    void run() override {
+        // 队列必须在运行事件循环的线程中创建（IORING_SETUP_SINGLE_ISSUER）
+        if (!ring.init(URING_ENTRIES) || !setup_buffers()) {
+            throw std::runtime_error("io_uring setup failed");
+        }
+        arm_accept();
+        arm_wake();
+        arm_tick();
+        while (true) {
+            ring.submit(1);
+            ring.reap([this](const UringCompletion& completion) { dispatch(completion); });
+            free_closed();
+        }
+    }
+
+private:
+    enum class Op : uint64_t { Accept = 1, Wake, Tick, Cancel, Recv, Send, Read };
 
-    if (bytes_read <= 0) {
-        CLOSE_SOCKET(client_socket);
-        return;
+    // user_data：连接指针（8字节对齐）的低3位存放操作类型
+    static uint64_t tag(Connection* conn, Op op) {
+        return reinterpret_cast<uint64_t>(conn) | static_cast<uint64_t>(op);
     }
 
-    buffer[bytes_read] = '\0';
-    std::string request(buffer);
+    bool setup_buffers() {
+        size_t ring_bytes = RECV_BUFFER_COUNT * sizeof(io_uring_buf);
+        void* ring_memory = mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring_memory == MAP_FAILED) return false;
+        recv_ring = static_cast<io_uring_buf*>(ring_memory);
+        recv_memory.resize(static_cast<size_t>(RECV_BUFFER_COUNT) * BUFFER_SIZE);
+        if (!ring.register_buffer_ring(recv_ring, RECV_BUFFER_COUNT, RECV_BUFFER_GROUP)) return false;
+        for (unsigned i = 0; i < RECV_BUFFER_COUNT; ++i) return_recv_buffer(static_cast<uint16_t>(i));
 
-    // 检查是否为GET请求
-    if (request.substr(0, 3) != "GET") {
-        send_response(client_socket, "405 Method Not Allowed", "text/plain", "Method Not Allowed");
-        CLOSE_SOCKET(client_socket);
-        return;
+        // 固定缓冲受RLIMIT_MEMLOCK限制，注册失败时退回普通READ
+        file_memory.resize(FILE_BUFFER_COUNT * FILE_BUFFER_SIZE);
+        std::vector<iovec> iovecs(FILE_BUFFER_COUNT);
+        for (unsigned i = 0; i < FILE_BUFFER_COUNT; ++i) {
+            iovecs[i].iov_base = file_memory.data() + i * FILE_BUFFER_SIZE;
+            iovecs[i].iov_len = FILE_BUFFER_SIZE;
+            free_slots.push_back(static_cast<int>(i));
+        }
+        fixed_buffers = ring.register_buffers(iovecs);
+        return true;
     }
 
-    // 提取请求路径
-    size_t start = request.find(' ') + 1;
-    size_t end = request.find(' ', start);
-    std::string path = request.substr(start, end - start);
+    // 把recv用过的缓冲放回提供缓冲环（环的tail和第0项的resv字段重叠）
+    void return_recv_buffer(uint16_t id) {
+        io_uring_buf& buf = recv_ring[recv_ring_tail & (RECV_BUFFER_COUNT - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(recv_memory.data() + static_cast<size_t>(id) * BUFFER_SIZE);
+        buf.len = BUFFER_SIZE;
+        buf.bid = id;
+        recv_ring_tail++;
+        __atomic_store_n(&recv_ring[0].resv, recv_ring_tail, __ATOMIC_RELEASE);
+    }
 
-    // URL解码
-    path = url_decode(path);
+    void dispatch(const UringCompletion& completion) {
+        Op op = static_cast<Op>(completion.user_data & 7);
+        UringConnection* conn = reinterpret_cast<UringConnection*>(completion.user_data & ~static_cast<uint64_t>(7));
+        switch (op) {
+        case Op::Accept:
+            on_accept(completion);
+            break;
+        case Op::Wake:
+            handle_completions();
+            arm_wake();
+            break;
+        case Op::Tick:
+            expire_timers();
+            // accept因出错（如文件描述符耗尽）停止后，每格重试一次
+            if (!accept_armed) arm_accept();
+            arm_tick();
+            break;
+        case Op::Cancel:
+            break;
+        case Op::Recv:
+            on_recv(conn, completion);
+            break;
+        case Op::Send:
+            on_send(conn, completion.res);
+            break;
+        case Op::Read:
+            on_read(conn, completion.res);
+            break;
+        }
+    }
 
-    // 检查路径遍历攻击
-    if (path.find("..") != std::string::npos ||
-        path.find("//") != std::string::npos ||
-        path.find("\\") != std::string::npos) {
-        send_response(client_socket, "403 Forbidden", "text/plain", "Forbidden");
-        CLOSE_SOCKET(client_socket);
-        return;
+    void arm_accept() {
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(nullptr, Op::Accept);
+        accept_armed = true;
     }
 
-    // 处理下载请求 - 修复路径处理
-    if (path.find("/download/") == 0) {
-        // 正确提取文件路径
-        std::string file_path = ROOT_DIR + path.substr(9);
-        send_file(client_socket, file_path, "application/octet-stream", true);
-        CLOSE_SOCKET(client_socket);
-        return;
+    // 工作线程通过eventfd通知处理结果
+    void arm_wake() {
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+        sqe->len = sizeof(wake_value);
+        sqe->user_data = tag(nullptr, Op::Wake);
     }
 
-    // 默认文件为index.html
-    if (path == "/" || path.empty()) path = "/index.html";
+    // 每格一次的定时器，用于推进时间轮
+    void arm_tick() {
+        tick_interval.tv_sec = 0;
+        tick_interval.tv_nsec = TIMER_TICK_MS * 1000000LL;
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&tick_interval);
+        sqe->len = 1;
+        sqe->user_data = tag(nullptr, Op::Tick);
+    }
 
-    // 构造文件路径
-    std::string file_path = ROOT_DIR + path;
+    void arm_recv(UringConnection* conn) {
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = static_cast<uint16_t>(RECV_BUFFER_GROUP);
+        sqe->user_data = tag(conn, Op::Recv);
+        conn->recv_armed = true;
+        conn->recv_cancelled = false;
+        conn->pending_ops++;
+    }
 
-    #if defined(_WIN32)
-        // 将所有'/'替换为'\\'，保证Windows路径兼容
-        std::replace(file_path.begin(), file_path.end(), '/', '\\');
-    #endif
+    void cancel_recv(UringConnection* conn) {
+        if (!conn->recv_armed || conn->recv_cancelled) return;
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(conn, Op::Recv);
+        sqe->user_data = tag(nullptr, Op::Cancel);
+        conn->recv_cancelled = true;
+    }
 
-    // 检查是否为目录
-    if (is_directory(file_path)) {
-        // 确保路径以斜杠结尾
-        if (path.back() != '/') {
-            std::string redirect = "HTTP/1.1 301 Moved Permanently\r\nLocation: " + path + "/\r\n\r\n";
-            send(client_socket, redirect.c_str(), static_cast<int>(redirect.size()), 0);
-            CLOSE_SOCKET(client_socket);
+    void on_accept(const UringCompletion& completion) {
+        bool more = (completion.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) accept_armed = false;
+        if (completion.res < 0) {
+            std::cerr << "Accept failed. Error: " << -completion.res << "\n";
             return;
         }
+        if (!more) arm_accept();
 
-        // 生成目录列表
-        std::ostringstream dir_list;
-        dir_list << "<html><head><title>Directory Listing</title>"
-            << "<meta charset=\"UTF-8\">"  // 添加UTF-8字符集声明
-            << "<style>"
-            << "body { font-family: Arial, sans-serif; margin: 20px; }"
-            << "h1 { color: #333; }"
-            << "ul { list-style-type: none; padding: 0; }"
-            << "li { margin: 5px 0; }"
-            << "a { text-decoration: none; color: #0066cc; }"
-            << "a:hover { text-decoration: underline; }"
-            << "</style></head>"
-            << "<body><h1>Directory Listing: " << path << "</h1><ul>";
+        UringConnection* conn = new UringConnection();
+        conn->fd = completion.res;
+        set_no_delay(conn->fd);
+        set_deadline(conn, TimeoutKind::Header);
 
-#if defined(_WIN32)
-        // Windows目录遍历 - 使用宽字符API支持Unicode
-        WIN32_FIND_DATAW findData;
-        std::wstring wide_path = std::wstring(file_path.begin(), file_path.end()) + L"\\*";
-        HANDLE hFind = FindFirstFileW(wide_path.c_str(), &findData);
-        if (hFind != INVALID_HANDLE_VALUE) {
-            do {
-                if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
-                    continue;
+        // 获取客户端IP（多次触发的accept不返回对端地址）
+        sockaddr_in client_address{};
+        socklen_t client_addr_len = sizeof(client_address);
+        char client_ip[INET_ADDRSTRLEN] = "-";
+        if (getpeername(conn->fd, reinterpret_cast<sockaddr*>(&client_address), &client_addr_len) == 0) {
+            inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
+        }
+        conn->client_ip = client_ip;
 
-                // 将宽字符文件名转换为UTF-8
-                int size_needed = WideCharToMultiByte(CP_UTF8, 0, findData.cFileName, -1, nullptr, 0, nullptr, nullptr);
-                std::string filename(size_needed, 0);
-                WideCharToMultiByte(CP_UTF8, 0, findData.cFileName, -1, &filename[0], size_needed, nullptr, nullptr);
-                filename.pop_back(); // 移除null终止符
+        arm_recv(conn);
+        ++connection_count;
+        metrics.local().connections.add(1);
+    }
 
-                std::string item_path = path + (path.back() == '/' ? "" : "/") + filename;
-                std::string full_path = file_path + "\\" + filename;
+    void on_recv(UringConnection* conn, const UringCompletion& completion) {
+        bool more = (completion.flags & IORING_CQE_F_MORE) != 0;
+        if (completion.flags & IORING_CQE_F_BUFFER) {
+            uint16_t id = static_cast<uint16_t>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (completion.res > 0 && !conn->dead) {
+                conn->in.append(recv_memory.data() + static_cast<size_t>(id) * BUFFER_SIZE, static_cast<size_t>(completion.res));
+            }
+            return_recv_buffer(id);
+        }
+        if (!more) {
+            conn->recv_armed = false;
+            conn->pending_ops--;
+        }
+        if (conn->dead) {
+            reclaim(conn);
+            return;
+        }
 
-                // 修复下载链接生成 - 使用正确的路径格式
-                if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                    dir_list << "<li><a href=\"" << item_path << "/\">" << filename << "/</a></li>";
-                }
-                else {
-                    // 确保下载路径以/download/开头，后面是完整的文件路径
-                    dir_list << "<li><a href=\"" << item_path << "\">" << filename << "</a> "
-                        << "(<a href=\"/download" << item_path << "\">Download</a>)</li>";
-                }
-            } while (FindNextFileW(hFind, &findData));
-            FindClose(hFind);
+        if (completion.res > 0) {
+            note_input(conn);
+            // 缓冲中积压太多时暂停接收，process_input处理掉已有的请求后会重新开始
+            if (conn->in.size() > MAX_REQUEST_HEADER_SIZE) cancel_recv(conn);
+            process_input(conn);
         }
-#else
-        // POSIX目录遍历
-        DIR* dir = opendir(file_path.c_str());
-        if (dir) {
-            struct dirent* ent;
-            while ((ent = readdir(dir)) != nullptr) {
-                std::string filename = ent->d_name;
-                if (filename == "." || filename == "..") continue;
+        else if (completion.res == 0) {
+            conn->read_closed = true;
+            process_input(conn);
+        }
+        else if (completion.res == -ENOBUFS || completion.res == -ECANCELED) {
+            // 提供缓冲暂时用完或被暂停，需要时由process_input重新提交recv
+            process_input(conn);
+        }
+        else {
+            close_connection(conn);
+        }
+    }
 
-                std::string item_path = path + (path.back() == '/' ? "" : "/") + filename;
-                std::string full_path = file_path + "/" + filename;
+    bool read_more(Connection* base) override {
+        UringConnection* conn = static_cast<UringConnection*>(base);
+        if (!conn->recv_armed) arm_recv(conn);
+        return false;
+    }
 
-                struct stat st;
-                if (stat(full_path.c_str(), &st)) continue;
+    void start_response(Connection* conn, HttpResponse&& response) override {
+        begin_response(conn, std::move(response));
+        continue_send(static_cast<UringConnection*>(conn));
+    }
 
-                // 修复下载链接生成 - 使用正确的路径格式
-                if (S_ISDIR(st.st_mode)) {
-                    dir_list << "<li><a href=\"" << item_path << "/\">" << filename << "/</a></li>";
-                }
-                else {
-                    // 确保下载路径以/download/开头，后面是完整的文件路径
-                    dir_list << "<li><a href=\"" << item_path << "\">" << filename << "</a> "
-                        << "(<a href=\"/download" << item_path << "\">Download</a>)</li>";
-                }
+    void resume_output(Connection* conn) override {
+        continue_send(static_cast<UringConnection*>(conn));
+    }
+
+    // 提交响应的下一段数据，每个连接同时只有一个send或read在进行。
+    // 响应头、内存分段和已读入的文件块合并成一个sendmsg；文件块还没读入时先读，读完再和响应头一起发出
+    void continue_send(UringConnection* conn) {
+        OutputState state = prepare_output(conn);
+        if (state == OutputState::Pending) return;
+        if (state == OutputState::Error) {
+            close_connection(conn);
+            return;
+        }
+        if (conn->out_seg < conn->out.body.size()) {
+            const BodySegment& seg = conn->out.body[conn->out_seg];
+            if (seg.file && conn->chunk_pos == conn->chunk_len) {
+                submit_read(conn, seg);
+                return;
             }
-            closedir(dir);
         }
-#endif
 
-        dir_list << "</ul></body></html>";
-        send_response(client_socket, "200 OK", "text/html", dir_list.str());
-        CLOSE_SOCKET(client_socket);
-        return;
+        bool file_follows = false;
+        size_t count = gather_output(conn, conn->send_iov, MAX_SEND_IOVECS, file_follows);
+        if (count == 0) {
+            finish_response(conn);
+            return;
+        }
+        conn->send_msg = msghdr{};
+        conn->send_msg.msg_iov = conn->send_iov;
+        conn->send_msg.msg_iovlen = count;
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn->send_msg);
+        sqe->len = 1;
+        // 后面的文件块读入后紧接着发送，先压住这部分数据
+        sqe->msg_flags = MSG_NOSIGNAL | (file_follows ? MSG_MORE : 0);
+        sqe->user_data = tag(conn, Op::Send);
+        conn->pending_ops++;
     }
 
-    // 检查文件是否存在
-    if (!file_exists(file_path)) {
-        std::cerr << "File does not exist: " << file_path << std::endl;
-        send_response(client_socket, "404 Not Found", "text/plain", "File Not Found");
-        CLOSE_SOCKET(client_socket);
-        return;
+    // 读文件的下一块：优先占用一块固定缓冲；固定缓冲都被（可能很慢的）其他连接占着时用连接自己的缓冲，不排队等待
+    void submit_read(UringConnection* conn, const BodySegment& seg) {
+        if (fixed_buffers && !free_slots.empty()) {
+            conn->buffer_slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        else if (conn->chunk.empty()) {
+            conn->chunk.resize(FILE_BUFFER_SIZE);
+        }
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = conn->buffer_slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = seg.file->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(chunk_data(conn));
+        sqe->len = static_cast<uint32_t>(std::min<long long>(FILE_BUFFER_SIZE, seg.length - conn->out_pos));
+        sqe->off = static_cast<uint64_t>(seg.offset + conn->out_pos);
+        if (conn->buffer_slot >= 0) sqe->buf_index = static_cast<uint16_t>(conn->buffer_slot);
+        sqe->user_data = tag(conn, Op::Read);
+        conn->pending_ops++;
     }
 
-    // 获取文件扩展名
-    std::string ext;
-    size_t dot_pos = file_path.find_last_of('.');
-    if (dot_pos != std::string::npos) {
-        ext = file_path.substr(dot_pos);
+    void on_send(UringConnection* conn, int res) {
+        conn->pending_ops--;
+        if (conn->dead) {
+            reclaim(conn);
+            return;
+        }
+        if (res < 0) {
+            if (res == -EAGAIN || res == -EINTR) continue_send(conn);
+            else close_connection(conn);
+            return;
+        }
+
+        advance_output(conn, static_cast<size_t>(res));
+        // 一块发完就归还固定缓冲，发送很慢的连接不会一直占着
+        if (conn->chunk_pos == conn->chunk_len) release_slot(conn);
+        continue_send(conn);
     }
 
-    // 获取Content-Type
-    std::string content_type = get_content_type(ext);
+    void on_read(UringConnection* conn, int res) {
+        conn->pending_ops--;
+        if (conn->dead) {
+            reclaim(conn);
+            return;
+        }
+        if (res <= 0) {
+            // 文件被截断或读取失败，无法再发送声明的长度
+            close_connection(conn);
+            return;
+        }
+        conn->chunk_buf = chunk_data(conn);
+        conn->chunk_pos = 0;
+        conn->chunk_len = static_cast<size_t>(res);
+        continue_send(conn);
+    }
 
-    // 发送文件 - 统一使用send_file函数
-    send_file(client_socket, file_path, content_type);
-    CLOSE_SOCKET(client_socket);
+    char* chunk_data(UringConnection* conn) {
+        if (conn->buffer_slot < 0) return conn->chunk.data();
+        return file_memory.data() + static_cast<size_t>(conn->buffer_slot) * FILE_BUFFER_SIZE;
+    }
+
+    void release_slot(UringConnection* conn) {
+        if (conn->buffer_slot < 0) return;
+        free_slots.push_back(conn->buffer_slot);
+        conn->buffer_slot = -1;
+    }
+
+    void close_connection(Connection* base) override {
+        UringConnection* conn = static_cast<UringConnection*>(base);
+        if (conn->dead) return;
+        // 发送中途断开的响应也记录下来（字节数为实际发出的部分）
+        if (conn->sending) {
+            log_response(conn);
+            metrics.local().aborted.add(1);
+        }
+        metrics.local().connections.add(-1);
+        conn->dead = true;
+        // 让进行中的recv/send尽快结束；fd等所有操作完成后才关闭，避免编号被新连接重用后操作落到别的连接上
+        shutdown(conn->fd, SHUT_RDWR);
+        cancel_recv(conn);
+        timers.cancel(&conn->timer);
+        --connection_count;
+        reclaim(conn);
+    }
+
+    // 线程池任务和已提交的操作都结束后才关闭fd、释放连接（发送中的数据在conn->out里）
+    void reclaim(Connection* base) override {
+        UringConnection* conn = static_cast<UringConnection*>(base);
+        if (!conn->dead || conn->busy || conn->pending_ops > 0) return;
+        release_slot(conn);
+        close(conn->fd);
+        closed.push_back(conn);
+    }
+
+    IoUring ring;
+    bool accept_armed = false;
+    uint64_t wake_value = 0;
+    __kernel_timespec tick_interval{};
+    io_uring_buf* recv_ring = nullptr;
+    uint16_t recv_ring_tail = 0;
+    std::vector<char> recv_memory;
+    std::vector<char> file_memory;
+    bool fixed_buffers = false;
+    std::vector<int> free_slots;
+};
+#else
+// 内核头文件太旧，没有编译io_uring引擎
+bool io_uring_available() {
+    return false;
+}
+#endif
+
+// 按IO_ENGINE创建事件循环
+std::unique_ptr<ConnectionLoop> make_event_loop(int listener, WorkerLanes& lanes) {
+#if defined(LAN_HTTP_IO_URING)
+    if (IO_ENGINE == "uring") return std::unique_ptr<ConnectionLoop>(new UringLoop(listener, lanes));
+#endif
+    return std::unique_ptr<ConnectionLoop>(new EventLoop(listener, lanes));
+}
+
+// 将可打开的文件数提高到硬限制，以便同时保持上千个连接
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 }
+#endif
 
 // 显示帮助信息
 void print_help() {
@@ -521,6 +5484,25 @@ void print_help() {
     std::cout << "Options:\n";
     std::cout << "  -p <port>      Specify server port (default: 8080)\n";
     std::cout << "  -www <dir>     Specify web root directory (default: .)\n";
+    std::cout << "  -headertimeout <s> Time allowed to receive a request's headers, 0 to disable (default: 10)\n";
+    std::cout << "  -sendtimeout <s>   Time allowed without send progress before a response is dropped, 0 to disable (default: 30)\n";
+    std::cout << "  -keepalive <s> Keep-alive idle timeout in seconds, 0 to disable (default: 5)\n";
+    std::cout << "  -maxreq <n>    Maximum requests per keep-alive connection (default: 100)\n";
+    std::cout << "  -cache <MB>    Hot small-file cache size in MB, 0 to disable (default: 64)\n";
+    std::cout << "  -dircache <MB> Directory listing cache size in MB, 0 to disable (default: 32)\n";
+    std::cout << "  -fdcache <n>   Open file descriptors and stat results to cache, 0 to disable (default: 1024)\n";
+    std::cout << "  -maxheader <n> Request line and headers size limit in bytes (default: 65536)\n";
+    std::cout << "  -maxline <n>   Request line size limit in bytes (default: 8192)\n";
+    std::cout << "  -maxfields <n> Maximum number of request headers (default: 100)\n";
+    std::cout << "  -maxqueue <n>  Requests waiting for a worker before new ones get 503, 0 = unlimited (default: 4096)\n";
+    std::cout << "  -maxwait <ms>  Queue wait after which a request gets 503 instead of being served, 0 = unlimited (default: 2000)\n";
+    std::cout << "  -threads <n>   Worker threads for small and cached responses, 0 = one per core, at least 2 (default: 0)\n";
+    std::cout << "  -bulkthreads <n>   Worker threads for large transfers, 0 = same as -threads (default: 0)\n";
+    std::cout << "  -bulkqueue <n>     Large transfers waiting for a bulk worker before new ones get 503, 0 = unlimited (default: 4096)\n";
+    std::cout << "  -bulksize <KB>     Responses at least this large run on the bulk lane (default: 1024)\n";
+    std::cout << "  -listeners <n> SO_REUSEPORT listeners with one event loop each, 0 = one per core (Linux, default: 1)\n";
+    std::cout << "  -io <engine>   I/O engine: epoll, uring or blocking (Linux, default: epoll)\n";
+    std::cout << "  -gzcache <dir> Build .gz copies of text files in <dir> (needs LAN_HTTP_USE_ZLIB)\n";
     std::cout << "  -h, --help     Show this help message\n";
 }
 
@@ -551,6 +5533,64 @@ void parse_arguments(int argc, char* argv[]) {
             }
             i++; // 跳过下一个参数
         }
+        else if ((arg == "-keepalive" || arg == "-maxreq" || arg == "-cache" || arg == "-dircache" ||
+            arg == "-maxqueue" || arg == "-maxwait" || arg == "-headertimeout" || arg == "-sendtimeout" ||
+            arg == "-fdcache" || arg == "-threads" || arg == "-bulkthreads" || arg == "-bulkqueue" || arg == "-bulksize") && i + 1 < argc) {
+            try {
+                int value = std::stoi(argv[i + 1]);
+                if (value < 0) throw std::out_of_range("negative");
+                (arg == "-keepalive" ? KEEP_ALIVE_TIMEOUT : arg == "-maxreq" ? MAX_KEEP_ALIVE_REQUESTS :
+                    arg == "-cache" ? HOT_CACHE_MB : arg == "-dircache" ? LISTING_CACHE_MB :
+                    arg == "-maxqueue" ? MAX_QUEUE_DEPTH : arg == "-maxwait" ? MAX_QUEUE_WAIT_MS :
+                    arg == "-headertimeout" ? HEADER_TIMEOUT : arg == "-sendtimeout" ? SEND_TIMEOUT :
+                    arg == "-threads" ? THREAD_POOL_SIZE : arg == "-bulkthreads" ? BULK_THREADS :
+                    arg == "-bulkqueue" ? BULK_MAX_QUEUE : arg == "-bulksize" ? BULK_MIN_KB : FD_CACHE_ENTRIES) = value;
+                i++; // 跳过下一个参数
+            }
+            catch (...) {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+        }
+        else if ((arg == "-maxheader" || arg == "-maxline" || arg == "-maxfields") && i + 1 < argc) {
+            try {
+                int value = std::stoi(argv[i + 1]);
+                if (value <= 0) throw std::out_of_range("not positive");
+                (arg == "-maxheader" ? MAX_REQUEST_HEADER_SIZE : arg == "-maxline" ? MAX_REQUEST_LINE_SIZE :
+                    MAX_HEADER_COUNT) = static_cast<size_t>(value);
+                i++; // 跳过下一个参数
+            }
+            catch (...) {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+        }
+        else if (arg == "-listeners" && i + 1 < argc) {
+            try {
+                LISTENER_COUNT = std::stoi(argv[i + 1]);
+                if (LISTENER_COUNT < 0) throw std::out_of_range("negative");
+                i++; // 跳过下一个参数
+            }
+            catch (...) {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+        }
+        else if (arg == "-io" && i + 1 < argc) {
+            IO_ENGINE = argv[i + 1];
+            if (IO_ENGINE != "epoll" && IO_ENGINE != "uring" && IO_ENGINE != "blocking") {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+            i++; // 跳过下一个参数
+        }
+        else if (arg == "-gzcache" && i + 1 < argc) {
+            GZIP_CACHE_DIR = argv[i + 1];
+            if (!GZIP_CACHE_DIR.empty() && (GZIP_CACHE_DIR.back() == '/' || GZIP_CACHE_DIR.back() == '\\')) {
+                GZIP_CACHE_DIR.pop_back();
+            }
+            i++; // 跳过下一个参数
+        }
         else if (arg == "-h" || arg == "--help") {
             print_help();
             exit(0);
@@ -601,6 +5641,64 @@ void parse_arguments_w(int argc, wchar_t* argv[]) {
             }
             i++; // 跳过下一个参数
         }
+        else if ((arg == L"-keepalive" || arg == L"-maxreq" || arg == L"-cache" || arg == L"-dircache" ||
+            arg == L"-maxqueue" || arg == L"-maxwait" || arg == L"-headertimeout" || arg == L"-sendtimeout" ||
+            arg == L"-fdcache" || arg == L"-threads" || arg == L"-bulkthreads" || arg == L"-bulkqueue" || arg == L"-bulksize") && i + 1 < argc) {
+            try {
+                int value = std::stoi(argv[i + 1]);
+                if (value < 0) throw std::out_of_range("negative");
+                (arg == L"-keepalive" ? KEEP_ALIVE_TIMEOUT : arg == L"-maxreq" ? MAX_KEEP_ALIVE_REQUESTS :
+                    arg == L"-cache" ? HOT_CACHE_MB : arg == L"-dircache" ? LISTING_CACHE_MB :
+                    arg == L"-maxqueue" ? MAX_QUEUE_DEPTH : arg == L"-maxwait" ? MAX_QUEUE_WAIT_MS :
+                    arg == L"-headertimeout" ? HEADER_TIMEOUT : arg == L"-sendtimeout" ? SEND_TIMEOUT :
+                    arg == L"-threads" ? THREAD_POOL_SIZE : arg == L"-bulkthreads" ? BULK_THREADS :
+                    arg == L"-bulkqueue" ? BULK_MAX_QUEUE : arg == L"-bulksize" ? BULK_MIN_KB : FD_CACHE_ENTRIES) = value;
+                i++; // 跳过下一个参数
+            }
+            catch (...) {
+                std::wcerr << L"Invalid value for " << arg << L": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+        }
+        else if ((arg == L"-maxheader" || arg == L"-maxline" || arg == L"-maxfields") && i + 1 < argc) {
+            try {
+                int value = std::stoi(argv[i + 1]);
+                if (value <= 0) throw std::out_of_range("not positive");
+                (arg == L"-maxheader" ? MAX_REQUEST_HEADER_SIZE : arg == L"-maxline" ? MAX_REQUEST_LINE_SIZE :
+                    MAX_HEADER_COUNT) = static_cast<size_t>(value);
+                i++; // 跳过下一个参数
+            }
+            catch (...) {
+                std::wcerr << L"Invalid value for " << arg << L": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+        }
+        else if (arg == L"-listeners" && i + 1 < argc) {
+            try {
+                LISTENER_COUNT = std::stoi(argv[i + 1]);
+                if (LISTENER_COUNT < 0) throw std::out_of_range("negative");
+                i++; // 跳过下一个参数
+            }
+            catch (...) {
+                std::wcerr << L"Invalid value for " << arg << L": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+        }
+        else if (arg == L"-io" && i + 1 < argc) {
+            IO_ENGINE = wstring_to_utf8(argv[i + 1]);
+            if (IO_ENGINE != "epoll" && IO_ENGINE != "uring" && IO_ENGINE != "blocking") {
+                std::wcerr << L"Invalid value for " << arg << L": " << argv[i + 1] << std::endl;
+                exit(1);
+            }
+            i++; // 跳过下一个参数
+        }
+        else if (arg == L"-gzcache" && i + 1 < argc) {
+            GZIP_CACHE_DIR = wstring_to_utf8(argv[i + 1]);
+            if (!GZIP_CACHE_DIR.empty() && (GZIP_CACHE_DIR.back() == '/' || GZIP_CACHE_DIR.back() == '\\')) {
+                GZIP_CACHE_DIR.pop_back();
+            }
+            i++; // 跳过下一个参数
+        }
         else if (arg == L"-h" || arg == L"--help") {
             print_help();
             exit(0);
@@ -612,199 +5710,237 @@ void parse_arguments_w(int argc, wchar_t* argv[]) {
         }
     }
 }
+#endif
 
-int wmain(int argc, wchar_t* argv[]) {
-    try {
-        // 设定编码
-        SetConsoleOutputCP(CP_UTF8);
-        SetConsoleCP(CP_UTF8);
-        // 解析命令行参数（宽字符版）
-        parse_arguments_w(argc, argv);
-
-        init_networking();
-
-        // 创建线程池
-        ThreadPool pool(THREAD_POOL_SIZE);
-
-        // 创建服务器socket
-        SOCKET_HANDLE server_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_socket == INVALID_SOCKET_VALUE) {
-            std::cerr << "Failed to create socket. Error: " << GET_SOCKET_ERRNO << "\n";
-            cleanup_networking();
-            return 1;
-        }
+// 创建监听socket，失败时输出原因并返回INVALID_SOCKET_VALUE。
+// reuse_port为true时设置SO_REUSEPORT，多个socket可以绑定同一端口，由内核分配新连接
+SOCKET_HANDLE open_listener(bool reuse_port) {
+    SOCKET_HANDLE server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket == INVALID_SOCKET_VALUE) {
+        std::cerr << "Failed to create socket. Error: " << GET_SOCKET_ERRNO << "\n";
+        return INVALID_SOCKET_VALUE;
+    }
 
-        // 设置socket选项
-        int opt = 1;
-        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR,
-            reinterpret_cast<const char*>(&opt), sizeof(opt));
+    // 设置socket选项
+    int opt = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR,
+        reinterpret_cast<const char*>(&opt), sizeof(opt));
+#if defined(__linux__)
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0) {
+        std::cerr << "SO_REUSEPORT failed. Error: " << GET_SOCKET_ERRNO << "\n";
+        CLOSE_SOCKET(server_socket);
+        return INVALID_SOCKET_VALUE;
+    }
+#else
+    (void)reuse_port;
+#endif
 
-        // 绑定地址和端口
-        sockaddr_in server_address{};
-        server_address.sin_family = AF_INET;
-        server_address.sin_addr.s_addr = INADDR_ANY;
-        server_address.sin_port = htons(PORT);
+    // 绑定地址和端口
+    sockaddr_in server_address{};
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = INADDR_ANY;
+    server_address.sin_port = htons(PORT);
 
-        if (bind(server_socket, reinterpret_cast<sockaddr*>(&server_address),
-            sizeof(server_address)) == SOCKET_ERROR_VALUE) {
-            std::cerr << "Bind failed. Error: " << GET_SOCKET_ERRNO << "\n";
-            CLOSE_SOCKET(server_socket);
-            cleanup_networking();
-            return 1;
-        }
+    if (bind(server_socket, reinterpret_cast<sockaddr*>(&server_address),
+        sizeof(server_address)) == SOCKET_ERROR_VALUE) {
+        std::cerr << "Bind failed. Error: " << GET_SOCKET_ERRNO << "\n";
+        CLOSE_SOCKET(server_socket);
+        return INVALID_SOCKET_VALUE;
+    }
 
-        // 开始监听
-        if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR_VALUE) {
-            std::cerr << "Listen failed. Error: " << GET_SOCKET_ERRNO << "\n";
-            CLOSE_SOCKET(server_socket);
-            cleanup_networking();
-            return 1;
-        }
+    // 开始监听
+    if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR_VALUE) {
+        std::cerr << "Listen failed. Error: " << GET_SOCKET_ERRNO << "\n";
+        CLOSE_SOCKET(server_socket);
+        return INVALID_SOCKET_VALUE;
+    }
+    return server_socket;
+}
 
-        std::cout << "Server running on port " << PORT << "\n";
-        std::cout << "Web root directory: " << ROOT_DIR << "\n";
-        std::cout << "Thread pool size: " << THREAD_POOL_SIZE << "\n";
-        std::cout << "Press Ctrl+C to stop the server\n";
+#if defined(__linux__)
+// 事件循环的数量：LISTENER_COUNT为0时每个CPU核心一个
+size_t event_loop_count() {
+    if (LISTENER_COUNT > 0) return static_cast<size_t>(LISTENER_COUNT);
+    return std::max(1u, std::thread::hardware_concurrency());
+}
 
-        while (true) {
-            // 接受客户端连接
-            sockaddr_in client_address{};
-            socklen_t client_addr_len = sizeof(client_address);
-            SOCKET_HANDLE client_socket = accept(server_socket,
-                reinterpret_cast<sockaddr*>(&client_address), &client_addr_len);
+// 每个监听socket一个事件循环线程，第i个线程绑定到第i个CPU核心；共享两个通道的线程池和各个缓存
+void run_event_loops(const std::vector<int>& listeners, WorkerLanes& lanes) {
+    std::vector<std::unique_ptr<ConnectionLoop>> loops;
+    for (int listener : listeners) loops.push_back(make_event_loop(listener, lanes));
 
-            if (client_socket == INVALID_SOCKET_VALUE) {
-                std::cerr << "Accept failed. Error: " << GET_SOCKET_ERRNO << "\n";
-                continue;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < loops.size(); ++i) {
+        ConnectionLoop* loop = loops[i].get();
+        threads.emplace_back([loop] {
+            try {
+                loop->run();
             }
-
-            // 获取客户端IP
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
-
-            // 读取请求的第一行，提取URL
-            char req_buf[BUFFER_SIZE] = { 0 };
-            ssize_t req_len = recv(client_socket, req_buf, sizeof(req_buf) - 1, MSG_PEEK);
-            std::string url_path;
-            if (req_len > 0) {
-                std::istringstream iss(req_buf);
-                std::string method, path;
-                iss >> method >> path;
-                url_path = path;
+            catch (const std::exception& e) {
+                std::cerr << "Event loop error: " << e.what() << "\n";
             }
+            });
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpus), &cpus);
+    }
+    for (std::thread& thread : threads) thread.join();
+}
+#endif
 
-            std::cout << "New connection from: " << client_ip;
-            if (!url_path.empty()) {
-                std::cout << " To: " << url_path;
-            }
-            std::cout << std::endl;
+// 阻塞accept + 线程池：每个连接交给一个工作线程，处理一个请求后关闭
+void run_blocking_server(SOCKET_HANDLE server_socket, WorkerLanes& lanes) {
+    while (true) {
+        // 接受客户端连接
+        sockaddr_in client_address{};
+        socklen_t client_addr_len = sizeof(client_address);
+        SOCKET_HANDLE client_socket = accept(server_socket,
+            reinterpret_cast<sockaddr*>(&client_address), &client_addr_len);
 
-            // 将任务加入线程池
-            pool.enqueue([client_socket] {
-                handle_request(client_socket);
-                });
+        if (client_socket == INVALID_SOCKET_VALUE) {
+            std::cerr << "Accept failed. Error: " << GET_SOCKET_ERRNO << "\n";
+            continue;
         }
 
-        CLOSE_SOCKET(server_socket);
-        cleanup_networking();
-    }
-    catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << "\n";
-        cleanup_networking();
-        return 1;
-    }
+        // 获取客户端IP
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
 
-    return 0;
+        // 将任务加入线程池，排队已满时直接回复503
+        metrics.local().connections.add(1);
+        std::string ip = client_ip;
+        bool queued = lanes.latency.try_enqueue([client_socket, ip, &lanes] {
+            handle_request(client_socket, ip, lanes);
+            }, WorkerLanes::max_queued(Lane::Latency));
+        if (!queued) reject_connection(client_socket, ip);
+    }
 }
-#else
-int main(int argc, char* argv[]) {
-    try {
-        // 解析命令行参数
-        parse_arguments(argc, argv);
 
+// 创建监听socket并运行服务器（Linux默认使用epoll事件循环，也可选io_uring或阻塞模型；其他平台使用阻塞accept + 线程池）
+int run_server() {
+    try {
         init_networking();
 
-        // 创建线程池
-        ThreadPool pool(THREAD_POOL_SIZE);
-
-        // 创建服务器socket
-        SOCKET_HANDLE server_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_socket == INVALID_SOCKET_VALUE) {
-            std::cerr << "Failed to create socket. Error: " << GET_SOCKET_ERRNO << "\n";
-            cleanup_networking();
-            return 1;
-        }
-
-        // 设置socket选项
-        int opt = 1;
-        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR,
-            reinterpret_cast<const char*>(&opt), sizeof(opt));
+        // 创建两个执行通道的线程池
+        WorkerLanes lanes(worker_thread_count(), bulk_thread_count());
+        compression_governor.queue_depth = [&lanes] { return lanes.queue_depth(); };
+        metrics.queue_depth = [&lanes](Lane lane) { return lanes[lane].queue_depth(); };
+        metrics.node_fallbacks = [&lanes](Lane lane) { return lanes[lane].node_fallbacks(); };
+        metrics.lane_workers[static_cast<int>(Lane::Latency)] = lanes.latency.size();
+        metrics.lane_workers[static_cast<int>(Lane::Bulk)] = lanes.bulk.size();
 
-        // 绑定地址和端口
-        sockaddr_in server_address{};
-        server_address.sin_family = AF_INET;
-        server_address.sin_addr.s_addr = INADDR_ANY;
-        server_address.sin_port = htons(PORT);
-
-        if (bind(server_socket, reinterpret_cast<sockaddr*>(&server_address),
-            sizeof(server_address)) == SOCKET_ERROR_VALUE) {
-            std::cerr << "Bind failed. Error: " << GET_SOCKET_ERRNO << "\n";
-            CLOSE_SOCKET(server_socket);
-            cleanup_networking();
-            return 1;
+        // 创建服务器socket；Linux上多个事件循环时每个循环各有一个SO_REUSEPORT监听socket
+#if defined(__linux__)
+        // io_uring不可用时退回epoll
+        if (IO_ENGINE == "uring" && !io_uring_available()) {
+            std::cerr << "io_uring unavailable, using epoll\n";
+            IO_ENGINE = "epoll";
         }
-
-        // 开始监听
-        if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR_VALUE) {
-            std::cerr << "Listen failed. Error: " << GET_SOCKET_ERRNO << "\n";
-            CLOSE_SOCKET(server_socket);
-            cleanup_networking();
-            return 1;
+        size_t loop_count = IO_ENGINE == "blocking" ? 1 : event_loop_count();
+#else
+        size_t loop_count = 1;
+#endif
+        std::vector<SOCKET_HANDLE> listeners;
+        for (size_t i = 0; i < loop_count; ++i) {
+            SOCKET_HANDLE listener = open_listener(loop_count > 1);
+            if (listener == INVALID_SOCKET_VALUE) {
+                for (SOCKET_HANDLE opened : listeners) CLOSE_SOCKET(opened);
+                cleanup_networking();
+                return 1;
+            }
+            listeners.push_back(listener);
         }
+        SOCKET_HANDLE server_socket = listeners[0];
 
         std::cout << "Server running on port " << PORT << "\n";
         std::cout << "Web root directory: " << ROOT_DIR << "\n";
-        std::cout << "Thread pool size: " << THREAD_POOL_SIZE << "\n";
+        std::cout << "Thread pool size: " << lanes.latency.size() << " latency + " << lanes.bulk.size()
+            << " bulk (work-stealing, bulk lane from " << BULK_MIN_KB << " KB)\n";
         std::cout << "Press Ctrl+C to stop the server\n";
+        access_log.start();
 
-        while (true) {
-            // 接受客户端连接
-            sockaddr_in client_address{};
-            socklen_t client_addr_len = sizeof(client_address);
-            SOCKET_HANDLE client_socket = accept(server_socket,
-                reinterpret_cast<sockaddr*>(&client_address), &client_addr_len);
+#if defined(__linux__)
+        // 对端断开时send返回EPIPE而不是终止进程
+        signal(SIGPIPE, SIG_IGN);
+        raise_fd_limit();
 
-            if (client_socket == INVALID_SOCKET_VALUE) {
-                std::cerr << "Accept failed. Error: " << GET_SOCKET_ERRNO << "\n";
-                continue;
-            }
+        if (IO_ENGINE == "uring") std::cout << "I/O model: io_uring (multishot accept/recv, registered buffers)\n";
+        else if (IO_ENGINE == "blocking") std::cout << "I/O model: blocking accept + thread pool\n";
+        else std::cout << "I/O model: epoll (edge-triggered)\n";
+#if defined(LAN_HTTP_USE_ZLIB)
+        std::cout << "On-the-fly gzip: responses of " << COMPRESS_MIN_SIZE << " bytes or more\n";
+#endif
 
-            // 获取客户端IP
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
+#if defined(LAN_HTTP_USE_ZLIB)
+        if (!GZIP_CACHE_DIR.empty()) {
+            gzip_builder.on_built = [](const std::string& url_path) {
+                file_cache.invalidate(url_path, false);
+            };
+            std::cout << "Gzip cache directory: " << GZIP_CACHE_DIR << "\n";
+        }
+#endif
 
-            // 读取请求的第一行，提取URL
-            char req_buf[BUFFER_SIZE] = { 0 };
-            ssize_t req_len = recv(client_socket, req_buf, sizeof(req_buf) - 1, MSG_PEEK);
-            std::string url_path;
-            if (req_len > 0) {
-                std::istringstream iss(req_buf);
-                std::string method, path;
-                iss >> method >> path;
-                url_path = path;
+        // 热点文件缓存依赖inotify失效，无法监视时不启用
+        if (HOT_CACHE_MB > 0) {
+            fs_watcher.add_listener([](const std::string& url_path, bool is_dir) {
+                file_cache.invalidate(url_path, is_dir);
+                // file.gz变化时，缓存中file的预压缩版本也要更新
+                if (!is_dir && url_path.size() > 3 && url_path.compare(url_path.size() - 3, 3, ".gz") == 0) {
+                    file_cache.invalidate(url_path.substr(0, url_path.size() - 3), false);
+                }
+                });
+        }
+        // 目录列表缓存：条目增删改名时失效所在目录的页面，目录本身变化时失效它和所有子目录的页面。
+        // 没有inotify时仍然可用，但每次都要stat目录并核对ETag
+        if (LISTING_CACHE_MB > 0) {
+            fs_watcher.add_listener([](const std::string& url_path, bool is_dir) {
+                if (url_path.empty()) {
+                    listing_cache.invalidate("", true);
+                    return;
+                }
+                listing_cache.invalidate(url_path.substr(0, url_path.rfind('/') + 1), false);
+                if (is_dir) listing_cache.invalidate(url_path, true);
+                });
+            listing_cache.configure(static_cast<size_t>(LISTING_CACHE_MB) * 1024 * 1024,
+                static_cast<size_t>(LISTING_CACHE_MB) * 1024 * 1024);
+            std::cout << "Directory listing cache: " << LISTING_CACHE_MB << " MB\n";
+        }
+        // 文件描述符缓存同样依赖inotify失效
+        if (FD_CACHE_ENTRIES > 0) {
+            fs_watcher.add_listener([](const std::string& url_path, bool is_dir) {
+                open_file_cache.invalidate(url_path, is_dir);
+                });
+        }
+        if (HOT_CACHE_MB > 0 || LISTING_CACHE_MB > 0 || FD_CACHE_ENTRIES > 0) {
+            if (!fs_watcher.start(ROOT_DIR)) {
+                std::cerr << "inotify unavailable, hot file cache and fd cache disabled\n";
             }
-
-            std::cout << "New connection from: " << client_ip;
-            if (!url_path.empty()) {
-                std::cout << " To: " << url_path;
+            else {
+                if (HOT_CACHE_MB > 0) {
+                    file_cache.configure(static_cast<size_t>(HOT_CACHE_MB) * 1024 * 1024, HOT_CACHE_MAX_FILE);
+                    std::cout << "Hot file cache: " << HOT_CACHE_MB << " MB\n";
+                }
+                if (FD_CACHE_ENTRIES > 0) {
+                    open_file_cache.configure(static_cast<size_t>(FD_CACHE_ENTRIES));
+                    std::cout << "Open file cache: " << FD_CACHE_ENTRIES << " entries\n";
+                }
             }
-            std::cout << std::endl;
-
-            // 将任务加入线程池
-            pool.enqueue([client_socket] {
-                handle_request(client_socket);
-                });
         }
+        if (IO_ENGINE == "blocking") {
+            run_blocking_server(server_socket, lanes);
+        }
+        else if (listeners.size() == 1) {
+            make_event_loop(server_socket, lanes)->run();
+        }
+        else {
+            std::cout << "Listeners: " << listeners.size() << " (SO_REUSEPORT, one event loop per core)\n";
+            run_event_loops(listeners, lanes);
+        }
+#else
+        run_blocking_server(server_socket, lanes);
+#endif
 
         CLOSE_SOCKET(server_socket);
         cleanup_networking();
@@ -817,4 +5953,23 @@ int main(int argc, char* argv[]) {
 
     return 0;
 }
-#endif
\ No newline at end of file
+
+// 定义LAN_HTTP_NO_MAIN后可将本文件作为库包含（基准测试程序使用）
+#if !defined(LAN_HTTP_NO_MAIN)
+#if defined(_WIN32)
+int wmain(int argc, wchar_t* argv[]) {
+    // 设定编码
+    SetConsoleOutputCP(CP_UTF8);
+    SetConsoleCP(CP_UTF8);
+    // 解析命令行参数（宽字符版）
+    parse_arguments_w(argc, argv);
+    return run_server();
+}
+#else
+int main(int argc, char* argv[]) {
+    // 解析命令行参数
+    parse_arguments(argc, argv);
+    return run_server();
+}
+#endif
+#endif
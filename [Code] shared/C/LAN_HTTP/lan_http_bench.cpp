@@ -0,0 +1,1334 @@
+// LAN_HTTP 基准测试程序（仅Linux）
+// 默认在子进程中启动服务器（直接包含lan_http.cpp），也可以用 -target 测试已运行的服务器。
+#define LAN_HTTP_NO_MAIN
+#include "lan_http.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// 统计堆分配次数，mime和urldecode模式用它确认热路径不分配内存
+std::atomic<unsigned long long> allocation_count{ 0 };
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace bench {
+
+// 测试配置
+std::string target_host = "127.0.0.1";
+int target_port = 0;
+bool external_target = false;
+int concurrency = 512;
+int probe_count = 20;
+int download_count = 20;  // engines模式中每种引擎的下载次数
+long long big_file_size = 16LL * 1024 * 1024;
+long long medium_file_size = 128 * 1024;
+int dir_file_count = 2000;   // 生成的大目录dir/中的文件数
+std::string request_mix = "small=80,medium=14,listing=3,missing=2,huge=1";  // load模式的请求比例
+bool keep_alive = true;      // load模式是否使用长连接
+int warmup_count = 1000;     // load模式正式计时前的预热请求数
+bool json_output = false;
+std::string work_dir;
+pid_t server_pid = -1;
+pid_t measured_pid = -1;  // 统计CPU时间的服务器进程
+
+double now_ms() {
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+// 生成测试用的网站根目录
+void create_root_dir() {
+    char dir_template[] = "/tmp/lan_http_bench_XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        throw std::runtime_error("mkdtemp failed");
+    }
+    work_dir = dir_template;
+
+    std::ofstream small(work_dir + "/small.txt", std::ios::binary);
+    small << std::string(1024, 's');
+    small.close();
+
+    std::ofstream medium(work_dir + "/medium.bin", std::ios::binary);
+    medium << std::string(static_cast<size_t>(medium_file_size), 'm');
+    medium.close();
+
+    std::ofstream big(work_dir + "/big.bin", std::ios::binary);
+    std::vector<char> block(1 << 20, 'b');
+    for (long long written = 0; written < big_file_size; written += static_cast<long long>(block.size())) {
+        big.write(block.data(), static_cast<std::streamsize>(std::min<long long>(block.size(), big_file_size - written)));
+    }
+    big.close();
+
+    // 文件很多的目录，测试目录列表
+    std::string dir = work_dir + "/dir";
+    mkdir(dir.c_str(), 0755);
+    for (int i = 0; i < dir_file_count; ++i) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/file_%05d.txt", i);
+        std::ofstream file(dir + name, std::ios::binary);
+        file << i;
+    }
+}
+
+void remove_root_dir() {
+    if (work_dir.empty()) return;
+    std::string cmd = "rm -rf '" + work_dir + "'";
+    int ignored = system(cmd.c_str());
+    (void)ignored;
+}
+
+// 取一个当前空闲的端口
+int pick_free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+// 连接目标服务器，rcvbuf>0时在连接前缩小接收缓冲区以模拟慢速客户端
+int connect_to_server(int rcvbuf = 0) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (rcvbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(target_port));
+    inet_pton(AF_INET, target_host.c_str(), &addr.sin_addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void set_timeout(int fd, int timeout_ms) {
+    timeval tv{};
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+std::string make_get(const std::string& path) {
+    return "GET " + path + " HTTP/1.1\r\nHost: " + target_host + "\r\nConnection: close\r\n\r\n";
+}
+
+// 发送一个请求并读到连接关闭，返回是否收到200响应
+bool fetch_once(const std::string& path, int timeout_ms) {
+    int fd = connect_to_server();
+    if (fd < 0) return false;
+    set_timeout(fd, timeout_ms);
+    std::string request = make_get(path);
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+        close(fd);
+        return false;
+    }
+    std::string response;
+    char buffer[16384];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, static_cast<size_t>(n));
+    }
+    close(fd);
+    return n == 0 && response.compare(0, 12, "HTTP/1.1 200") == 0;
+}
+
+// 在子进程中启动服务器，等待端口可连接
+void start_server() {
+    create_root_dir();
+    target_port = pick_free_port();
+
+    server_pid = fork();
+    if (server_pid == 0) {
+        // 访问日志和404的提示不输出，以免影响测量
+        if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) _exit(1);
+        ROOT_DIR = work_dir;
+        PORT = target_port;
+        _exit(run_server());
+    }
+
+    for (int i = 0; i < 200; ++i) {
+        int fd = connect_to_server();
+        if (fd >= 0) {
+            close(fd);
+            return;
+        }
+        usleep(10000);
+    }
+    throw std::runtime_error("server did not start");
+}
+
+void stop_server() {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, nullptr, 0);
+        server_pid = -1;
+    }
+    remove_root_dir();
+}
+
+// 读取进程累计的CPU时间（用户态+内核态，毫秒）
+double process_cpu_ms(pid_t pid) {
+    if (pid <= 0) return 0;
+    std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+    std::string content((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+    size_t pos = content.rfind(')');
+    if (pos == std::string::npos) return 0;
+    std::istringstream fields(content.substr(pos + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    // 跳过state之后的第3~13个字段，第14、15个字段为utime和stime
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) utime = std::stoull(field);
+        if (i == 15) stime = std::stoull(field);
+    }
+    return static_cast<double>(utime + stime) * 1000.0 / static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+// 下载一次完整文件，返回收到的字节数（含响应头），失败返回-1
+long long download_once(const std::string& path, int timeout_ms) {
+    int fd = connect_to_server();
+    if (fd < 0) return -1;
+    set_timeout(fd, timeout_ms);
+    std::string request = make_get(path);
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    static std::vector<char> buffer(1 << 20);
+    long long total = 0;
+    ssize_t n;
+    while ((n = recv(fd, buffer.data(), buffer.size(), 0)) > 0) total += n;
+    close(fd);
+    return n == 0 ? total : -1;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+// slow: 建立大量只读一点点数据的慢速下载，同时测量小文件请求是否还能及时完成
+void run_slow() {
+    std::vector<int> clients;
+    std::string request = make_get("/download/big.bin");
+    for (int i = 0; i < concurrency; ++i) {
+        int fd = connect_to_server(4096);
+        if (fd < 0) break;
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        clients.push_back(fd);
+    }
+    usleep(300 * 1000);
+
+    // 慢速下载进行中，测量新的小文件请求
+    std::vector<double> latencies;
+    int probe_ok = 0;
+    for (int i = 0; i < probe_count; ++i) {
+        double start = now_ms();
+        if (fetch_once("/small.txt", 2000)) {
+            probe_ok++;
+            latencies.push_back(now_ms() - start);
+        }
+    }
+
+    // 每个慢速客户端读一次，统计已经开始收到响应的连接数
+    int responding = 0;
+    char buffer[4096];
+    for (int fd : clients) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n >= 12 && std::memcmp(buffer, "HTTP/1.1 200", 12) == 0) responding++;
+    }
+    for (int fd : clients) close(fd);
+
+    std::printf("mode=slow slow_clients=%zu slow_responding=%d probes=%d probes_ok=%d "
+        "probe_p50_ms=%.3f probe_max_ms=%.3f\n",
+        clients.size(), responding, probe_count, probe_ok,
+        percentile(latencies, 0.5), percentile(latencies, 1.0));
+}
+
+// download: 反复下载大文件，统计服务器每GB消耗的CPU时间
+void run_download() {
+    double cpu_start = process_cpu_ms(measured_pid);
+    double start = now_ms();
+    long long bytes = 0;
+    int ok = 0;
+    for (int i = 0; i < probe_count; ++i) {
+        long long n = download_once("/download/big.bin", 10000);
+        if (n < 0) continue;
+        bytes += n;
+        ok++;
+    }
+    double elapsed = now_ms() - start;
+    double cpu = process_cpu_ms(measured_pid) - cpu_start;
+    double gb = static_cast<double>(bytes) / (1024.0 * 1024.0 * 1024.0);
+
+    std::printf("mode=download requests=%d ok=%d bytes=%lld elapsed_ms=%.1f throughput_mb_s=%.1f "
+        "server_cpu_ms=%.1f server_cpu_ms_per_gb=%.1f\n",
+        probe_count, ok, bytes, elapsed, bytes / 1048576.0 / (elapsed / 1000.0),
+        cpu, gb > 0 ? cpu / gb : 0.0);
+}
+
+// 在长连接上发送一个请求并读完响应，返回是否收到200；服务器要求关闭连接时close_after为true
+bool request_on(int fd, const std::string& request, bool& close_after) {
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) return false;
+    std::string response;
+    char buffer[16384];
+    size_t header_end = std::string::npos;
+    while (header_end == std::string::npos) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) return false;
+        response.append(buffer, static_cast<size_t>(n));
+        header_end = response.find("\r\n\r\n");
+    }
+    size_t length_pos = response.find("Content-Length: ");
+    if (length_pos == std::string::npos || length_pos > header_end) return false;
+    size_t total = header_end + 4 + std::stoul(response.substr(length_pos + 16));
+    while (response.size() < total) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) return false;
+        response.append(buffer, static_cast<size_t>(n));
+    }
+    close_after = response.find("Connection: close") < header_end;
+    return response.compare(0, 12, "HTTP/1.1 200") == 0;
+}
+
+// reqrate: -c个线程各用一个长连接连续请求small.txt，共-n个请求，统计每秒完成的请求数。
+// 服务器关闭连接（如阻塞模型每个请求后都会关闭）时重新连接
+void run_reqrate() {
+    std::atomic<int> next(0);
+    std::atomic<int> ok(0);
+    std::atomic<int> failed(0);
+    std::atomic<int> connects(0);
+    std::string request = "GET /small.txt HTTP/1.1\r\nHost: " + target_host + "\r\n\r\n";
+    std::vector<std::thread> clients;
+    double start = now_ms();
+    for (int i = 0; i < concurrency; ++i) {
+        clients.emplace_back([&] {
+            int fd = -1;
+            while (next.fetch_add(1) < probe_count) {
+                if (fd < 0) {
+                    fd = connect_to_server();
+                    if (fd < 0) {
+                        failed++;
+                        continue;
+                    }
+                    set_timeout(fd, 5000);
+                    connects++;
+                }
+                bool close_after = false;
+                if (request_on(fd, request, close_after)) {
+                    ok++;
+                }
+                else {
+                    failed++;
+                    close_after = true;
+                }
+                if (close_after) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            if (fd >= 0) close(fd);
+            });
+    }
+    for (std::thread& client : clients) client.join();
+    double elapsed = now_ms() - start;
+    std::printf("mode=reqrate clients=%d requests=%d ok=%d failed=%d connections=%d elapsed_ms=%.1f req_per_s=%.0f\n",
+        concurrency, probe_count, ok.load(), failed.load(), connects.load(), elapsed, ok.load() / (elapsed / 1000.0));
+}
+
+// load模式的请求类别
+struct RequestClass {
+    const char* name;
+    const char* path;
+    int expected_status;
+    int weight;
+};
+
+RequestClass request_classes[] = {
+    { "small", "/small.txt", 200, 0 },
+    { "medium", "/medium.bin", 200, 0 },
+    { "huge", "/download/big.bin", 200, 0 },
+    { "listing", "/dir/", 200, 0 },
+    { "missing", "/missing.txt", 404, 0 },
+};
+const int REQUEST_CLASS_COUNT = sizeof(request_classes) / sizeof(request_classes[0]);
+
+// 解析-mix，如 small=80,medium=14,listing=3,missing=2,huge=1
+void parse_request_mix(const std::string& mix) {
+    for (RequestClass& cls : request_classes) cls.weight = 0;
+    std::istringstream items(mix);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        int weight = eq == std::string::npos ? 1 : std::stoi(item.substr(eq + 1));
+        bool found = false;
+        for (RequestClass& cls : request_classes) {
+            if (name == cls.name) {
+                cls.weight = weight;
+                found = true;
+            }
+        }
+        if (!found || weight < 0) throw std::runtime_error("bad -mix entry: " + item);
+    }
+}
+
+// 从连接读入更多数据追加到pending，连接关闭或出错时返回false
+bool receive_more(int fd, std::string& pending) {
+    char buffer[65536];
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) return false;
+    pending.append(buffer, static_cast<size_t>(n));
+    return true;
+}
+
+// 丢弃count字节响应体，累计到received
+bool skip_body(int fd, std::string& pending, long long count, long long& received) {
+    received += count;
+    while (count > 0) {
+        if (pending.empty() && !receive_more(fd, pending)) return false;
+        size_t take = static_cast<size_t>(std::min<long long>(count, static_cast<long long>(pending.size())));
+        pending.erase(0, take);
+        count -= static_cast<long long>(take);
+    }
+    return true;
+}
+
+// 读完一个响应（Content-Length、chunked或读到连接关闭），pending中保留属于下一个响应的数据。
+// 返回状态码，失败返回0；服务器会关闭连接时close_after为true，body_bytes累计响应体字节数
+int read_response(int fd, std::string& pending, bool& close_after, long long& body_bytes) {
+    size_t header_end;
+    while ((header_end = pending.find("\r\n\r\n")) == std::string::npos) {
+        if (!receive_more(fd, pending)) return 0;
+    }
+    std::string head = pending.substr(0, header_end + 2);
+    pending.erase(0, header_end + 4);
+    if (head.compare(0, 9, "HTTP/1.1 ") != 0) return 0;
+    int status = std::atoi(head.c_str() + 9);
+    close_after = head.find("\r\nConnection: close\r\n") != std::string::npos;
+
+    size_t length_pos = head.find("\r\nContent-Length: ");
+    if (length_pos != std::string::npos) {
+        return skip_body(fd, pending, std::stoll(head.substr(length_pos + 18)), body_bytes) ? status : 0;
+    }
+    if (head.find("\r\nTransfer-Encoding: chunked\r\n") != std::string::npos) {
+        long long framing = 0;  // 分块之间的\r\n不算响应体
+        while (true) {
+            size_t line_end;
+            while ((line_end = pending.find("\r\n")) == std::string::npos) {
+                if (!receive_more(fd, pending)) return 0;
+            }
+            long long size = std::stoll(pending.substr(0, line_end), nullptr, 16);
+            pending.erase(0, line_end + 2);
+            if (size == 0) break;
+            if (!skip_body(fd, pending, size, body_bytes) || !skip_body(fd, pending, 2, framing)) return 0;
+        }
+        // 没有trailer，最后是一个空行
+        return skip_body(fd, pending, 2, framing) ? status : 0;
+    }
+    // 没有长度：读到连接关闭
+    do {
+        body_bytes += static_cast<long long>(pending.size());
+        pending.clear();
+    } while (receive_more(fd, pending));
+    close_after = true;
+    return status;
+}
+
+// 一个load客户端线程的结果
+struct LoadResult {
+    std::vector<double> latencies[REQUEST_CLASS_COUNT];  // 毫秒
+    int failed[REQUEST_CLASS_COUNT] = {};
+    int connects = 0;
+    long long body_bytes = 0;
+};
+
+// load客户端：按-mix比例随机选择请求（每个客户端的随机序列是固定的，结果可以复现），
+// 长连接被服务器关闭或关闭了长连接时重新连接
+void run_load_client(int index, std::atomic<int>& next, int total, LoadResult& result) {
+    int weight_sum = 0;
+    for (const RequestClass& cls : request_classes) weight_sum += cls.weight;
+    std::vector<std::string> requests;
+    for (const RequestClass& cls : request_classes) {
+        requests.push_back(std::string("GET ") + cls.path + " HTTP/1.1\r\nHost: " + target_host + "\r\n" +
+            (keep_alive ? "" : "Connection: close\r\n") + "\r\n");
+    }
+
+    uint32_t rng = static_cast<uint32_t>(index) * 2654435761u + 12345;
+    int fd = -1;
+    std::string pending;
+    while (next.fetch_add(1) < total) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        int pick = static_cast<int>(rng % static_cast<uint32_t>(weight_sum));
+        int cls = 0;
+        while (pick >= request_classes[cls].weight) pick -= request_classes[cls++].weight;
+
+        double start = now_ms();
+        if (fd < 0) {
+            fd = connect_to_server();
+            if (fd < 0) {
+                result.failed[cls]++;
+                continue;
+            }
+            set_timeout(fd, 10000);
+            result.connects++;
+            pending.clear();
+        }
+        const std::string& request = requests[cls];
+        bool close_after = true;
+        int status = 0;
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size())) {
+            status = read_response(fd, pending, close_after, result.body_bytes);
+        }
+        if (status == request_classes[cls].expected_status) {
+            result.latencies[cls].push_back(now_ms() - start);
+        }
+        else {
+            result.failed[cls]++;
+            close_after = true;
+        }
+        if (close_after || !keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) close(fd);
+}
+
+// load: -c个客户端按-mix的比例请求小文件、中等文件、大文件下载、大目录列表和不存在的文件，共-n个请求。
+// 输出吞吐量、延迟分位数和服务器每个请求消耗的CPU时间（key=value行，-json时输出一个JSON对象）
+void run_load() {
+    parse_request_mix(request_mix);
+    int weight_sum = 0;
+    for (const RequestClass& cls : request_classes) weight_sum += cls.weight;
+    if (weight_sum <= 0) throw std::runtime_error("-mix has no requests");
+
+    auto run_clients = [](int total, std::vector<LoadResult>& results) {
+        std::atomic<int> next(0);
+        std::vector<std::thread> clients;
+        results.assign(static_cast<size_t>(concurrency), LoadResult());
+        for (int i = 0; i < concurrency; ++i) {
+            clients.emplace_back([&, i] { run_load_client(i, next, total, results[static_cast<size_t>(i)]); });
+        }
+        for (std::thread& client : clients) client.join();
+    };
+
+    // 预热：填满服务器的文件和目录缓存
+    std::vector<LoadResult> results;
+    if (warmup_count > 0) run_clients(warmup_count, results);
+
+    double cpu_start = process_cpu_ms(measured_pid);
+    double start = now_ms();
+    run_clients(probe_count, results);
+    double elapsed = now_ms() - start;
+    double cpu = process_cpu_ms(measured_pid) - cpu_start;
+
+    // 合并各客户端的结果
+    LoadResult merged;
+    std::vector<double> all;
+    for (const LoadResult& result : results) {
+        merged.connects += result.connects;
+        merged.body_bytes += result.body_bytes;
+        for (int i = 0; i < REQUEST_CLASS_COUNT; ++i) {
+            merged.failed[i] += result.failed[i];
+            merged.latencies[i].insert(merged.latencies[i].end(), result.latencies[i].begin(), result.latencies[i].end());
+            all.insert(all.end(), result.latencies[i].begin(), result.latencies[i].end());
+        }
+    }
+    int ok = static_cast<int>(all.size());
+    int failed = 0;
+    for (int i = 0; i < REQUEST_CLASS_COUNT; ++i) failed += merged.failed[i];
+    long long bytes = merged.body_bytes;
+    double seconds = elapsed / 1000.0;
+    double cpu_us_per_request = ok > 0 ? cpu * 1000.0 / ok : 0.0;
+
+    if (json_output) {
+        std::printf("{\"mode\":\"load\",\"io\":\"%s\",\"clients\":%d,\"keepalive\":%s,\"mix\":\"%s\",\"requests\":%d,"
+            "\"ok\":%d,\"failed\":%d,\"connections\":%d,\"elapsed_ms\":%.1f,\"req_per_s\":%.0f,\"body_mb_per_s\":%.1f,"
+            "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f,\"server_cpu_ms\":%.1f,"
+            "\"server_cpu_us_per_req\":%.2f,\"classes\":{",
+            external_target ? "external" : IO_ENGINE.c_str(), concurrency, keep_alive ? "true" : "false",
+            request_mix.c_str(), probe_count, ok, failed, merged.connects, elapsed, ok / seconds,
+            bytes / 1048576.0 / seconds, percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999),
+            percentile(all, 1.0), cpu, cpu_us_per_request);
+        for (int i = 0; i < REQUEST_CLASS_COUNT; ++i) {
+            const std::vector<double>& values = merged.latencies[i];
+            std::printf("%s\"%s\":{\"ok\":%zu,\"failed\":%d,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f}",
+                i ? "," : "", request_classes[i].name, values.size(), merged.failed[i],
+                percentile(values, 0.5), percentile(values, 0.99), percentile(values, 0.999));
+        }
+        std::printf("}}\n");
+        return;
+    }
+
+    std::printf("mode=load io=%s clients=%d keepalive=%d mix=%s requests=%d ok=%d failed=%d connections=%d "
+        "elapsed_ms=%.1f req_per_s=%.0f body_mb_per_s=%.1f p50_ms=%.3f p99_ms=%.3f p999_ms=%.3f max_ms=%.3f "
+        "server_cpu_ms=%.1f server_cpu_us_per_req=%.2f\n",
+        external_target ? "external" : IO_ENGINE.c_str(), concurrency, keep_alive ? 1 : 0, request_mix.c_str(),
+        probe_count, ok, failed, merged.connects, elapsed, ok / seconds, bytes / 1048576.0 / seconds,
+        percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999), percentile(all, 1.0),
+        cpu, cpu_us_per_request);
+    for (int i = 0; i < REQUEST_CLASS_COUNT; ++i) {
+        const std::vector<double>& values = merged.latencies[i];
+        if (values.empty() && merged.failed[i] == 0) continue;
+        std::printf("mode=load class=%s ok=%zu failed=%d p50_ms=%.3f p99_ms=%.3f p999_ms=%.3f\n",
+            request_classes[i].name, values.size(), merged.failed[i],
+            percentile(values, 0.5), percentile(values, 0.99), percentile(values, 0.999));
+    }
+}
+
+// connrate: -c个线程各自不断新建连接，每个连接请求一次small.txt后关闭，统计每秒完成的连接数
+void run_connrate() {
+    std::atomic<int> next(0);
+    std::atomic<int> ok(0);
+    std::atomic<int> failed(0);
+    std::vector<std::thread> clients;
+    double start = now_ms();
+    for (int i = 0; i < concurrency; ++i) {
+        clients.emplace_back([&] {
+            while (next.fetch_add(1) < probe_count) {
+                if (fetch_once("/small.txt", 5000)) ok++;
+                else failed++;
+            }
+            });
+    }
+    for (std::thread& client : clients) client.join();
+    double elapsed = now_ms() - start;
+    std::printf("mode=connrate clients=%d connections=%d ok=%d failed=%d elapsed_ms=%.1f conn_per_s=%.0f\n",
+        concurrency, probe_count, ok.load(), failed.load(), elapsed, ok.load() / (elapsed / 1000.0));
+}
+
+// 原来的线程池：一个std::queue<std::function>加一把锁，作为pool模式的对照
+class MutexThreadPool {
+public:
+    MutexThreadPool(size_t threads) : stop(false) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this] {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(this->queue_mutex);
+                        this->condition.wait(lock, [this] {
+                            return this->stop || !this->tasks.empty();
+                            });
+                        if (this->stop && this->tasks.empty())
+                            return;
+                        task = std::move(this->tasks.front());
+                        this->tasks.pop();
+                    }
+                    task();
+                }
+                });
+        }
+    }
+
+    // 队列不限长度，总是成功
+    template<class F>
+    bool try_enqueue(F&& f, size_t) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            tasks.emplace(std::forward<F>(f));
+        }
+        condition.notify_one();
+        return true;
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for (std::thread& worker : workers) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop;
+};
+
+// 由一个线程（相当于事件循环）提交probe_count个任务，任务捕获一个与请求差不多大小的对象，
+// 返回从开始提交到全部执行完的每秒任务数
+template<class Pool>
+double measure_pool(Pool& pool, int tasks) {
+    std::atomic<int> done(0);
+    HttpRequest request;
+    request.method = "GET";
+    request.target = "/index.html";
+    request.version = "HTTP/1.1";
+    double start = now_ms();
+    for (int i = 0; i < tasks; ++i) {
+        // 注入队列满时等工作线程取走一些再提交
+        while (!pool.try_enqueue([&done, request] {
+            if (!request.target.empty()) done.fetch_add(1, std::memory_order_relaxed);
+            }, 0)) {
+            std::this_thread::yield();
+        }
+    }
+    while (done.load(std::memory_order_relaxed) < tasks) std::this_thread::yield();
+    return tasks / ((now_ms() - start) / 1000.0);
+}
+
+// pool: 比较工作窃取线程池与原来的互斥锁线程池的任务吞吐量
+void run_pool() {
+    size_t threads = worker_thread_count();
+    double mutex_rate, stealing_rate;
+    {
+        MutexThreadPool pool(threads);
+        measure_pool(pool, probe_count / 10 + 1);  // 预热
+        mutex_rate = measure_pool(pool, probe_count);
+    }
+    {
+        ThreadPool pool(threads);
+        measure_pool(pool, probe_count / 10 + 1);
+        stealing_rate = measure_pool(pool, probe_count);
+    }
+    std::printf("mode=pool threads=%zu tasks=%d mutex_pool_tasks_s=%.0f work_stealing_tasks_s=%.0f speedup=%.2f\n",
+        threads, probe_count, mutex_rate, stealing_rate, stealing_rate / mutex_rate);
+}
+
+// 改造前的响应头生成：ostringstream拼接，每次都用strftime格式化Date
+std::string legacy_response_head(const HttpResponse& response, int remaining_requests) {
+    std::ostringstream header;
+    header << "HTTP/1.1 " << response.status << "\r\n";
+    if (response.status.compare(0, 3, "304") != 0) {
+        header << "Content-Type: " << response.content_type << "\r\n";
+        if (response.chunked) {
+            header << "Transfer-Encoding: chunked\r\n";
+        }
+        else {
+            header << "Content-Length: " << response.content_length() << "\r\n";
+        }
+    }
+    if (remaining_requests > 0) {
+        header << "Connection: keep-alive\r\n";
+        header << "Keep-Alive: timeout=" << KEEP_ALIVE_TIMEOUT << ", max=" << remaining_requests << "\r\n";
+    }
+    else {
+        header << "Connection: close\r\n";
+    }
+    std::time_t now = std::time(nullptr);
+    std::tm gmt_tm = safe_gmtime(&now);
+    char date[80];
+    std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &gmt_tm);
+    header << "Date: " << date << "\r\n";
+    header << response.headers;
+    header << "\r\n";
+    return header.str();
+}
+
+// head: 生成-n次响应头，比较改造前后每次的耗时
+void run_head() {
+    HttpResponse response = make_response("200 OK", "text/html; charset=utf-8", std::string(1234, 'x'),
+        "Accept-Ranges: bytes\r\nETag: \"1c2b-4d2-65f0a3b1.0\"\r\nLast-Modified: Tue, 12 Mar 2024 18:25:53 GMT\r\n"
+        "Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n");
+    size_t checksum = 0;
+    double start = now_ms();
+    for (int i = 0; i < probe_count; ++i) {
+        checksum += legacy_response_head(response, 99 - i % 100).size();
+    }
+    double legacy_ns = (now_ms() - start) * 1e6 / probe_count;
+
+    std::string head;  // 和连接上的out_head一样复用容量
+    start = now_ms();
+    for (int i = 0; i < probe_count; ++i) {
+        build_response_head(response, 99 - i % 100, head);
+        checksum += head.size();
+    }
+    double current_ns = (now_ms() - start) * 1e6 / probe_count;
+    std::printf("mode=head iterations=%d ostringstream_ns=%.1f stack_buffer_ns=%.1f speedup=%.2f checksum=%zu\n",
+        probe_count, legacy_ns, current_ns, legacy_ns / current_ns, checksum);
+}
+
+// 改造前的MIME类型查找：复制并转小写扩展名，在std::map中查找，返回std::string
+std::string legacy_content_type(const std::string& extension) {
+    static const std::map<std::string, std::string> mime_types = {
+        {".html", "text/html"},
+        {".htm", "text/html"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".pdf", "application/pdf"},
+        {".zip", "application/zip"},
+        {".txt", "text/plain"},
+        {".json", "application/json"},
+        {".xml", "application/xml"},
+        {".ico", "image/x-icon"}
+    };
+
+    std::string ext = extension;
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+
+    auto it = mime_types.find(ext);
+    if (it != mime_types.end()) {
+        return it->second;
+    }
+
+    return "application/octet-stream";
+}
+
+// mime: 查找-n次MIME类型，比较改造前后每次的耗时和堆分配次数
+void run_mime() {
+    const std::string paths[] = { "/index.html", "/css/site.css", "/js/app.min.js", "/img/Logo.PNG", "/photos/IMG_0042.JPG",
+        "/fonts/inter.woff2", "/video/intro.mp4", "/app.wasm", "/icons/menu.svg", "/data/feed.json",
+        "/download/setup.exe", "/backup.tar.gz", "/README", "/notes.unknownext" };
+    const size_t path_count = sizeof(paths) / sizeof(paths[0]);
+    size_t checksum = 0;
+
+    // 两个版本都包含取扩展名，与route_request中的用法一致
+    unsigned long long allocations_before = allocation_count.load();
+    double start = now_ms();
+    for (int i = 0; i < probe_count; ++i) {
+        const std::string& path = paths[static_cast<size_t>(i) % path_count];
+        size_t dot = path.find_last_of('.');
+        std::string ext = dot == std::string::npos ? std::string() : path.substr(dot);
+        checksum += legacy_content_type(ext).size();
+    }
+    double legacy_ns = (now_ms() - start) * 1e6 / probe_count;
+    double legacy_allocs = static_cast<double>(allocation_count.load() - allocations_before) / probe_count;
+
+    allocations_before = allocation_count.load();
+    start = now_ms();
+    for (int i = 0; i < probe_count; ++i) {
+        checksum += get_content_type(get_extension(paths[static_cast<size_t>(i) % path_count])).size();
+    }
+    double current_ns = (now_ms() - start) * 1e6 / probe_count;
+    double current_allocs = static_cast<double>(allocation_count.load() - allocations_before) / probe_count;
+
+    std::printf("mode=mime iterations=%d types=%zu map_ns=%.1f perfect_hash_ns=%.1f speedup=%.2f "
+        "map_allocs_per_lookup=%.2f perfect_hash_allocs_per_lookup=%.2f checksum=%zu\n",
+        probe_count, MIME_TYPE_COUNT, legacy_ns, current_ns, legacy_ns / current_ns, legacy_allocs, current_allocs, checksum);
+}
+
+// 改造前的URL解码：每个%XX构造一个istringstream，之后再用三次find检查路径遍历
+bool legacy_url_decode(const std::string& str, std::string& bytes) {
+    bytes.clear();
+    bytes.reserve(str.size());
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] == '%') {
+            if (i + 2 < str.size()) {
+                int value = 0;
+                std::istringstream is(str.substr(i + 1, 2));
+                if (is >> std::hex >> value) {
+                    bytes += static_cast<char>(value);
+                    i += 2;
+                }
+                else {
+                    bytes += str[i];
+                }
+            }
+            else {
+                bytes += str[i];
+            }
+        }
+        else if (str[i] == '+') {
+            bytes += ' ';
+        }
+        else {
+            bytes += str[i];
+        }
+    }
+    return bytes.find("..") == std::string::npos && bytes.find("//") == std::string::npos &&
+        bytes.find("\\") == std::string::npos;
+}
+
+// 按浏览器的方式百分号编码路径（保留/和不需要编码的ASCII字符）
+std::string percent_encode_path(const std::string& path) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : path) {
+        if (std::isalnum(c) || c == '/' || c == '.' || c == '-' || c == '_' || c == '~') {
+            encoded += static_cast<char>(c);
+        }
+        else {
+            encoded += '%';
+            encoded += digits[c >> 4];
+            encoded += digits[c & 0x0F];
+        }
+    }
+    return encoded;
+}
+
+// urldecode: 解码并检查-n次请求路径（www/downloads中那样的长中文文件名），比较改造前后的耗时
+void run_urldecode() {
+    const std::string names[] = {
+        "/download/downloads/中文测试.txt",
+        "/downloads/2024年度局域网文件共享项目总结报告（最终修订版）-附件一：会议纪要与参会人员名单.docx",
+        "/downloads/照片/2023年春节家庭聚会/IMG_20230122_183045_全家福_高清原图.jpg",
+        "/downloads/学习资料/计算机网络：自顶向下方法（原书第7版）/第三章 运输层 课后习题答案.pdf",
+        "/static/js/vendors~main.8f3a2b1c4d5e6f7a8b9c0d1e2f3a4b5c.chunk.min.js",
+    };
+    std::vector<std::string> targets;
+    for (const std::string& name : names) targets.push_back(percent_encode_path(name));
+    targets.push_back(names[1]);  // 有的客户端直接发送UTF-8字节
+    size_t target_bytes = 0;
+    for (const std::string& target : targets) target_bytes += target.size();
+    const size_t target_count = targets.size();
+
+    std::string decoded;
+    size_t checksum = 0;
+    unsigned long long allocations_before = allocation_count.load();
+    double start = now_ms();
+    for (int i = 0; i < probe_count; ++i) {
+        if (legacy_url_decode(targets[static_cast<size_t>(i) % target_count], decoded)) checksum += decoded.size();
+    }
+    double legacy_ns = (now_ms() - start) * 1e6 / probe_count;
+    double legacy_allocs = static_cast<double>(allocation_count.load() - allocations_before) / probe_count;
+
+    allocations_before = allocation_count.load();
+    start = now_ms();
+    for (int i = 0; i < probe_count; ++i) {
+        if (url_decode(targets[static_cast<size_t>(i) % target_count], decoded) == UrlStatus::Ok) checksum += decoded.size();
+    }
+    double current_ns = (now_ms() - start) * 1e6 / probe_count;
+    double current_allocs = static_cast<double>(allocation_count.load() - allocations_before) / probe_count;
+
+#if defined(LAN_HTTP_URL_SIMD)
+    int block = LAN_HTTP_URL_SIMD;
+#else
+    int block = 0;
+#endif
+    std::printf("mode=urldecode iterations=%d avg_target_bytes=%zu simd_block=%d istringstream_ns=%.1f simd_ns=%.1f "
+        "speedup=%.2f istringstream_allocs=%.2f simd_allocs=%.2f checksum=%zu\n",
+        probe_count, target_bytes / target_count, block, legacy_ns, current_ns, legacy_ns / current_ns,
+        legacy_allocs, current_allocs, checksum);
+}
+
+// engines: 依次用阻塞、epoll、io_uring三种引擎启动服务器，各跑一遍connrate、reqrate和download
+void run_engines() {
+    int requests = probe_count;
+    for (const char* engine : { "blocking", "epoll", "uring" }) {
+        IO_ENGINE = engine;
+        std::printf("io=%s\n", engine);
+        std::fflush(stdout);
+        start_server();
+        measured_pid = server_pid;
+        probe_count = requests;
+        run_connrate();
+        run_reqrate();
+        probe_count = download_count;
+        run_download();
+        stop_server();
+        std::fflush(stdout);
+    }
+}
+
+// check模式的结果
+int check_passed = 0;
+int check_failed = 0;
+
+// 记录一项检查，失败时输出说明
+void expect(bool ok, const std::string& what) {
+    if (ok) {
+        check_passed++;
+        return;
+    }
+    check_failed++;
+    std::printf("FAIL io=%s %s\n", IO_ENGINE.c_str(), what.c_str());
+}
+
+// 发送原始请求并读到连接关闭，返回收到的全部数据。
+// 服务器可能没读完请求就回复错误并关闭，发送失败时仍然读取已经到达的响应
+std::string exchange(const std::string& request) {
+    int fd = connect_to_server();
+    if (fd < 0) return std::string();
+    set_timeout(fd, 5000);
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += static_cast<size_t>(n);
+    }
+    std::string response;
+    char buffer[16384];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, static_cast<size_t>(n));
+    }
+    close(fd);
+    return response;
+}
+
+// 带额外请求头的GET，headers每行以\r\n结尾
+std::string make_get_with(const std::string& path, const std::string& headers) {
+    return "GET " + path + " HTTP/1.1\r\nHost: " + target_host + "\r\n" + headers + "Connection: close\r\n\r\n";
+}
+
+// 响应的状态码，不是HTTP响应时返回0
+int status_of(const std::string& response) {
+    if (response.compare(0, 9, "HTTP/1.1 ") != 0 || response.size() < 12) return 0;
+    int status = 0;
+    std::from_chars(response.data() + 9, response.data() + 12, status);
+    return status;
+}
+
+// 响应头的值（不区分大小写），没有时为空
+std::string header_of(const std::string& response, std::string_view name) {
+    std::string_view head(response);
+    head = head.substr(0, head.find("\r\n\r\n"));
+    while (!head.empty()) {
+        size_t end = head.find("\r\n");
+        std::string_view line = head.substr(0, end);
+        size_t colon = line.find(':');
+        if (colon != std::string_view::npos && equals_ignore_case(line.substr(0, colon), name)) {
+            line.remove_prefix(colon + 1);
+            while (!line.empty() && line.front() == ' ') line.remove_prefix(1);
+            return std::string(line);
+        }
+        if (end == std::string_view::npos) break;
+        head.remove_prefix(end + 2);
+    }
+    return std::string();
+}
+
+std::string body_of(const std::string& response) {
+    size_t end = response.find("\r\n\r\n");
+    return end == std::string::npos ? std::string() : response.substr(end + 4);
+}
+
+// 解析请求行和请求头的上限：414、431和400
+void check_parser_limits() {
+    std::string tail = " HTTP/1.1\r\nHost: " + target_host + "\r\nConnection: close\r\n\r\n";
+    std::string at_limit = "GET /" + std::string(MAX_REQUEST_LINE_SIZE - 14, 'a') + tail;
+    int status = status_of(exchange(at_limit));
+    expect(status != 0 && status != 414, "request line at the limit is accepted, got " + std::to_string(status));
+    std::string over_limit = "GET /" + std::string(MAX_REQUEST_LINE_SIZE - 13, 'a') + tail;
+    status = status_of(exchange(over_limit));
+    expect(status == 414, "request line over the limit gets 414, got " + std::to_string(status));
+    // 没有换行也不能无限等下去
+    status = status_of(exchange("GET /" + std::string(MAX_REQUEST_LINE_SIZE, 'a')));
+    expect(status == 414, "unterminated long request line gets 414, got " + std::to_string(status));
+
+    status = status_of(exchange(make_get_with("/small.txt",
+        "X-Big: " + std::string(MAX_REQUEST_HEADER_SIZE, 'x') + "\r\n")));
+    expect(status == 431, "oversized header block gets 431, got " + std::to_string(status));
+    std::string headers;
+    for (size_t i = 0; i + 2 < MAX_HEADER_COUNT; ++i) headers += "X-H" + std::to_string(i) + ": 1\r\n";
+    status = status_of(exchange(make_get_with("/small.txt", headers)));
+    expect(status == 200, "MAX_HEADER_COUNT headers are accepted, got " + std::to_string(status));
+    headers += "X-Extra: 1\r\n";
+    status = status_of(exchange(make_get_with("/small.txt", headers)));
+    expect(status == 431, "one header too many gets 431, got " + std::to_string(status));
+
+    status = status_of(exchange("GARBAGE\r\n\r\n"));
+    expect(status == 400, "malformed request line gets 400, got " + std::to_string(status));
+}
+
+// Range：单个区间、后缀、multipart/byteranges、416，以及按没有Range处理的情况
+void check_ranges(const std::string& content) {
+    std::string total = "/" + std::to_string(content.size());
+    auto single = [&](const std::string& range, long long first, long long last) {
+        std::string response = exchange(make_get_with("/range.bin", "Range: " + range + "\r\n"));
+        std::string expected = content.substr(static_cast<size_t>(first), static_cast<size_t>(last - first + 1));
+        expect(status_of(response) == 206 &&
+            header_of(response, "Content-Range") == "bytes " + std::to_string(first) + "-" + std::to_string(last) + total &&
+            body_of(response) == expected, "Range " + range + " returns bytes " + std::to_string(first) + "-" +
+            std::to_string(last));
+    };
+    single("bytes=10-19", 10, 19);
+    single("bytes=-5", static_cast<long long>(content.size()) - 5, static_cast<long long>(content.size()) - 1);
+    single("bytes=990-", 990, static_cast<long long>(content.size()) - 1);
+    single("bytes=100-99999", 100, static_cast<long long>(content.size()) - 1);
+
+    // 两个区间：逐段检查Content-Range和数据，最后是结束分隔符
+    std::string response = exchange(make_get_with("/range.bin", "Range: bytes=0-4, 20-29\r\n"));
+    std::string type = header_of(response, "Content-Type");
+    size_t at = type.find("boundary=");
+    std::string body = body_of(response);
+    bool ok = status_of(response) == 206 && type.compare(0, 21, "multipart/byteranges;") == 0 &&
+        at != std::string::npos && header_of(response, "Content-Length") == std::to_string(body.size());
+    if (ok) {
+        std::string delimiter = "--" + type.substr(at + 9);
+        const long long parts[2][2] = { { 0, 4 }, { 20, 29 } };
+        size_t pos = 0;
+        for (const auto& part : parts) {
+            pos = body.find(delimiter + "\r\n", pos);
+            size_t data = pos == std::string::npos ? pos : body.find("\r\n\r\n", pos);
+            if (data == std::string::npos) {
+                ok = false;
+                break;
+            }
+            std::string part_head = body.substr(pos, data - pos);
+            std::string range = "Content-Range: bytes " + std::to_string(part[0]) + "-" + std::to_string(part[1]) + total;
+            size_t length = static_cast<size_t>(part[1] - part[0] + 1);
+            ok = ok && part_head.find(range) != std::string::npos &&
+                body.compare(data + 4, length, content, static_cast<size_t>(part[0]), length) == 0;
+            pos = data + 4 + length;
+        }
+        ok = ok && body.compare(pos, std::string::npos, "\r\n" + delimiter + "--\r\n") == 0;
+    }
+    expect(ok, "Range bytes=0-4, 20-29 returns a two-part multipart/byteranges body");
+
+    response = exchange(make_get_with("/range.bin", "Range: bytes=5000-\r\n"));
+    expect(status_of(response) == 416 && header_of(response, "Content-Range") == "bytes *" + total,
+        "unsatisfiable Range gets 416 with bytes */size");
+    std::string too_many = "bytes=";
+    for (size_t i = 0; i <= MAX_BYTE_RANGES; ++i) too_many += (i ? "," : "") + std::to_string(i * 2) + "-" + std::to_string(i * 2);
+    for (const std::string& ignored : { std::string("bytes=abc"), std::string("bytes=5-1"), std::string("items=0-1"),
+        std::string("bytes=99999999999999999999-"), too_many }) {
+        response = exchange(make_get_with("/range.bin", "Range: " + ignored + "\r\n"));
+        expect(status_of(response) == 200 && body_of(response) == content,
+            "Range " + ignored.substr(0, 40) + " is ignored and the whole file is sent");
+    }
+}
+
+// 条件请求：If-None-Match优先于If-Modified-Since，304不带响应体
+void check_conditional() {
+    std::string response = exchange(make_get_with("/range.bin", ""));
+    std::string etag = header_of(response, "ETag");
+    std::string last_modified = header_of(response, "Last-Modified");
+    expect(status_of(response) == 200 && !etag.empty() && !last_modified.empty(),
+        "a file response carries ETag and Last-Modified");
+
+    auto conditional = [&](const std::string& path, const std::string& headers, int expected, const std::string& what) {
+        std::string reply = exchange(make_get_with(path, headers));
+        int status = status_of(reply);
+        bool ok = status == expected;
+        if (expected == 304) ok = ok && body_of(reply).empty() && header_of(reply, "ETag") == etag;
+        expect(ok, what + " gets " + std::to_string(expected) + ", got " + std::to_string(status));
+    };
+    conditional("/range.bin", "If-None-Match: " + etag + "\r\n", 304, "matching If-None-Match");
+    conditional("/range.bin", "If-None-Match: \"other\", W/" + etag + "\r\n", 304, "weak tag in an If-None-Match list");
+    conditional("/range.bin", "If-None-Match: *\r\n", 304, "If-None-Match: *");
+    conditional("/range.bin", "If-None-Match: \"other\"\r\n", 200, "mismatched If-None-Match");
+    conditional("/range.bin", "If-Modified-Since: " + last_modified + "\r\n", 304, "If-Modified-Since at mtime");
+    conditional("/range.bin", "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", 200, "older If-Modified-Since");
+    conditional("/range.bin", "If-Modified-Since: yesterday\r\n", 200, "malformed If-Modified-Since");
+    conditional("/range.bin", "If-None-Match: \"other\"\r\nIf-Modified-Since: " + last_modified + "\r\n", 200,
+        "mismatched If-None-Match with a matching If-Modified-Since");
+    conditional("/download/range.bin", "If-None-Match: " + etag + "\r\n", 304, "If-None-Match on /download/");
+}
+
+#if defined(LAN_HTTP_USE_ZLIB)
+// Accept-Encoding协商：gzip和x-gzip不区分大小写，q=0（各种写法）表示拒绝，*匹配gzip
+void check_accept_encoding() {
+    const std::pair<const char*, bool> cases[] = {
+        { "gzip", true }, { "X-GZIP", true }, { " gzip ;q=1", true }, { "deflate, gzip;q=0.5", true },
+        { "gzip;q=0.001", true }, { "br;q=1, *;q=0.1", true }, { "*;q=0, gzip", true },
+        { "gzip;q=0", false }, { "gzip; q=0.000", false }, { "gzip;Q=0.", false }, { "gzip;level=1;q=0", false },
+        { "gzip;q=0, *", false }, { "*;q=0", false }, { "identity", false },
+    };
+    for (const auto& item : cases) {
+        std::string response = exchange(make_get_with("/small.txt", std::string("Accept-Encoding: ") + item.first + "\r\n"));
+        bool gzip = header_of(response, "Content-Encoding") == "gzip";
+        expect(status_of(response) == 200 && gzip == item.second,
+            std::string("Accept-Encoding: ") + item.first + (item.second ? " gets gzip" : " gets identity"));
+    }
+}
+#endif
+
+// check: 依次用三种引擎启动服务器，检查解析上限（414/431）、Range/multipart和304，有失败时返回非0
+int run_check() {
+    // 检查用不到大文件和大目录，缩小生成的网站根目录
+    big_file_size = 1024 * 1024;
+    dir_file_count = 4;
+    std::string content;
+    for (int i = 0; i < 1000; ++i) content += static_cast<char>('a' + i % 26);
+    for (const char* engine : { "blocking", "epoll", "uring" }) {
+        IO_ENGINE = engine;
+        int failed_before = check_failed;
+        start_server();
+        std::ofstream(work_dir + "/range.bin", std::ios::binary) << content;
+        check_parser_limits();
+        check_ranges(content);
+        check_conditional();
+#if defined(LAN_HTTP_USE_ZLIB)
+        check_accept_encoding();
+#endif
+        stop_server();
+        std::printf("io=%s failed=%d\n", engine, check_failed - failed_before);
+        std::fflush(stdout);
+    }
+    std::printf("mode=check passed=%d failed=%d\n", check_passed, check_failed);
+    return check_failed == 0 ? 0 : 1;
+}
+
+void print_usage() {
+    std::cout << "Usage: lan_http_bench [options] <mode>\n";
+    std::cout << "Modes:\n";
+    std::cout << "  slow               Many slow downloads in flight + small-file probes\n";
+    std::cout << "  download           Download big.bin -n times, report server CPU per GB\n";
+    std::cout << "  connrate           -c threads open -n short connections (one small.txt each), report connections/s\n";
+    std::cout << "  reqrate            -c keep-alive clients send -n small.txt requests in total, report requests/s\n";
+    std::cout << "  engines            connrate, reqrate and download against the blocking, epoll and io_uring engines\n";
+    std::cout << "  load               -c clients send -n requests picked by -mix, report req/s, p50/p99/p999 and server CPU per request\n";
+    std::cout << "  head               Time to build a response header, old ostringstream version vs now (-n iterations)\n";
+    std::cout << "  pool               Task throughput of the work-stealing pool vs the old mutex pool (-n tasks)\n";
+    std::cout << "  mime               Time and heap allocations per MIME lookup, old std::map version vs perfect hash (-n iterations)\n";
+    std::cout << "  check              Self-check of the blocking, epoll and io_uring engines: 414/431 limits, Range/multipart, 304, gzip negotiation (zlib builds); exits 1 on failure\n";
+    std::cout << "  urldecode          Time to decode and check long percent-encoded Chinese paths, old istringstream version vs SIMD (-n iterations)\n";
+    std::cout << "Options:\n";
+    std::cout << "  -target <h:port>   Benchmark a running server (its root must contain small.txt, big.bin)\n";
+    std::cout << "  -c <n>             Number of concurrent clients (default: 512)\n";
+    std::cout << "  -n <n>             Number of probe/download requests (default: 20)\n";
+    std::cout << "  -pid <pid>         Server process to measure CPU of when using -target\n";
+    std::cout << "  -size <MB>         Size of generated big.bin (default: 16)\n";
+    std::cout << "  -listeners <n>     SO_REUSEPORT listeners of the started server, 0 = one per core (default: 1)\n";
+    std::cout << "  -threads <n>       Worker threads for the pool / started server (default: CPU cores, min 2)\n";
+    std::cout << "  -io <engine>       I/O engine of the started server: epoll, uring or blocking (default: epoll)\n";
+    std::cout << "  -downloads <n>     Downloads per engine in engines mode (default: 20)\n";
+    std::cout << "  -mix <list>        Request mix of load mode (default: small=80,medium=14,listing=3,missing=2,huge=1)\n";
+    std::cout << "  -keepalive <0|1>   Keep-alive connections in load mode (default: 1)\n";
+    std::cout << "  -warmup <n>        Untimed requests before load mode measures (default: 1000)\n";
+    std::cout << "  -medium <KB>       Size of generated medium.bin (default: 128)\n";
+    std::cout << "  -dirfiles <n>      Files in the generated dir/ listing (default: 2000)\n";
+    std::cout << "  -json              Print load mode results as one JSON object\n";
+}
+
+} // namespace bench
+
+int main(int argc, char* argv[]) {
+    using namespace bench;
+    std::string mode;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-target" && i + 1 < argc) {
+            std::string value = argv[++i];
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos) {
+                print_usage();
+                return 1;
+            }
+            target_host = value.substr(0, colon);
+            target_port = std::stoi(value.substr(colon + 1));
+            external_target = true;
+        }
+        else if (arg == "-c" && i + 1 < argc) {
+            concurrency = std::stoi(argv[++i]);
+        }
+        else if (arg == "-n" && i + 1 < argc) {
+            probe_count = std::stoi(argv[++i]);
+        }
+        else if (arg == "-pid" && i + 1 < argc) {
+            measured_pid = static_cast<pid_t>(std::stoi(argv[++i]));
+        }
+        else if (arg == "-listeners" && i + 1 < argc) {
+            LISTENER_COUNT = std::stoi(argv[++i]);
+        }
+        else if (arg == "-threads" && i + 1 < argc) {
+            THREAD_POOL_SIZE = std::stoi(argv[++i]);
+        }
+        else if (arg == "-io" && i + 1 < argc) {
+            IO_ENGINE = argv[++i];
+        }
+        else if (arg == "-downloads" && i + 1 < argc) {
+            download_count = std::stoi(argv[++i]);
+        }
+        else if (arg == "-size" && i + 1 < argc) {
+            big_file_size = std::stoll(argv[++i]) * 1024 * 1024;
+        }
+        else if (arg == "-medium" && i + 1 < argc) {
+            medium_file_size = std::stoll(argv[++i]) * 1024;
+        }
+        else if (arg == "-dirfiles" && i + 1 < argc) {
+            dir_file_count = std::stoi(argv[++i]);
+        }
+        else if (arg == "-mix" && i + 1 < argc) {
+            request_mix = argv[++i];
+        }
+        else if (arg == "-keepalive" && i + 1 < argc) {
+            keep_alive = std::stoi(argv[++i]) != 0;
+        }
+        else if (arg == "-warmup" && i + 1 < argc) {
+            warmup_count = std::stoi(argv[++i]);
+        }
+        else if (arg == "-json") {
+            json_output = true;
+        }
+        else if (arg == "-h" || arg == "--help") {
+            print_usage();
+            return 0;
+        }
+        else {
+            mode = arg;
+        }
+    }
+
+    if (mode == "pool") {
+        run_pool();
+        return 0;
+    }
+    if (mode == "head") {
+        run_head();
+        return 0;
+    }
+    if (mode == "mime") {
+        run_mime();
+        return 0;
+    }
+    if (mode == "urldecode") {
+        run_urldecode();
+        return 0;
+    }
+    if (mode != "slow" && mode != "download" && mode != "connrate" && mode != "reqrate" && mode != "engines" &&
+        mode != "load" && mode != "check") {
+        print_usage();
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    try {
+        if (mode == "engines") {
+            if (external_target) throw std::runtime_error("engines mode starts its own servers");
+            run_engines();
+            return 0;
+        }
+        if (mode == "check") {
+            if (external_target) throw std::runtime_error("check mode starts its own servers");
+            return run_check();
+        }
+        if (!external_target) {
+            start_server();
+            measured_pid = server_pid;
+        }
+        if (mode == "slow") run_slow();
+        else if (mode == "connrate") run_connrate();
+        else if (mode == "reqrate") run_reqrate();
+        else if (mode == "load") run_load();
+        else run_download();
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        stop_server();
+        return 1;
+    }
+    stop_server();
+    return 0;
+}